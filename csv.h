@@ -0,0 +1,207 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <charconv>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "matrix.h"
+
+using namespace std;
+
+// Read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+    MappedFile(const string &filename)
+    {
+        fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            cerr << "Could not open " << filename << endl;
+            exit(1);
+        }
+
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0)
+        {
+            cerr << "Could not stat " << filename << endl;
+            exit(1);
+        }
+        length = file_stat.st_size;
+
+        // mmap rejects empty mappings, an empty file is just an empty range
+        if (length > 0)
+        {
+            data = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED)
+            {
+                cerr << "Could not map " << filename << endl;
+                exit(1);
+            }
+            madvise(data, length, MADV_SEQUENTIAL);
+        }
+    }
+
+    ~MappedFile()
+    {
+        if (data)
+        {
+            munmap(data, length);
+        }
+        close(fd);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *begin() const
+    {
+        return static_cast<const char *>(data);
+    }
+
+    const char *end() const
+    {
+        return begin() + length;
+    }
+
+private:
+    int fd = -1;
+    void *data = nullptr;
+    size_t length = 0;
+};
+
+// Parses the cells of the line [p, line_end) in place into out[0 ... cols - 1]
+// Cells that are not numbers become 0 (like atof), a line with a different number of cells is an error
+template <typename T>
+void csv_parse_line(const char *p, const char *line_end, T *out, int cols, int line_number)
+{
+    int j = 0;
+    while (true)
+    {
+        const char *cell_end = static_cast<const char *>(memchr(p, ',', line_end - p));
+        if (!cell_end)
+        {
+            cell_end = line_end;
+        }
+        if (j >= cols)
+        {
+            cerr << "CSV line " << line_number << " has more than " << cols << " columns" << endl;
+            exit(1);
+        }
+
+        // from_chars does not skip leading whitespace or a '+' sign
+        const char *start = p;
+        while (start < cell_end && (*start == ' ' || *start == '\t' || *start == '"'))
+        {
+            start++;
+        }
+        if (start < cell_end && *start == '+')
+        {
+            start++;
+        }
+        T value = 0;
+        if (from_chars(start, cell_end, value).ec != errc())
+        {
+            value = 0;
+        }
+        out[j++] = value;
+
+        if (cell_end == line_end)
+        {
+            break;
+        }
+        p = cell_end + 1;
+    }
+
+    if (j != cols)
+    {
+        cerr << "CSV line " << line_number << " has " << j << " columns, expected " << cols << endl;
+        exit(1);
+    }
+}
+
+// Calls line(p, cells_end, line_number) for every non-blank line [p, cells_end) of a mapped CSV (without the '\r' of Windows line endings)
+// The first line is skipped when has_header is set (the datasets in this repo start with column names)
+inline void csv_for_each_line(const MappedFile &file, bool has_header, function<void(const char *, const char *, int)> line)
+{
+    const char *p = file.begin();
+    const char *end = file.end();
+    int line_number = 1;
+    while (p < end)
+    {
+        const char *line_end = static_cast<const char *>(memchr(p, '\n', end - p));
+        line_end = line_end ? line_end : end;
+        const char *cells_end = (line_end > p && line_end[-1] == '\r') ? line_end - 1 : line_end;
+        if (cells_end > p && !(has_header && line_number == 1))
+        {
+            line(p, cells_end, line_number);
+        }
+        p = line_end < end ? line_end + 1 : end;
+        line_number++;
+    }
+}
+
+// Calls body(values, rows, cols) for consecutive blocks of at most chunk_rows rows of a numeric CSV
+// The file is memory-mapped and parsed in place, only one block of chunk_rows * cols values is held at a time
+template <typename T>
+void for_each_csv_chunk(const string &filename, int chunk_rows, function<void(const T *values, int rows, int cols)> body, bool has_header = true)
+{
+    MappedFile file(filename);
+    chunk_rows = max(1, chunk_rows);
+    vector<T> chunk;
+    int cols = 0;
+    int rows_in_chunk = 0;
+
+    csv_for_each_line(file, has_header, [&](const char *p, const char *cells_end, int line_number) {
+        // The first data line sets the number of columns
+        if (cols == 0)
+        {
+            cols = count(p, cells_end, ',') + 1;
+            chunk.resize((size_t)chunk_rows * cols);
+        }
+        csv_parse_line(p, cells_end, chunk.data() + (size_t)rows_in_chunk * cols, cols, line_number);
+        if (++rows_in_chunk == chunk_rows)
+        {
+            body(chunk.data(), rows_in_chunk, cols);
+            rows_in_chunk = 0;
+        }
+    });
+
+    if (rows_in_chunk > 0)
+    {
+        body(chunk.data(), rows_in_chunk, cols);
+    }
+}
+
+// Loads a numeric CSV into a single row-major Matrix
+// The lines are counted first so the buffer is allocated once and the values are parsed straight into it
+template <typename T>
+Matrix<T> load_csv(const string &filename, bool has_header = true)
+{
+    MappedFile file(filename);
+    vector<T> values;
+    int rows = 0;
+    int cols = 0;
+
+    csv_for_each_line(file, has_header, [&](const char *p, const char *cells_end, int line_number) {
+        if (cols == 0)
+        {
+            // Upper bound on the number of rows, blank lines are counted too
+            cols = count(p, cells_end, ',') + 1;
+            size_t max_rows = count(p, file.end(), '\n') + 1;
+            values.resize(max_rows * cols);
+        }
+        csv_parse_line(p, cells_end, values.data() + (size_t)rows * cols, cols, line_number);
+        rows++;
+    });
+
+    values.resize((size_t)rows * cols);
+    return Matrix<T>(rows, cols, move(values));
+}
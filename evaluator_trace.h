@@ -0,0 +1,536 @@
+#pragma once
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include "seal/seal.h"
+#include "seal/util/common.h"
+#include "seal/util/uintarith.h"
+#include "seal/util/uintarithsmallmod.h"
+
+using namespace std;
+using namespace seal;
+
+// Number of calls and total wall time of one operation at one call site
+struct TraceCounter
+{
+    long count = 0;
+    double total_us = 0;
+};
+
+// One traced operation with the chain index and scale of its result
+struct TraceEvent
+{
+    string site;
+    string operation;
+    double time_us;
+    int chain_index;
+    double log2_scale;
+};
+
+// Process wide record of the operations of every TracedEvaluator
+// Off by default: a disabled trace costs one relaxed atomic load per operation and per TraceScope
+class EvaluatorTrace
+{
+public:
+    // With keep_events every operation is also logged with its chain index and scale, otherwise only the counters are kept
+    static void enable(bool keep_events = false)
+    {
+        lock_guard<mutex> lock(trace_mutex);
+        events_enabled = keep_events;
+        active.store(true, memory_order_relaxed);
+    }
+
+    // Enables the trace if the environment variable is set ("events" also keeps every operation)
+    static bool enable_from_env(const char *variable = "HE_TRACE")
+    {
+        const char *value = getenv(variable);
+        if (!value || string(value).empty() || string(value) == "0")
+        {
+            return false;
+        }
+        enable(string(value) == "events");
+        return true;
+    }
+
+    static void disable()
+    {
+        active.store(false, memory_order_relaxed);
+    }
+
+    static bool enabled()
+    {
+        return active.load(memory_order_relaxed);
+    }
+
+    static void reset()
+    {
+        lock_guard<mutex> lock(trace_mutex);
+        counters.clear();
+        events.clear();
+    }
+
+    // Adds count operations that took time_us in total at the call site of the current thread
+    static void record(const char *operation, int count, double time_us, int chain_index, double scale)
+    {
+        lock_guard<mutex> lock(trace_mutex);
+        TraceCounter &counter = counters[make_pair(site(), string(operation))];
+        counter.count += count;
+        counter.total_us += time_us;
+        if (events_enabled)
+        {
+            events.push_back({site(), operation, time_us, chain_index, log2(scale)});
+        }
+    }
+
+    // Counters keyed by (call site, operation)
+    static map<pair<string, string>, TraceCounter> get_counters()
+    {
+        lock_guard<mutex> lock(trace_mutex);
+        return counters;
+    }
+
+    static vector<TraceEvent> get_events()
+    {
+        lock_guard<mutex> lock(trace_mutex);
+        return events;
+    }
+
+    // Call site of the current thread, the TraceScope names from the outermost to the innermost joined by '/'
+    static const string &current_site()
+    {
+        return site();
+    }
+
+    // Per call site table of the operation counts and times, followed by the totals of every operation
+    // Key switches are the rotations plus the relinearizations
+    static void print_summary(ostream &out = cout)
+    {
+        map<pair<string, string>, TraceCounter> snapshot = get_counters();
+        map<string, TraceCounter> totals;
+
+        ios old_fmt(nullptr);
+        old_fmt.copyfmt(out);
+        out << fixed << setprecision(1);
+        out << "\nHE TRACE:" << endl;
+        string last_site;
+        bool first = true;
+        for (auto &entry : snapshot)
+        {
+            const string &entry_site = entry.first.first;
+            if (first || entry_site != last_site)
+            {
+                out << "| " << (entry_site.empty() ? "(top level)" : entry_site) << endl;
+                last_site = entry_site;
+                first = false;
+            }
+            print_counter(out, entry.first.second, entry.second);
+
+            TraceCounter &total = totals[entry.first.second];
+            total.count += entry.second.count;
+            total.total_us += entry.second.total_us;
+        }
+
+        out << "| TOTAL" << endl;
+        TraceCounter key_switches;
+        for (auto &entry : totals)
+        {
+            print_counter(out, entry.first, entry.second);
+            if (entry.first == "rotate" || entry.first == "relinearize")
+            {
+                key_switches.count += entry.second.count;
+                key_switches.total_us += entry.second.total_us;
+            }
+        }
+        print_counter(out, "(key switches)", key_switches);
+        out.copyfmt(old_fmt);
+    }
+
+    static void write_events_csv(ostream &out)
+    {
+        out << "site,operation,time_us,chain_index,log2_scale" << endl;
+        for (const TraceEvent &event : get_events())
+        {
+            out << event.site << "," << event.operation << "," << event.time_us << "," << event.chain_index << "," << event.log2_scale << endl;
+        }
+    }
+
+    // Prints the summary and, if events were kept, writes them to events_path
+    static void report(const string &events_path = "he_trace_events.csv")
+    {
+        print_summary();
+        if (events_enabled)
+        {
+            ofstream out(events_path);
+            if (!out)
+            {
+                cerr << "Couldn't open file: " << events_path << endl;
+                return;
+            }
+            write_events_csv(out);
+            cout << "Trace events written to " << events_path << endl;
+        }
+    }
+
+private:
+    friend class TraceScope;
+
+    static inline atomic<bool> active{false};
+    static inline bool events_enabled = false;
+    static inline mutex trace_mutex;
+    static inline map<pair<string, string>, TraceCounter> counters;
+    static inline vector<TraceEvent> events;
+
+    static string &site()
+    {
+        thread_local string current_site;
+        return current_site;
+    }
+
+    static void print_counter(ostream &out, const string &operation, const TraceCounter &counter)
+    {
+        out << "|\t" << left << setw(20) << operation << right << setw(10) << counter.count << " ops" << setw(14) << counter.total_us / 1000 << " ms"
+            << setw(12) << (counter.count ? counter.total_us / counter.count : 0) << " us/op" << endl;
+    }
+};
+
+// Names the call site of the operations of the current thread until the end of the enclosing block
+// Nested scopes are joined, e.g. update_weights_packed/predict_cipher_weights_packed/evaluate_polynomial
+class TraceScope
+{
+public:
+    explicit TraceScope(const char *name)
+    {
+        if (EvaluatorTrace::enabled())
+        {
+            string &site = EvaluatorTrace::site();
+            previous_site = site;
+            site += site.empty() ? name : string("/") + name;
+            active = true;
+        }
+    }
+
+    // Sets the call site of the current thread, used by worker threads to inherit the site of the thread that started them
+    TraceScope(const string &site_path, bool inherit)
+    {
+        if (inherit && EvaluatorTrace::enabled())
+        {
+            string &site = EvaluatorTrace::site();
+            previous_site = site;
+            site = site_path;
+            active = true;
+        }
+    }
+
+    ~TraceScope()
+    {
+        if (active)
+        {
+            EvaluatorTrace::site() = previous_site;
+        }
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+    bool active = false;
+    string previous_site;
+};
+
+// Evaluator that records the operations it runs in EvaluatorTrace
+// The methods hide the Evaluator ones with the same signatures, so code has to hold a TracedEvaluator (not an Evaluator &) to be traced.
+// Operations that are not wrapped here are inherited unchanged and not traced
+class TracedEvaluator : public Evaluator
+{
+public:
+    TracedEvaluator(const SEALContext &context) : Evaluator(context), context(context)
+    {
+    }
+
+    using Evaluator::add;
+    using Evaluator::add_inplace;
+    using Evaluator::add_many;
+    using Evaluator::add_plain;
+    using Evaluator::add_plain_inplace;
+    using Evaluator::mod_switch_to;
+    using Evaluator::mod_switch_to_inplace;
+    using Evaluator::mod_switch_to_next;
+    using Evaluator::mod_switch_to_next_inplace;
+    using Evaluator::multiply;
+    using Evaluator::multiply_inplace;
+    using Evaluator::multiply_plain;
+    using Evaluator::multiply_plain_inplace;
+    using Evaluator::negate_inplace;
+    using Evaluator::relinearize;
+    using Evaluator::relinearize_inplace;
+    using Evaluator::rescale_to_next;
+    using Evaluator::rescale_to_next_inplace;
+    using Evaluator::rotate_vector;
+    using Evaluator::rotate_vector_inplace;
+    using Evaluator::square;
+    using Evaluator::square_inplace;
+    using Evaluator::sub;
+    using Evaluator::sub_inplace;
+
+    void negate_inplace(Ciphertext &encrypted) const
+    {
+        traced("negate", 1, encrypted, [&]() { Evaluator::negate_inplace(encrypted); });
+    }
+
+    void add_inplace(Ciphertext &encrypted1, const Ciphertext &encrypted2) const
+    {
+        traced("add", 1, encrypted1, [&]() { Evaluator::add_inplace(encrypted1, encrypted2); });
+    }
+
+    void add(const Ciphertext &encrypted1, const Ciphertext &encrypted2, Ciphertext &destination) const
+    {
+        traced("add", 1, destination, [&]() { Evaluator::add(encrypted1, encrypted2, destination); });
+    }
+
+    void add_many(const vector<Ciphertext> &encrypteds, Ciphertext &destination) const
+    {
+        traced("add", max(0, (int)encrypteds.size() - 1), destination, [&]() { Evaluator::add_many(encrypteds, destination); });
+    }
+
+    void sub_inplace(Ciphertext &encrypted1, const Ciphertext &encrypted2) const
+    {
+        traced("sub", 1, encrypted1, [&]() { Evaluator::sub_inplace(encrypted1, encrypted2); });
+    }
+
+    void sub(const Ciphertext &encrypted1, const Ciphertext &encrypted2, Ciphertext &destination) const
+    {
+        traced("sub", 1, destination, [&]() { Evaluator::sub(encrypted1, encrypted2, destination); });
+    }
+
+    void add_plain_inplace(Ciphertext &encrypted, const Plaintext &plain) const
+    {
+        traced("add_plain", 1, encrypted, [&]() { Evaluator::add_plain_inplace(encrypted, plain); });
+    }
+
+    void add_plain(const Ciphertext &encrypted, const Plaintext &plain, Ciphertext &destination) const
+    {
+        traced("add_plain", 1, destination, [&]() { Evaluator::add_plain(encrypted, plain, destination); });
+    }
+
+    void multiply_inplace(Ciphertext &encrypted1, const Ciphertext &encrypted2, MemoryPoolHandle pool = MemoryManager::GetPool()) const
+    {
+        traced("multiply", 1, encrypted1, [&]() { Evaluator::multiply_inplace(encrypted1, encrypted2, pool); });
+    }
+
+    void multiply(const Ciphertext &encrypted1, const Ciphertext &encrypted2, Ciphertext &destination, MemoryPoolHandle pool = MemoryManager::GetPool()) const
+    {
+        traced("multiply", 1, destination, [&]() { Evaluator::multiply(encrypted1, encrypted2, destination, pool); });
+    }
+
+    void square_inplace(Ciphertext &encrypted, MemoryPoolHandle pool = MemoryManager::GetPool()) const
+    {
+        traced("multiply", 1, encrypted, [&]() { Evaluator::square_inplace(encrypted, pool); });
+    }
+
+    void square(const Ciphertext &encrypted, Ciphertext &destination, MemoryPoolHandle pool = MemoryManager::GetPool()) const
+    {
+        traced("multiply", 1, destination, [&]() { Evaluator::square(encrypted, destination, pool); });
+    }
+
+    void multiply_plain_inplace(Ciphertext &encrypted, const Plaintext &plain, MemoryPoolHandle pool = MemoryManager::GetPool()) const
+    {
+        traced("multiply_plain", 1, encrypted, [&]() { Evaluator::multiply_plain_inplace(encrypted, plain, pool); });
+    }
+
+    void multiply_plain(const Ciphertext &encrypted, const Plaintext &plain, Ciphertext &destination, MemoryPoolHandle pool = MemoryManager::GetPool()) const
+    {
+        traced("multiply_plain", 1, destination, [&]() { Evaluator::multiply_plain(encrypted, plain, destination, pool); });
+    }
+
+    void relinearize_inplace(Ciphertext &encrypted, const RelinKeys &relin_keys, MemoryPoolHandle pool = MemoryManager::GetPool()) const
+    {
+        traced("relinearize", 1, encrypted, [&]() { Evaluator::relinearize_inplace(encrypted, relin_keys, pool); });
+    }
+
+    void relinearize(const Ciphertext &encrypted, const RelinKeys &relin_keys, Ciphertext &destination, MemoryPoolHandle pool = MemoryManager::GetPool()) const
+    {
+        traced("relinearize", 1, destination, [&]() { Evaluator::relinearize(encrypted, relin_keys, destination, pool); });
+    }
+
+    void rescale_to_next_inplace(Ciphertext &encrypted, MemoryPoolHandle pool = MemoryManager::GetPool()) const
+    {
+        traced("rescale", 1, encrypted, [&]() { Evaluator::rescale_to_next_inplace(encrypted, pool); });
+    }
+
+    void rescale_to_next(const Ciphertext &encrypted, Ciphertext &destination, MemoryPoolHandle pool = MemoryManager::GetPool()) const
+    {
+        traced("rescale", 1, destination, [&]() { Evaluator::rescale_to_next(encrypted, destination, pool); });
+    }
+
+    void mod_switch_to_next_inplace(Ciphertext &encrypted, MemoryPoolHandle pool = MemoryManager::GetPool()) const
+    {
+        traced("mod_switch", 1, encrypted, [&]() { Evaluator::mod_switch_to_next_inplace(encrypted, pool); });
+    }
+
+    void mod_switch_to_next(const Ciphertext &encrypted, Ciphertext &destination, MemoryPoolHandle pool = MemoryManager::GetPool()) const
+    {
+        traced("mod_switch", 1, destination, [&]() { Evaluator::mod_switch_to_next(encrypted, destination, pool); });
+    }
+
+    void mod_switch_to_inplace(Ciphertext &encrypted, parms_id_type parms_id, MemoryPoolHandle pool = MemoryManager::GetPool()) const
+    {
+        traced("mod_switch", 1, encrypted, [&]() { Evaluator::mod_switch_to_inplace(encrypted, parms_id, pool); });
+    }
+
+    void mod_switch_to(const Ciphertext &encrypted, parms_id_type parms_id, Ciphertext &destination, MemoryPoolHandle pool = MemoryManager::GetPool()) const
+    {
+        traced("mod_switch", 1, destination, [&]() { Evaluator::mod_switch_to(encrypted, parms_id, destination, pool); });
+    }
+
+    void mod_switch_to_inplace(Plaintext &plain, parms_id_type parms_id) const
+    {
+        traced("mod_switch_plain", 1, plain, [&]() { Evaluator::mod_switch_to_inplace(plain, parms_id); });
+    }
+
+    void mod_switch_to(const Plaintext &plain, parms_id_type parms_id, Plaintext &destination) const
+    {
+        traced("mod_switch_plain", 1, destination, [&]() { Evaluator::mod_switch_to(plain, parms_id, destination); });
+    }
+
+    void rotate_vector_inplace(Ciphertext &encrypted, int steps, const GaloisKeys &galois_keys, MemoryPoolHandle pool = MemoryManager::GetPool()) const
+    {
+        traced("rotate", 1, encrypted, [&]() { Evaluator::rotate_vector_inplace(encrypted, steps, galois_keys, pool); });
+    }
+
+    void rotate_vector(const Ciphertext &encrypted, int steps, const GaloisKeys &galois_keys, Ciphertext &destination, MemoryPoolHandle pool = MemoryManager::GetPool()) const
+    {
+        traced("rotate", 1, destination, [&]() { Evaluator::rotate_vector(encrypted, steps, galois_keys, destination, pool); });
+    }
+
+    // accumulator += encrypted * plain in one pass over the accumulator, without a temporary product ciphertext
+    // An empty accumulator is set to the product. Operands that can't be fused (not in NTT form, different levels) fall back to multiply_plain and add_inplace
+    void multiply_plain_accumulate(const Ciphertext &encrypted, const Plaintext &plain, Ciphertext &accumulator) const
+    {
+        traced("multiply_plain_acc", 1, accumulator, [&]() {
+            if (accumulator.size() == 0)
+            {
+                Evaluator::multiply_plain(encrypted, plain, accumulator);
+                return;
+            }
+            if (!can_fuse(encrypted, accumulator, encrypted.size(), encrypted.scale() * plain.scale()) || !plain.is_ntt_form() || plain.parms_id() != encrypted.parms_id())
+            {
+                Ciphertext product;
+                Evaluator::multiply_plain(encrypted, plain, product);
+                Evaluator::add_inplace(accumulator, product);
+                return;
+            }
+
+            const vector<Modulus> &coeff_modulus = context.get_context_data(encrypted.parms_id())->parms().coeff_modulus();
+            size_t N = encrypted.poly_modulus_degree();
+            for (size_t j = 0; j < encrypted.size(); j++)
+            {
+                for (size_t i = 0; i < coeff_modulus.size(); i++)
+                {
+                    const Modulus &q = coeff_modulus[i];
+                    const uint64_t *a = encrypted.data(j) + i * N;
+                    const uint64_t *p = plain.data() + i * N;
+                    uint64_t *acc = accumulator.data(j) + i * N;
+                    for (size_t k = 0; k < N; k++)
+                    {
+                        acc[k] = util::add_uint_mod(acc[k], util::multiply_uint_mod(a[k], p[k], q), q);
+                    }
+                }
+            }
+        });
+    }
+
+    // accumulator += encrypted1 * encrypted2 without relinearization (the accumulator has size 3), in one pass over the accumulator
+    // The cross term a0 * b1 + a1 * b0 is reduced once from 128 bits. Relinearize and rescale the accumulator once after the last term.
+    // An empty accumulator is set to the product, operands that can't be fused fall back to multiply and add_inplace
+    void multiply_accumulate(const Ciphertext &encrypted1, const Ciphertext &encrypted2, Ciphertext &accumulator) const
+    {
+        traced("multiply_acc", 1, accumulator, [&]() {
+            if (accumulator.size() == 0)
+            {
+                Evaluator::multiply(encrypted1, encrypted2, accumulator);
+                return;
+            }
+            if (encrypted1.size() != 2 || encrypted2.size() != 2 || !encrypted2.is_ntt_form() || encrypted2.parms_id() != encrypted1.parms_id() ||
+                !can_fuse(encrypted1, accumulator, 3, encrypted1.scale() * encrypted2.scale()))
+            {
+                Ciphertext product;
+                Evaluator::multiply(encrypted1, encrypted2, product);
+                Evaluator::add_inplace(accumulator, product);
+                return;
+            }
+
+            const vector<Modulus> &coeff_modulus = context.get_context_data(encrypted1.parms_id())->parms().coeff_modulus();
+            size_t N = encrypted1.poly_modulus_degree();
+            for (size_t i = 0; i < coeff_modulus.size(); i++)
+            {
+                const Modulus &q = coeff_modulus[i];
+                const uint64_t *a0 = encrypted1.data(0) + i * N;
+                const uint64_t *a1 = encrypted1.data(1) + i * N;
+                const uint64_t *b0 = encrypted2.data(0) + i * N;
+                const uint64_t *b1 = encrypted2.data(1) + i * N;
+                uint64_t *acc0 = accumulator.data(0) + i * N;
+                uint64_t *acc1 = accumulator.data(1) + i * N;
+                uint64_t *acc2 = accumulator.data(2) + i * N;
+                for (size_t k = 0; k < N; k++)
+                {
+                    acc0[k] = util::add_uint_mod(acc0[k], util::multiply_uint_mod(a0[k], b0[k], q), q);
+                    acc2[k] = util::add_uint_mod(acc2[k], util::multiply_uint_mod(a1[k], b1[k], q), q);
+
+                    // The primes have at most 60 bits, so the sum of the two 120 bit products can't overflow
+                    unsigned long long cross[2];
+                    unsigned long long product[2];
+                    util::multiply_uint64(a0[k], b1[k], cross);
+                    util::multiply_uint64(a1[k], b0[k], product);
+                    cross[0] += product[0];
+                    cross[1] += product[1] + (cross[0] < product[0]);
+                    acc1[k] = util::add_uint_mod(acc1[k], util::barrett_reduce_128(cross, q), q);
+                }
+            }
+        });
+    }
+
+private:
+    SEALContext context;
+
+    // Whether product (size polynomials at the level of encrypted, with the given scale) can be added into accumulator coefficient by coefficient
+    bool can_fuse(const Ciphertext &encrypted, const Ciphertext &accumulator, size_t size, double scale) const
+    {
+        if (!encrypted.is_ntt_form() || !accumulator.is_ntt_form() || accumulator.parms_id() != encrypted.parms_id() || accumulator.size() != size)
+        {
+            return false;
+        }
+        if (!util::are_close<double>(accumulator.scale(), scale))
+        {
+            throw invalid_argument("scale mismatch");
+        }
+        return true;
+    }
+
+    // Runs body, and if the trace is on records its time with the chain index and scale of result (a Ciphertext or a Plaintext)
+    template <typename T, typename F>
+    void traced(const char *operation, int count, const T &result, F &&body) const
+    {
+        if (!EvaluatorTrace::enabled())
+        {
+            body();
+            return;
+        }
+
+        auto start = chrono::steady_clock::now();
+        body();
+        auto stop = chrono::steady_clock::now();
+
+        auto context_data = context.get_context_data(result.parms_id());
+        int chain_index = context_data ? context_data->chain_index() : -1;
+        EvaluatorTrace::record(operation, count, chrono::duration<double, micro>(stop - start).count(), chain_index, result.scale());
+    }
+};
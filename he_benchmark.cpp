@@ -0,0 +1,663 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include "seal/seal.h"
+#include "helper.h"
+#include "logistic_regression_ckks.h"
+
+using namespace std;
+using namespace seal;
+
+// Unified benchmark harness
+// Every (poly_modulus_degree, dimension, operation) of the sweep is run warmup times untimed, then repetitions times timed.
+// The median, p95, min and mean are written as JSON and / or CSV so that runs of different builds can be diffed
+
+// Timings of one (operation, poly_modulus_degree, dimension) point of the sweep
+// Dimension is 0 for the operations on a full slot vector that don't depend on it
+struct BenchmarkResult
+{
+    string operation;
+    size_t poly_modulus_degree = 0;
+    int dimension = 0;
+    int repetitions = 0;
+    double median_us = 0;
+    double p95_us = 0;
+    double min_us = 0;
+    double mean_us = 0;
+    // "ok", or the reason the point was skipped (dimension too large, modulus chain too short, ...)
+    string status = "ok";
+};
+
+// An operation the harness can time
+// steps returns the rotations it needs, setup prepares its inputs (untimed) and returns the body that is timed
+struct BenchmarkOperation
+{
+    string name;
+    bool uses_dimension;
+    function<bool(int dimension, int slot_count)> fits;
+    function<vector<int>(int dimension, FHESession &session)> steps;
+    function<function<void()>(int dimension, FHESession &session)> setup;
+};
+
+struct BenchmarkOptions
+{
+    vector<size_t> poly_modulus_degrees = {8192, 16384};
+    vector<int> dimensions = {4, 8, 16};
+    vector<string> operations;
+    int warmup = 2;
+    int repetitions = 10;
+    int sigmoid_degree = 3;
+    string json_path;
+    string csv_path;
+};
+
+// Runs body warmup times, then repetitions times and fills the statistics of result (in microseconds)
+void measure(int warmup, int repetitions, const function<void()> &body, BenchmarkResult &result)
+{
+    for (int i = 0; i < warmup; i++)
+    {
+        body();
+    }
+
+    vector<double> times(repetitions);
+    for (int i = 0; i < repetitions; i++)
+    {
+        auto start = chrono::high_resolution_clock::now();
+        body();
+        auto stop = chrono::high_resolution_clock::now();
+        times[i] = chrono::duration<double, micro>(stop - start).count();
+    }
+
+    sort(times.begin(), times.end());
+    result.repetitions = repetitions;
+    result.min_us = times[0];
+    result.median_us = repetitions % 2 ? times[repetitions / 2] : (times[repetitions / 2 - 1] + times[repetitions / 2]) / 2;
+    // Nearest rank percentile
+    result.p95_us = times[(int)ceil(0.95 * repetitions) - 1];
+    double sum = 0;
+    for (double t : times)
+    {
+        sum += t;
+    }
+    result.mean_us = sum / repetitions;
+}
+
+// Vector of size values in [0, 1)
+vector<double> random_vector(int size)
+{
+    vector<double> vec(size);
+    for (int i = 0; i < size; i++)
+    {
+        vec[i] = (double)rand() / RAND_MAX;
+    }
+    return vec;
+}
+
+Ciphertext encrypt_vector(const vector<double> &vec, FHESession &session)
+{
+    Plaintext pt;
+    session.ckks_encoder.encode(vec, session.scale, pt);
+    Ciphertext ct;
+    session.encryptor.encrypt(pt, ct);
+    return ct;
+}
+
+// Encoded diagonals of a random dimension x dimension matrix
+vector<Plaintext> random_matrix_diagonals(int dimension, FHESession &session)
+{
+    Matrix<double> U(dimension, dimension);
+    for (int i = 0; i < dimension; i++)
+    {
+        for (int j = 0; j < dimension; j++)
+        {
+            U(i, j) = (double)rand() / RAND_MAX;
+        }
+    }
+
+    Matrix<double> U_diagonals = get_all_diagonals(U);
+    vector<Plaintext> U_diagonals_pt(dimension);
+    for (int l = 0; l < dimension; l++)
+    {
+        session.ckks_encoder.encode(U_diagonals.row(l), session.scale, U_diagonals_pt[l]);
+    }
+    return U_diagonals_pt;
+}
+
+// Every operation of the harness, in the order they are run
+vector<BenchmarkOperation> get_benchmark_operations(DiagonalCache &diagonal_cache, int sigmoid_degree)
+{
+    auto any_size = [](int dimension, int slot_count) { return true; };
+    auto no_steps = [](int dimension, FHESession &session) { return vector<int>(); };
+    // Vector of dimension values duplicated by the linear transformations
+    auto fits_vector = [](int dimension, int slot_count) { return 2 * dimension <= slot_count; };
+    // Flattened dimension x dimension matrix duplicated by the linear transformations
+    auto fits_matrix = [](int dimension, int slot_count) { return 2 * dimension * dimension <= slot_count; };
+
+    vector<BenchmarkOperation> operations;
+
+    operations.push_back({"encode", false, any_size, no_steps, [](int dimension, FHESession &session) {
+                              vector<double> vec = random_vector(session.ckks_encoder.slot_count());
+                              return function<void()>([vec, &session]() {
+                                  Plaintext pt;
+                                  session.ckks_encoder.encode(vec, session.scale, pt);
+                              });
+                          }});
+
+    operations.push_back({"encrypt", false, any_size, no_steps, [](int dimension, FHESession &session) {
+                              Plaintext pt;
+                              session.ckks_encoder.encode(random_vector(session.ckks_encoder.slot_count()), session.scale, pt);
+                              return function<void()>([pt, &session]() {
+                                  Ciphertext ct;
+                                  session.encryptor.encrypt(pt, ct);
+                              });
+                          }});
+
+    operations.push_back({"decrypt", false, any_size, no_steps, [](int dimension, FHESession &session) {
+                              Ciphertext ct = encrypt_vector(random_vector(session.ckks_encoder.slot_count()), session);
+                              return function<void()>([ct, &session]() {
+                                  Plaintext pt;
+                                  session.decryptor.decrypt(ct, pt);
+                              });
+                          }});
+
+    operations.push_back({"decode", false, any_size, no_steps, [](int dimension, FHESession &session) {
+                              Plaintext pt;
+                              session.ckks_encoder.encode(random_vector(session.ckks_encoder.slot_count()), session.scale, pt);
+                              return function<void()>([pt, &session]() {
+                                  vector<double> vec;
+                                  session.ckks_encoder.decode(pt, vec);
+                              });
+                          }});
+
+    operations.push_back({"add", false, any_size, no_steps, [](int dimension, FHESession &session) {
+                              Ciphertext ctA = encrypt_vector(random_vector(session.ckks_encoder.slot_count()), session);
+                              Ciphertext ctB = encrypt_vector(random_vector(session.ckks_encoder.slot_count()), session);
+                              return function<void()>([ctA, ctB, &session]() {
+                                  Ciphertext ct;
+                                  session.evaluator.add(ctA, ctB, ct);
+                              });
+                          }});
+
+    operations.push_back({"add_plain", false, any_size, no_steps, [](int dimension, FHESession &session) {
+                              Ciphertext ct = encrypt_vector(random_vector(session.ckks_encoder.slot_count()), session);
+                              Plaintext pt;
+                              session.ckks_encoder.encode(random_vector(session.ckks_encoder.slot_count()), session.scale, pt);
+                              return function<void()>([ct, pt, &session]() {
+                                  Ciphertext result;
+                                  session.evaluator.add_plain(ct, pt, result);
+                              });
+                          }});
+
+    operations.push_back({"multiply_plain", false, any_size, no_steps, [](int dimension, FHESession &session) {
+                              Ciphertext ct = encrypt_vector(random_vector(session.ckks_encoder.slot_count()), session);
+                              Plaintext pt;
+                              session.ckks_encoder.encode(random_vector(session.ckks_encoder.slot_count()), session.scale, pt);
+                              return function<void()>([ct, pt, &session]() {
+                                  Ciphertext result;
+                                  session.evaluator.multiply_plain(ct, pt, result);
+                              });
+                          }});
+
+    // Ciphertext multiplication followed by relinearization
+    operations.push_back({"multiply", false, any_size, no_steps, [](int dimension, FHESession &session) {
+                              Ciphertext ctA = encrypt_vector(random_vector(session.ckks_encoder.slot_count()), session);
+                              Ciphertext ctB = encrypt_vector(random_vector(session.ckks_encoder.slot_count()), session);
+                              return function<void()>([ctA, ctB, &session]() {
+                                  Ciphertext ct;
+                                  session.evaluator.multiply(ctA, ctB, ct);
+                                  session.evaluator.relinearize_inplace(ct, session.relin_keys);
+                              });
+                          }});
+
+    operations.push_back({"rescale", false, any_size, no_steps, [](int dimension, FHESession &session) {
+                              Ciphertext ct = encrypt_vector(random_vector(session.ckks_encoder.slot_count()), session);
+                              session.evaluator.square_inplace(ct);
+                              session.evaluator.relinearize_inplace(ct, session.relin_keys);
+                              return function<void()>([ct, &session]() {
+                                  Ciphertext result;
+                                  session.evaluator.rescale_to_next(ct, result);
+                              });
+                          }});
+
+    operations.push_back({"rotate", false, any_size, [](int dimension, FHESession &session) { return vector<int>{1}; }, [](int dimension, FHESession &session) {
+                              Ciphertext ct = encrypt_vector(random_vector(session.ckks_encoder.slot_count()), session);
+                              return function<void()>([ct, &session]() {
+                                  Ciphertext result;
+                                  session.evaluator.rotate_vector(ct, 1, session.gal_keys, result);
+                              });
+                          }});
+
+    // Plaintext dimension x dimension matrix times ciphertext vector
+    operations.push_back({"linear_transform", true, fits_vector, [](int dimension, FHESession &session) { return get_linear_transform_steps(dimension); }, [](int dimension, FHESession &session) {
+                              vector<Plaintext> U_diagonals = random_matrix_diagonals(dimension, session);
+                              Ciphertext ct = encrypt_vector(random_vector(dimension), session);
+                              return function<void()>([U_diagonals, ct, &session]() {
+                                  Linear_Transform_Plain(ct, U_diagonals, session);
+                              });
+                          }});
+
+    operations.push_back({"linear_transform_bsgs", true, fits_vector, [](int dimension, FHESession &session) { return get_bsgs_steps(dimension); }, [](int dimension, FHESession &session) {
+                              vector<Plaintext> U_diagonals = get_bsgs_plain_diagonals(random_matrix_diagonals(dimension, session), session.ckks_encoder);
+                              Ciphertext ct = encrypt_vector(random_vector(dimension), session);
+                              return function<void()>([U_diagonals, ct, &session]() {
+                                  Linear_Transform_Plain_BSGS(ct, U_diagonals, session);
+                              });
+                          }});
+
+    // Ciphertext-ciphertext dimension x dimension matrix multiplication
+    operations.push_back({"matmul", true, fits_matrix, [&diagonal_cache](int dimension, FHESession &session) { return get_matmul_steps(diagonal_cache.get(dimension, session)); }, [&diagonal_cache](int dimension, FHESession &session) {
+                              const MatMulDiagonals &diagonals = diagonal_cache.get(dimension, session);
+                              Ciphertext ctA = encrypt_vector(random_vector(dimension * dimension), session);
+                              Ciphertext ctB = encrypt_vector(random_vector(dimension * dimension), session);
+                              return function<void()>([&diagonals, ctA, ctB, dimension, &session]() {
+                                  CC_Matrix_Multiplication(ctA, ctB, dimension, diagonals, session);
+                              });
+                          }});
+
+    // As many independent dimension x dimension products as one ciphertext holds, multiplied at once
+    operations.push_back({"matmul_batch", true, fits_matrix, [&diagonal_cache](int dimension, FHESession &session) { return get_matmul_steps(diagonal_cache.get(dimension, session)); }, [&diagonal_cache](int dimension, FHESession &session) {
+                              const MatMulDiagonals &diagonals = diagonal_cache.get(dimension, session);
+                              vector<Matrix<double>> A(get_matmul_batch_capacity(dimension, session.ckks_encoder.slot_count()));
+                              vector<Matrix<double>> B(A.size());
+                              for (int b = 0; b < A.size(); b++)
+                              {
+                                  A[b] = Matrix<double>(dimension, dimension, random_vector(dimension * dimension));
+                                  B[b] = Matrix<double>(dimension, dimension, random_vector(dimension * dimension));
+                              }
+                              Ciphertext ctA = encrypt_matrix_batch(A, session);
+                              Ciphertext ctB = encrypt_matrix_batch(B, session);
+                              return function<void()>([&diagonals, ctA, ctB, dimension, &session]() {
+                                  CC_Matrix_Multiplication(ctA, ctB, dimension, diagonals, session);
+                              });
+                          }});
+
+    operations.push_back({"transpose", true, fits_matrix, [](int dimension, FHESession &session) { return get_sparse_diagonal_steps(get_sparse_diagonals(get_U_transpose_diagonals(dimension), session.ckks_encoder, session.scale)); }, [](int dimension, FHESession &session) {
+                              SparseDiagonals U_transpose = get_sparse_diagonals(get_U_transpose_diagonals(dimension), session.ckks_encoder, session.scale);
+                              Ciphertext ct = encrypt_vector(random_vector(dimension * dimension), session);
+                              return function<void()>([U_transpose, ct, &session]() {
+                                  Linear_Transform_Plain_Sparse(ct, U_transpose, session);
+                              });
+                          }});
+
+    operations.push_back({"dot_product", true, fits_vector, [](int dimension, FHESession &session) { return get_dot_product_steps(dimension); }, [](int dimension, FHESession &session) {
+                              Ciphertext ctA = encrypt_vector(random_vector(dimension), session);
+                              Ciphertext ctB = encrypt_vector(random_vector(dimension), session);
+                              return function<void()>([ctA, ctB, dimension, &session]() {
+                                  cipher_dot_product(ctA, ctB, dimension, session.relin_keys, session.gal_keys, session.evaluator);
+                              });
+                          }});
+
+    // Sigmoid approximation of degree sigmoid_degree
+    operations.push_back({"polynomial", false, any_size, no_steps, [sigmoid_degree](int dimension, FHESession &session) {
+                              Ciphertext ct = encrypt_vector(random_vector(session.ckks_encoder.slot_count()), session);
+                              vector<double> coeffs = get_sigmoid_coeffs(sigmoid_degree);
+                              return function<void()>([ct, coeffs, &session]() {
+                                  evaluate_polynomial(ct, coeffs, session);
+                              });
+                          }});
+
+    // One packed gradient descent step over a full batch of random observations with dimension features
+    operations.push_back({"lr_iteration", true, [](int dimension, int slot_count) { return get_packed_batch_size(slot_count, get_packed_width(dimension)) > 0; }, [](int dimension, FHESession &session) { return get_packed_steps(session.ckks_encoder.slot_count(), get_packed_width(dimension)); }, [sigmoid_degree](int dimension, FHESession &session) {
+                              int slot_count = session.ckks_encoder.slot_count();
+                              int width = get_packed_width(dimension);
+                              int batch_size = get_packed_batch_size(slot_count, width);
+
+                              Matrix<double> features(batch_size, dimension);
+                              vector<double> labels(batch_size);
+                              for (int i = 0; i < batch_size; i++)
+                              {
+                                  for (int j = 0; j < dimension; j++)
+                                  {
+                                      features(i, j) = 2.0 * rand() / RAND_MAX - 1;
+                                  }
+                                  labels[i] = rand() % 2;
+                              }
+
+                              vector<vector<Ciphertext>> features_diagonals = {encrypt_rows(get_packed_diagonals(features, 0, batch_size, width), session)};
+                              vector<vector<Ciphertext>> features_T_diagonals = {encrypt_rows(get_packed_T_diagonals(features, 0, batch_size, width), session)};
+                              vector<Ciphertext> labels_ct = {encrypt_vector(labels, session)};
+                              Ciphertext weights = encrypt_vector(get_packed_weights(random_vector(dimension), width, slot_count), session);
+                              LROptions options;
+                              options.degree = sigmoid_degree;
+                              return function<void()>([features_diagonals, features_T_diagonals, labels_ct, weights, batch_size, options, &session]() {
+                                  update_weights_packed(features_diagonals, features_T_diagonals, labels_ct, weights, batch_size, 0.1, session, options);
+                              });
+                          }});
+
+    return operations;
+}
+
+// CKKS session with a 60 bit special prime, as many 40 bit primes as the poly_modulus_degree allows (up to 16) and a 40 bit scale
+FHESession create_benchmark_session(size_t poly_modulus_degree)
+{
+    int num_primes = min(16, (CoeffModulus::MaxBitCount(poly_modulus_degree) - 120) / 40);
+    if (num_primes < 1)
+    {
+        cerr << "poly_modulus_degree " << poly_modulus_degree << " is too small, use at least 8192" << endl;
+        exit(1);
+    }
+
+    vector<int> bit_sizes(num_primes + 2, 40);
+    bit_sizes.front() = 60;
+    bit_sizes.back() = 60;
+
+    EncryptionParameters params(scheme_type::ckks);
+    params.set_poly_modulus_degree(poly_modulus_degree);
+    params.set_coeff_modulus(CoeffModulus::Create(poly_modulus_degree, bit_sizes));
+
+    return FHESession(params, pow(2.0, 40), KeyCache::dir_from_env());
+}
+
+// Runs the whole sweep, one session per poly_modulus_degree with the Galois keys of every selected operation and dimension
+vector<BenchmarkResult> run_benchmarks(const BenchmarkOptions &options)
+{
+    DiagonalCache diagonal_cache;
+    vector<BenchmarkOperation> all_operations = get_benchmark_operations(diagonal_cache, options.sigmoid_degree);
+
+    vector<BenchmarkOperation> operations;
+    if (options.operations.empty())
+    {
+        operations = all_operations;
+    }
+    for (const string &name : options.operations)
+    {
+        auto it = find_if(all_operations.begin(), all_operations.end(), [&](const BenchmarkOperation &op) { return op.name == name; });
+        if (it == all_operations.end())
+        {
+            cerr << "Unknown operation: " << name << endl;
+            exit(1);
+        }
+        operations.push_back(*it);
+    }
+
+    vector<BenchmarkResult> results;
+    for (size_t poly_modulus_degree : options.poly_modulus_degrees)
+    {
+        FHESession session = create_benchmark_session(poly_modulus_degree);
+        int slot_count = session.ckks_encoder.slot_count();
+
+        // (operation, dimension) points of this poly_modulus_degree
+        vector<pair<const BenchmarkOperation *, int>> points;
+        for (const BenchmarkOperation &op : operations)
+        {
+            if (!op.uses_dimension)
+            {
+                points.push_back({&op, 0});
+                continue;
+            }
+            for (int dimension : options.dimensions)
+            {
+                points.push_back({&op, dimension});
+            }
+        }
+
+        vector<int> steps;
+        for (auto &point : points)
+        {
+            if (point.first->fits(point.second, slot_count))
+            {
+                vector<int> op_steps = point.first->steps(point.second, session);
+                steps.insert(steps.end(), op_steps.begin(), op_steps.end());
+            }
+        }
+        // Step 0 is not a rotation
+        steps.erase(remove(steps.begin(), steps.end(), 0), steps.end());
+        session.create_galois_keys(steps);
+
+        for (auto &point : points)
+        {
+            BenchmarkResult result;
+            result.operation = point.first->name;
+            result.poly_modulus_degree = poly_modulus_degree;
+            result.dimension = point.second;
+
+            clog << "Running " << result.operation << " (poly_modulus_degree = " << poly_modulus_degree << ", dimension = " << result.dimension << ") ... ";
+            if (!point.first->fits(point.second, slot_count))
+            {
+                result.status = "skipped: dimension does not fit in " + to_string(slot_count) + " slots";
+            }
+            else
+            {
+                try
+                {
+                    function<void()> body = point.first->setup(point.second, session);
+                    measure(options.warmup, options.repetitions, body, result);
+                }
+                catch (const exception &e)
+                {
+                    // Mostly the end of the modulus switching chain for the deeper operations with a small poly_modulus_degree
+                    result.status = string("skipped: ") + e.what();
+                }
+            }
+            clog << (result.status == "ok" ? "Done" : result.status) << endl;
+
+            results.push_back(result);
+        }
+    }
+
+    return results;
+}
+
+string json_escape(const string &str)
+{
+    string escaped;
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+        {
+            escaped += '\\';
+        }
+        escaped += (c == '\n') ? ' ' : c;
+    }
+    return escaped;
+}
+
+void write_json(ostream &out, const BenchmarkOptions &options, const vector<BenchmarkResult> &results)
+{
+    out << fixed << setprecision(3);
+    out << "{" << endl;
+    out << "  \"warmup\": " << options.warmup << "," << endl;
+    out << "  \"repetitions\": " << options.repetitions << "," << endl;
+    out << "  \"sigmoid_degree\": " << options.sigmoid_degree << "," << endl;
+    out << "  \"results\": [" << endl;
+    for (int i = 0; i < results.size(); i++)
+    {
+        const BenchmarkResult &r = results[i];
+        out << "    {\"operation\": \"" << r.operation << "\", \"poly_modulus_degree\": " << r.poly_modulus_degree << ", \"dimension\": " << r.dimension
+            << ", \"repetitions\": " << r.repetitions << ", \"median_us\": " << r.median_us << ", \"p95_us\": " << r.p95_us
+            << ", \"min_us\": " << r.min_us << ", \"mean_us\": " << r.mean_us << ", \"status\": \"" << json_escape(r.status) << "\"}"
+            << (i + 1 < results.size() ? "," : "") << endl;
+    }
+    out << "  ]" << endl;
+    out << "}" << endl;
+}
+
+void write_csv(ostream &out, const vector<BenchmarkResult> &results)
+{
+    out << fixed << setprecision(3);
+    out << "operation,poly_modulus_degree,dimension,repetitions,median_us,p95_us,min_us,mean_us,status" << endl;
+    for (const BenchmarkResult &r : results)
+    {
+        string status = r.status;
+        replace(status.begin(), status.end(), '"', '\'');
+        out << r.operation << "," << r.poly_modulus_degree << "," << r.dimension << "," << r.repetitions << "," << r.median_us << ","
+            << r.p95_us << "," << r.min_us << "," << r.mean_us << ",\"" << status << "\"" << endl;
+    }
+}
+
+// Writes with writer to path, "-" is stdout
+void write_output(const string &path, function<void(ostream &)> writer)
+{
+    if (path == "-")
+    {
+        writer(cout);
+        return;
+    }
+
+    ofstream out(path);
+    if (!out)
+    {
+        cerr << "Couldn't open file: " << path << endl;
+        exit(1);
+    }
+    writer(out);
+}
+
+// Splits a comma separated list
+vector<string> split_list(const string &list)
+{
+    vector<string> items;
+    stringstream ss(list);
+    string item;
+    while (getline(ss, item, ','))
+    {
+        if (!item.empty())
+        {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+void print_usage(const char *program)
+{
+    cerr << "Usage: " << program << " [options]" << endl;
+    cerr << "  --poly N1,N2,...    poly_modulus_degrees to sweep (default 8192,16384)" << endl;
+    cerr << "  --dims d1,d2,...    dimensions to sweep (default 4,8,16)" << endl;
+    cerr << "  --ops op1,op2,...   operations to run (default all):" << endl;
+    cerr << "                      encode, encrypt, decrypt, decode, add, add_plain, multiply_plain, multiply, rescale, rotate," << endl;
+    cerr << "                      linear_transform, linear_transform_bsgs, matmul, matmul_batch, transpose, dot_product, polynomial, lr_iteration" << endl;
+    cerr << "  --warmup W          untimed runs per point (default 2)" << endl;
+    cerr << "  --reps R            timed runs per point (default 10)" << endl;
+    cerr << "  --degree D          degree of the sigmoid approximation of polynomial and lr_iteration, 3, 5 or 7 (default 3)" << endl;
+    cerr << "  --json FILE         write the results as JSON (- for stdout)" << endl;
+    cerr << "  --csv FILE          write the results as CSV (- for stdout)" << endl;
+}
+
+BenchmarkOptions parse_options(int argc, char *argv[])
+{
+    BenchmarkOptions options;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--help" || arg == "-h")
+        {
+            print_usage(argv[0]);
+            exit(0);
+        }
+        if (i + 1 >= argc)
+        {
+            cerr << "Missing value for " << arg << endl;
+            print_usage(argv[0]);
+            exit(1);
+        }
+
+        string value = argv[++i];
+        if (arg == "--poly")
+        {
+            options.poly_modulus_degrees.clear();
+            for (const string &item : split_list(value))
+            {
+                options.poly_modulus_degrees.push_back(stoul(item));
+            }
+        }
+        else if (arg == "--dims")
+        {
+            options.dimensions.clear();
+            for (const string &item : split_list(value))
+            {
+                options.dimensions.push_back(stoi(item));
+            }
+        }
+        else if (arg == "--ops")
+        {
+            options.operations = split_list(value);
+        }
+        else if (arg == "--warmup")
+        {
+            options.warmup = stoi(value);
+        }
+        else if (arg == "--reps")
+        {
+            options.repetitions = stoi(value);
+        }
+        else if (arg == "--degree")
+        {
+            options.sigmoid_degree = stoi(value);
+        }
+        else if (arg == "--json")
+        {
+            options.json_path = value;
+        }
+        else if (arg == "--csv")
+        {
+            options.csv_path = value;
+        }
+        else
+        {
+            cerr << "Unknown option: " << arg << endl;
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (options.repetitions < 1 || options.warmup < 0)
+    {
+        cerr << "--reps must be at least 1 and --warmup at least 0" << endl;
+        exit(1);
+    }
+    if (options.sigmoid_degree != 3 && options.sigmoid_degree != 5 && options.sigmoid_degree != 7)
+    {
+        cerr << "--degree must be 3, 5 or 7" << endl;
+        exit(1);
+    }
+    for (int dimension : options.dimensions)
+    {
+        if (dimension < 1)
+        {
+            cerr << "Invalid dimension: " << dimension << endl;
+            exit(1);
+        }
+    }
+
+    return options;
+}
+
+int main(int argc, char *argv[])
+{
+    BenchmarkOptions options = parse_options(argc, argv);
+    vector<BenchmarkResult> results = run_benchmarks(options);
+
+    if (!options.json_path.empty())
+    {
+        write_output(options.json_path, [&](ostream &out) { write_json(out, options, results); });
+    }
+    if (!options.csv_path.empty())
+    {
+        write_output(options.csv_path, [&](ostream &out) { write_csv(out, results); });
+    }
+
+    // Summary table
+    if (options.json_path != "-" && options.csv_path != "-")
+    {
+        cout << endl;
+        cout << left << setw(24) << "operation" << right << setw(8) << "N" << setw(6) << "d" << setw(14) << "median (us)" << setw(14) << "p95 (us)" << endl;
+        cout << fixed << setprecision(1);
+        for (const BenchmarkResult &r : results)
+        {
+            cout << left << setw(24) << r.operation << right << setw(8) << r.poly_modulus_degree << setw(6) << r.dimension;
+            if (r.status == "ok")
+            {
+                cout << setw(14) << r.median_us << setw(14) << r.p95_us << endl;
+            }
+            else
+            {
+                cout << "  " << r.status << endl;
+            }
+        }
+    }
+
+    return 0;
+}
@@ -1,11 +1,84 @@
+#pragma once
+
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <map>
+#include <tuple>
+#include <deque>
+#include <condition_variable>
 #include "seal/seal.h"
+#include "matrix.h"
+#include "csv.h"
+#include "evaluator_trace.h"
+#include "serialization.h"
 
 using namespace std;
 using namespace seal;
 
+// Runs body(i) for i = 0 ... count - 1 on num_threads worker threads (0 uses every hardware thread)
+// Every index is processed exactly once so results written to index i do not depend on the scheduling
+void parallel_for(int count, int num_threads, function<void(int)> body)
+{
+    if (num_threads <= 0)
+    {
+        num_threads = thread::hardware_concurrency();
+    }
+    num_threads = max(1, min(num_threads, count));
+
+    if (num_threads == 1)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            body(i);
+        }
+        return;
+    }
+
+    atomic<int> next_index(0);
+    exception_ptr error = nullptr;
+    mutex error_mutex;
+    string trace_site = EvaluatorTrace::current_site();
+
+    vector<thread> workers;
+    for (int t = 0; t < num_threads; t++)
+    {
+        workers.emplace_back([&]() {
+            TraceScope trace_scope(trace_site, true);
+            for (int i = next_index++; i < count; i = next_index++)
+            {
+                try
+                {
+                    body(i);
+                }
+                catch (...)
+                {
+                    lock_guard<mutex> lock(error_mutex);
+                    if (!error)
+                    {
+                        error = current_exception();
+                    }
+                }
+            }
+        });
+    }
+
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+
+    if (error)
+    {
+        rethrow_exception(error);
+    }
+}
+
 // Helper function that prints parameters
 void print_parameters(shared_ptr<SEALContext> context)
 {
@@ -52,24 +125,470 @@ void print_parameters(shared_ptr<SEALContext> context)
     cout << "\\" << endl;
 }
 
-// Helper function that prints a matrix (vector of vectors)
+// Encoded masks (value in a range of slots, 0 everywhere else) shared by the functions that extract or assemble slots
+// Each mask is encoded once per (range, value, parms_id, scale) and reused, get can be called from several threads
+class MaskCache
+{
+public:
+    MaskCache(CKKSEncoder &ckks_encoder) : ckks_encoder(ckks_encoder)
+    {
+    }
+
+    // Mask with value in the slots [begin, end)
+    const Plaintext &get(int begin, int end, double value, parms_id_type parms_id, double scale)
+    {
+        auto key = make_tuple(begin, end, value, parms_id, scale);
+
+        lock_guard<mutex> lock(masks_mutex);
+        auto it = masks.find(key);
+        if (it != masks.end())
+        {
+            return it->second;
+        }
+
+        vector<double> mask_vec(ckks_encoder.slot_count(), 0);
+        fill(mask_vec.begin() + begin, mask_vec.begin() + end, value);
+        Plaintext mask_pt;
+        ckks_encoder.encode(mask_vec, parms_id, scale, mask_pt);
+
+        return masks.emplace(key, move(mask_pt)).first->second;
+    }
+
+    void clear()
+    {
+        lock_guard<mutex> lock(masks_mutex);
+        masks.clear();
+    }
+
+private:
+    CKKSEncoder &ckks_encoder;
+    mutex masks_mutex;
+    map<tuple<int, int, double, parms_id_type, double>, Plaintext> masks;
+};
+
+// Encryption parameters together with their context, keys, encryptor, decryptor, evaluator and encoder
+// Build it once and pass it by reference so hot functions don't redo the modulus and NTT precomputation of a new context
+class FHESession
+{
+public:
+    EncryptionParameters params;
+    SEALContext context;
+    KeyCache key_cache;
+    KeyGenerator keygen;
+    SecretKey secret_key;
+    PublicKey public_key;
+    RelinKeys relin_keys;
+    GaloisKeys gal_keys;
+    Encryptor encryptor;
+    Decryptor decryptor;
+    TracedEvaluator evaluator;
+    CKKSEncoder ckks_encoder;
+    MaskCache masks;
+    double scale;
+
+    // key_cache_dir (e.g. KeyCache::dir_from_env()) keeps the keys on disk between runs, see KeyCache
+    // Runs with the same parameters then load them instead of generating them, which is what dominates the startup for large N
+    FHESession(EncryptionParameters parms, double scale, const string &key_cache_dir = "")
+        : params(parms), context(parms), key_cache(key_cache_dir, parms), keygen(create_keygen(context, key_cache)), secret_key(keygen.secret_key()),
+          public_key(create_public_key(context, keygen, key_cache)), encryptor(context, public_key, secret_key), decryptor(context, secret_key),
+          evaluator(context), ckks_encoder(context), masks(ckks_encoder), scale(scale)
+    {
+        if (!key_cache.load(relin_keys, context, "relin"))
+        {
+            keygen.create_relin_keys(relin_keys);
+            key_cache.save(relin_keys, "relin");
+        }
+    }
+
+    // Galois keys for every power-of-two step
+    // Prefer create_galois_keys(steps) with the get_*_steps of the algorithms used, the full set is hundreds of MB for large N
+    void create_galois_keys()
+    {
+        if (!key_cache.load(gal_keys, context, "galois_all"))
+        {
+            keygen.create_galois_keys(gal_keys);
+            key_cache.save(gal_keys, "galois_all");
+        }
+    }
+
+    // Galois keys for the given steps only
+    void create_galois_keys(vector<int> steps)
+    {
+        sort(steps.begin(), steps.end());
+        steps.erase(unique(steps.begin(), steps.end()), steps.end());
+        string name = KeyCache::get_galois_name(steps);
+        if (!key_cache.load(gal_keys, context, name))
+        {
+            keygen.create_galois_keys(steps, gal_keys);
+            key_cache.save(gal_keys, name);
+        }
+    }
+
+    // Seed-compressed relinearization keys for a server, about half the size of relin_keys once saved
+    // (a Serializable can only be saved, the server loads it as RelinKeys)
+    Serializable<RelinKeys> create_serializable_relin_keys()
+    {
+        return keygen.create_relin_keys();
+    }
+
+    // Seed-compressed Galois keys for the given steps only
+    Serializable<GaloisKeys> create_serializable_galois_keys(vector<int> steps)
+    {
+        sort(steps.begin(), steps.end());
+        steps.erase(unique(steps.begin(), steps.end()), steps.end());
+        return keygen.create_galois_keys(steps);
+    }
+
+    // Saves the parameters and the seed-compressed evaluation keys a server needs to <prefix>.params, <prefix>.relin and <prefix>.galois
+    // Returns the number of bytes written
+    size_t save_server_keys(const string &prefix, const vector<int> &gal_steps)
+    {
+        size_t bytes = save_to_file(params, prefix + ".params");
+        bytes += save_to_file(create_serializable_relin_keys(), prefix + ".relin");
+        bytes += save_to_file(create_serializable_galois_keys(gal_steps), prefix + ".galois");
+        return bytes;
+    }
+
+private:
+    // The cached secret key if there is one, otherwise a new one that starts the cache
+    static KeyGenerator create_keygen(const SEALContext &context, KeyCache &key_cache)
+    {
+        SecretKey sk;
+        // A secret key that is cached but doesn't load makes the whole cache of these parameters stale
+        bool stale = key_cache.contains("secret");
+        if (!key_cache.load(sk, context, "secret"))
+        {
+            sk = KeyGenerator(context).secret_key();
+            key_cache.create(sk, stale);
+        }
+
+        return KeyGenerator(context, sk);
+    }
+
+    static PublicKey create_public_key(const SEALContext &context, KeyGenerator &keygen, const KeyCache &key_cache)
+    {
+        PublicKey pk;
+        if (!key_cache.load(pk, context, "public"))
+        {
+            keygen.create_public_key(pk);
+            key_cache.save(pk, "public");
+        }
+        return pk;
+    }
+};
+
+// --------------------------- PARAMETER PLANNING ----------------------------
+
+// CKKS parameters chosen for a multiplicative depth
+// The chain is one data prime, depth primes of scale_bits bits (one consumed by every rescale) and the special prime of the keys
+struct ParameterPlan
+{
+    size_t poly_modulus_degree;
+    vector<int> coeff_modulus_bits;
+    int scale_bits;
+    int depth;
+
+    EncryptionParameters get_parameters() const
+    {
+        EncryptionParameters params(scheme_type::ckks);
+        params.set_poly_modulus_degree(poly_modulus_degree);
+        params.set_coeff_modulus(CoeffModulus::Create(poly_modulus_degree, coeff_modulus_bits));
+        return params;
+    }
+
+    double scale() const
+    {
+        return pow(2.0, scale_bits);
+    }
+};
+
+// Smallest poly_modulus_degree (and its modulus chain) that fits depth rescales of scale_bits bits at 128-bit security
+// and has at least min_slots slots. The first and the special prime have scale_bits + 20 bits (at most 60), so the values
+// keep 20 bits above the decimal point. poly_modulus_degree forces N instead of searching, it is an error if it doesn't fit
+ParameterPlan plan_parameters(int depth, int scale_bits = 40, size_t min_slots = 0, size_t poly_modulus_degree = 0)
+{
+    if (depth < 1 || scale_bits < 20 || scale_bits > 60)
+    {
+        cerr << "Invalid depth " << depth << " or scale bits " << scale_bits << " (20 to 60)" << endl;
+        exit(1);
+    }
+
+    int outer_bits = min(60, scale_bits + 20);
+    vector<int> bits(depth + 2, scale_bits);
+    bits.front() = outer_bits;
+    bits.back() = outer_bits;
+    int total_bits = 2 * outer_bits + depth * scale_bits;
+
+    vector<size_t> candidates = {4096, 8192, 16384, 32768};
+    if (poly_modulus_degree)
+    {
+        candidates = {poly_modulus_degree};
+    }
+    for (size_t N : candidates)
+    {
+        if (total_bits <= CoeffModulus::MaxBitCount(N) && N / 2 >= min_slots)
+        {
+            return ParameterPlan{N, bits, scale_bits, depth};
+        }
+    }
+
+    if (poly_modulus_degree)
+    {
+        cerr << "poly_modulus_degree " << poly_modulus_degree << " can't hold depth " << depth << " (" << total_bits << " bits, at most "
+             << CoeffModulus::MaxBitCount(poly_modulus_degree) << ") with " << min_slots << " slots" << endl;
+    }
+    else
+    {
+        cerr << "No poly_modulus_degree up to 32768 holds depth " << depth << " with " << scale_bits << " bit primes (" << total_bits << " bits) and "
+             << min_slots << " slots, lower the depth or the scale bits" << endl;
+    }
+    exit(1);
+}
+
+void print_plan(const ParameterPlan &plan)
+{
+    int total_bits = 0;
+    for (int bits : plan.coeff_modulus_bits)
+    {
+        total_bits += bits;
+    }
+    cout << "Parameter plan: N = " << plan.poly_modulus_degree << ", " << plan.poly_modulus_degree / 2 << " slots, depth " << plan.depth
+         << ", coeff_modulus " << plan.coeff_modulus_bits.front() << " + " << plan.depth << " x " << plan.scale_bits << " + " << plan.coeff_modulus_bits.back()
+         << " = " << total_bits << " bits (at most " << CoeffModulus::MaxBitCount(plan.poly_modulus_degree) << "), scale 2^" << plan.scale_bits << endl;
+}
+
+// Fixed capacity queue shared by producer and consumer threads
+// push blocks while the queue is full, pop blocks while it is empty and returns false once the queue is closed and drained
+template <typename T>
+class BoundedQueue
+{
+public:
+    BoundedQueue(size_t capacity) : capacity(max<size_t>(1, capacity))
+    {
+    }
+
+    // Returns false if the queue was closed before the item could be added
+    bool push(T item)
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        not_full.wait(lock, [&]() { return closed || items.size() < capacity; });
+        if (closed)
+        {
+            return false;
+        }
+        items.push_back(move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        not_empty.wait(lock, [&]() { return closed || !items.empty(); });
+        if (items.empty())
+        {
+            return false;
+        }
+        item = move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    // Stops accepting items and wakes every waiting thread, queued items can still be popped
+    void close()
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        closed = true;
+        not_full.notify_all();
+        not_empty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    deque<T> items;
+    bool closed = false;
+    mutex queue_mutex;
+    condition_variable not_full;
+    condition_variable not_empty;
+};
+
+// Encodes get_row(i) at session.scale and encrypts it into result[i] for i = 0 ... count - 1
+// Encoder threads feed encryptor threads through a queue of at most max_in_flight plaintexts (0 uses twice the thread count),
+// each plaintext is dropped as soon as it is encrypted so a full vector<Plaintext> is never held
+// get_row is called concurrently from the encoder threads and must not modify shared state
+vector<Ciphertext> encode_encrypt_pipeline(int count, function<vector<double>(int)> get_row, FHESession &session, int num_threads = 0, int max_in_flight = 0)
+{
+    vector<Ciphertext> result(count);
+    if (num_threads <= 0)
+    {
+        num_threads = thread::hardware_concurrency();
+    }
+    num_threads = min(num_threads, 2 * count);
+
+    // Not enough threads for both stages, stream one row at a time
+    if (num_threads < 2)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            Plaintext pt;
+            session.ckks_encoder.encode(get_row(i), session.scale, pt);
+            session.encryptor.encrypt(pt, result[i]);
+        }
+        return result;
+    }
+
+    // Encryption is a few times more expensive than encoding, give it most of the threads
+    int num_encoders = max(1, num_threads / 3);
+    int num_encryptors = num_threads - num_encoders;
+    if (max_in_flight <= 0)
+    {
+        max_in_flight = 2 * num_threads;
+    }
+
+    BoundedQueue<pair<int, Plaintext>> queue(max_in_flight);
+    atomic<int> next_index(0);
+    atomic<int> encoders_left(num_encoders);
+    exception_ptr error = nullptr;
+    mutex error_mutex;
+
+    auto record_error = [&]() {
+        lock_guard<mutex> lock(error_mutex);
+        if (!error)
+        {
+            error = current_exception();
+        }
+    };
+
+    vector<thread> workers;
+    for (int t = 0; t < num_encoders; t++)
+    {
+        workers.emplace_back([&]() {
+            try
+            {
+                for (int i = next_index++; i < count; i = next_index++)
+                {
+                    Plaintext pt;
+                    session.ckks_encoder.encode(get_row(i), session.scale, pt);
+                    if (!queue.push(make_pair(i, move(pt))))
+                    {
+                        break;
+                    }
+                }
+            }
+            catch (...)
+            {
+                record_error();
+                queue.close();
+            }
+            // The last encoder to finish lets the encryptors drain the queue and exit
+            if (--encoders_left == 0)
+            {
+                queue.close();
+            }
+        });
+    }
+    for (int t = 0; t < num_encryptors; t++)
+    {
+        workers.emplace_back([&]() {
+            pair<int, Plaintext> item;
+            while (queue.pop(item))
+            {
+                try
+                {
+                    session.encryptor.encrypt(item.second, result[item.first]);
+                }
+                catch (...)
+                {
+                    record_error();
+                    queue.close();
+                }
+                item.second = Plaintext();
+            }
+        });
+    }
+
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+
+    if (error)
+    {
+        rethrow_exception(error);
+    }
+    return result;
+}
+
+// Encodes and encrypts every row of a matrix with encode_encrypt_pipeline
+vector<Ciphertext> encrypt_rows(const Matrix<double> &rows, FHESession &session, int num_threads = 0)
+{
+    return encode_encrypt_pipeline(
+        rows.rows(), [&](int i) { return rows.row(i); }, session, num_threads);
+}
+
+vector<Ciphertext> encrypt_rows(const vector<vector<double>> &rows, FHESession &session, int num_threads = 0)
+{
+    return encode_encrypt_pipeline(
+        rows.size(), [&](int i) { return rows[i]; }, session, num_threads);
+}
+
+// Encrypts every row of a matrix straight into a bundle file for upload (rows in order)
+// Rows are encrypted with the secret key, so only the seed of the random half of each ciphertext is saved,
+// and chunks of rows are encoded, encrypted and compressed in parallel. Returns the number of bytes written
+size_t encrypt_rows_to_bundle(const Matrix<double> &rows, const string &path, FHESession &session, int num_threads = 0, int chunk_rows = 256)
+{
+    CiphertextBundleWriter writer(path);
+    vector<string> serialized(chunk_rows);
+    for (int begin = 0; begin < rows.rows(); begin += chunk_rows)
+    {
+        int end = min(rows.rows(), begin + chunk_rows);
+        parallel_for(end - begin, num_threads, [&](int i) {
+            Plaintext pt;
+            session.ckks_encoder.encode(rows.row(begin + i), session.scale, pt);
+            serialized[i] = save_to_string(session.encryptor.encrypt_symmetric(pt));
+        });
+        for (int i = 0; i < end - begin; i++)
+        {
+            writer.add_serialized(serialized[i]);
+        }
+    }
+    writer.close();
+
+    ifstream in(path, ios::binary | ios::ate);
+    return in.tellg();
+}
+
+// Loads every ciphertext of a bundle, decompressing in parallel
+vector<Ciphertext> load_bundle(const string &path, FHESession &session, int num_threads = 0)
+{
+    CiphertextBundleReader reader(path, session.context);
+    vector<Ciphertext> result(reader.size());
+    parallel_for(reader.size(), num_threads, [&](int i) {
+        result[i] = reader.load(i);
+    });
+
+    return result;
+}
+
+// Helper function that prints a matrix
 template <typename T>
-inline void print_full_matrix(vector<vector<T>> matrix, int precision = 3)
+inline void print_full_matrix(const Matrix<T> &matrix, int precision = 3)
 {
     // save formatting for cout
     ios old_fmt(nullptr);
     old_fmt.copyfmt(cout);
     cout << fixed << setprecision(precision);
-    int row_size = matrix.size();
-    int col_size = matrix[0].size();
+    int row_size = matrix.rows();
+    int col_size = matrix.cols();
     for (unsigned int i = 0; i < row_size; i++)
     {
         cout << "[";
         for (unsigned int j = 0; j < col_size - 1; j++)
         {
-            cout << matrix[i][j] << ", ";
+            cout << matrix(i, j) << ", ";
         }
-        cout << matrix[i][col_size - 1];
+        cout << matrix(i, col_size - 1);
         cout << "]" << endl;
     }
     cout << endl;
@@ -77,17 +596,24 @@ inline void print_full_matrix(vector<vector<T>> matrix, int precision = 3)
     cout.copyfmt(old_fmt);
 }
 
+// Helper function that prints a matrix (vector of vectors)
+template <typename T>
+inline void print_full_matrix(const vector<vector<T>> &matrix, int precision = 3)
+{
+    print_full_matrix(Matrix<T>(matrix), precision);
+}
+
 // Helper function that prints parts of a matrix (only squared matrix)
 template <typename T>
-inline void print_partial_matrix(vector<vector<T>> matrix, int print_size = 3, int precision = 3)
+inline void print_partial_matrix(const Matrix<T> &matrix, int print_size = 3, int precision = 3)
 {
     // save formatting for cout
     ios old_fmt(nullptr);
     old_fmt.copyfmt(cout);
     cout << fixed << setprecision(precision);
 
-    int row_size = matrix.size();
-    int col_size = matrix[0].size();
+    int row_size = matrix.rows();
+    int col_size = matrix.cols();
 
     // Boundary check
     if (row_size < 2 * print_size && col_size < 2 * print_size)
@@ -101,14 +627,14 @@ inline void print_partial_matrix(vector<vector<T>> matrix, int print_size = 3, i
         cout << "\t[";
         for (unsigned int col = 0; col < print_size; col++)
         {
-            cout << matrix[row][col] << ", ";
+            cout << matrix(row, col) << ", ";
         }
         cout << "..., ";
         for (unsigned int col = col_size - print_size; col < col_size - 1; col++)
         {
-            cout << matrix[row][col] << ", ";
+            cout << matrix(row, col) << ", ";
         }
-        cout << matrix[row][col_size - 1];
+        cout << matrix(row, col_size - 1);
         cout << "]" << endl;
     }
     cout << "\t..." << endl;
@@ -118,14 +644,14 @@ inline void print_partial_matrix(vector<vector<T>> matrix, int print_size = 3, i
         cout << "\t[";
         for (unsigned int col = 0; col < print_size; col++)
         {
-            cout << matrix[row][col] << ", ";
+            cout << matrix(row, col) << ", ";
         }
         cout << "..., ";
         for (unsigned int col = col_size - print_size; col < col_size - 1; col++)
         {
-            cout << matrix[row][col] << ", ";
+            cout << matrix(row, col) << ", ";
         }
-        cout << matrix[row][col_size - 1];
+        cout << matrix(row, col_size - 1);
         cout << "]" << endl;
     }
 
@@ -134,9 +660,15 @@ inline void print_partial_matrix(vector<vector<T>> matrix, int print_size = 3, i
     cout.copyfmt(old_fmt);
 }
 
+template <typename T>
+inline void print_partial_matrix(const vector<vector<T>> &matrix, int print_size = 3, int precision = 3)
+{
+    print_partial_matrix(Matrix<T>(matrix), print_size, precision);
+}
+
 // Helper function that prints parts of a vector
 template <typename T>
-inline void print_partial_vector(vector<T> vec, int size, int print_size = 3, int precision = 3)
+inline void print_partial_vector(const vector<T> &vec, int size, int print_size = 3, int precision = 3)
 {
     // save formatting for cout
     ios old_fmt(nullptr);
@@ -172,45 +704,164 @@ inline void print_partial_vector(vector<T> vec, int size, int print_size = 3, in
 
 // Gets a diagonal from a matrix U
 template <typename T>
-vector<T> get_diagonal(int position, vector<vector<T>> U)
+vector<T> get_diagonal(int position, const Matrix<T> &U)
 {
+    int n = U.rows();
+    vector<T> diagonal(n);
+
+    // U(0,l) , U(1,l+1), ... ,  U(n-l-1, n-1), U(n-l, 0), ... , U(n-1, l-1)
+    for (int i = 0; i < n; i++)
+    {
+        diagonal[i] = U(i, (i + position) % n);
+    }
+
+    return diagonal;
+}
 
-    vector<T> diagonal(U.size());
+// Gets all diagonals from a matrix U into a matrix (row l is diagonal l)
+template <typename T>
+Matrix<T> get_all_diagonals(const Matrix<T> &U)
+{
+    int n = U.rows();
+    Matrix<T> diagonal_matrix(n, n);
 
-    int k = 0;
-    // U(0,l) , U(1,l+1), ... ,  U(n-l-1, n-1)
-    for (int i = 0, j = position; (i < U.size() - position) && (j < U.size()); i++, j++)
+    // Walk U row by row so the reads are sequential
+    for (int i = 0; i < n; i++)
     {
-        diagonal[k] = U[i][j];
-        k++;
+        const T *U_row = U.row_data(i);
+        for (int l = 0, j = i; l < n; l++, j = (j + 1 == n) ? 0 : j + 1)
+        {
+            diagonal_matrix(l, i) = U_row[j];
+        }
     }
-    for (int i = U.size() - position, j = 0; (i < U.size()) && (j < position); i++, j++)
+
+    return diagonal_matrix;
+}
+
+// Number of power-of-two rotations needed for a rotation step (weight of its non-adjacent form)
+// SEAL rotates by this many key switches when there is no Galois key for the step itself
+int rotation_cost(int step)
+{
+    int cost = 0;
+    int n = abs(step);
+    while (n != 0)
     {
-        diagonal[k] = U[i][j];
-        k++;
+        if (n & 1)
+        {
+            n -= 2 - (n & 3);
+            cost++;
+        }
+        n >>= 1;
     }
 
-    return diagonal;
+    return cost;
 }
 
-// Gets all diagonals from a matrix U into a matrix
-template <typename T>
-vector<vector<T>> get_all_diagonals(vector<vector<T>> U)
+// One rotation computed by rotate_vector_many: result index is source (-1 for the input ciphertext) rotated by rotation
+struct RotationPlanStep
+{
+    int index;
+    int source;
+    int rotation;
+};
+
+// Order in which rotate_vector_many computes the rotations of the same ciphertext by several steps
+// Steps are computed in increasing order and each rotation starts from the input or from the previous result,
+// whichever needs fewer key switches (e.g. steps 1, 2, ..., d - 1 cost one key switch each)
+vector<RotationPlanStep> get_rotation_plan(const vector<int> &steps)
+{
+    vector<int> order(steps.size());
+    for (int i = 0; i < order.size(); i++)
+    {
+        order[i] = i;
+    }
+    sort(order.begin(), order.end(), [&steps](int a, int b) { return steps[a] < steps[b]; });
+
+    vector<RotationPlanStep> plan;
+    int prev = -1;
+    for (int i : order)
+    {
+        int step = steps[i];
+        if (step != 0 && prev >= 0 && rotation_cost(step - steps[prev]) < rotation_cost(step))
+        {
+            plan.push_back({i, prev, step - steps[prev]});
+        }
+        else
+        {
+            plan.push_back({i, -1, step});
+        }
+        prev = i;
+    }
+
+    return plan;
+}
+
+// Rotations a rotate_vector_many call with these steps performs
+// Pass them to session.create_galois_keys(steps) when only generating the keys that are needed
+vector<int> get_rotation_plan_steps(const vector<int> &steps)
 {
+    vector<int> rotations;
+    for (const RotationPlanStep &plan_step : get_rotation_plan(steps))
+    {
+        if (plan_step.rotation != 0)
+        {
+            rotations.push_back(plan_step.rotation);
+        }
+    }
 
-    vector<vector<T>> diagonal_matrix(U.size());
+    return rotations;
+}
 
-    for (int i = 0; i < U.size(); i++)
+// Rotates the same ciphertext by several steps following get_rotation_plan
+vector<Ciphertext> rotate_vector_many(const Ciphertext &ct, const vector<int> &steps, const GaloisKeys &gal_keys, TracedEvaluator &evaluator)
+{
+    vector<Ciphertext> ct_rots(steps.size());
+    for (const RotationPlanStep &plan_step : get_rotation_plan(steps))
     {
-        diagonal_matrix[i] = get_diagonal(i, U);
+        const Ciphertext &source = plan_step.source < 0 ? ct : ct_rots[plan_step.source];
+        if (plan_step.rotation == 0)
+        {
+            ct_rots[plan_step.index] = source;
+        }
+        else
+        {
+            evaluator.rotate_vector(source, plan_step.rotation, gal_keys, ct_rots[plan_step.index]);
+        }
     }
 
-    return diagonal_matrix;
+    return ct_rots;
+}
+
+// Calls body(i, ct rotated by steps[i]) for every step in the order of get_rotation_plan
+// Only the last rotation is kept (it is the source of the next one), so a body that accumulates the rotations into one
+// ciphertext needs O(1) ciphertexts instead of the steps.size() of rotate_vector_many
+void for_each_rotation(const Ciphertext &ct, const vector<int> &steps, const GaloisKeys &gal_keys, TracedEvaluator &evaluator, function<void(int, const Ciphertext &)> body)
+{
+    Ciphertext rotations[2];
+    const Ciphertext *previous = &ct;
+    int next = 0;
+    for (const RotationPlanStep &plan_step : get_rotation_plan(steps))
+    {
+        const Ciphertext &source = plan_step.source < 0 ? ct : *previous;
+        if (plan_step.rotation == 0)
+        {
+            previous = &source;
+        }
+        else
+        {
+            evaluator.rotate_vector(source, plan_step.rotation, gal_keys, rotations[next]);
+            previous = &rotations[next];
+            next ^= 1;
+        }
+        body(plan_step.index, *previous);
+    }
 }
 
 // Linear Transformation function between ciphertext matrix and ciphertext vector
-Ciphertext Linear_Transform_Cipher(Ciphertext ct, vector<Ciphertext> U_diagonals, GaloisKeys gal_keys, Evaluator &evaluator)
+Ciphertext Linear_Transform_Cipher(const Ciphertext &ct, const vector<Ciphertext> &U_diagonals, const GaloisKeys &gal_keys, TracedEvaluator &evaluator)
 {
+    TraceScope trace_scope(__func__);
+
     // Fill ct with duplicate
     Ciphertext ct_rot;
     evaluator.rotate_vector(ct, -U_diagonals.size(), gal_keys, ct_rot);
@@ -218,26 +869,27 @@ Ciphertext Linear_Transform_Cipher(Ciphertext ct, vector<Ciphertext> U_diagonals
     Ciphertext ct_new;
     evaluator.add(ct, ct_rot, ct_new);
 
-    vector<Ciphertext> ct_result(U_diagonals.size());
-    evaluator.multiply(ct_new, U_diagonals[0], ct_result[0]);
-
-    for (int l = 1; l < U_diagonals.size(); l++)
+    // Rotations of ct_new by 0 ... d - 1
+    vector<int> steps(U_diagonals.size());
+    for (int l = 0; l < U_diagonals.size(); l++)
     {
-        Ciphertext temp_rot;
-        evaluator.rotate_vector(ct_new, l, gal_keys, temp_rot);
-        evaluator.multiply(temp_rot, U_diagonals[l], ct_result[l]);
+        steps[l] = l;
     }
     Ciphertext ct_prime;
-    evaluator.add_many(ct_result, ct_prime);
+    for_each_rotation(ct_new, steps, gal_keys, evaluator, [&](int l, const Ciphertext &ct_rot_l) {
+        evaluator.multiply_accumulate(ct_rot_l, U_diagonals[l], ct_prime);
+    });
 
     return ct_prime;
 }
 
 // Linear Transformation function between plaintext  matrix and ciphertext vector
-Ciphertext Linear_Transform_Plain(Ciphertext ct, vector<Plaintext> U_diagonals, GaloisKeys gal_keys, EncryptionParameters params)
+Ciphertext Linear_Transform_Plain(const Ciphertext &ct, const vector<Plaintext> &U_diagonals, FHESession &session)
 {
-    SEALContext context(params);
-    Evaluator evaluator(context);
+    TraceScope trace_scope(__func__);
+
+    TracedEvaluator &evaluator = session.evaluator;
+    GaloisKeys &gal_keys = session.gal_keys;
 
     // Fill ct with duplicate
     Ciphertext ct_rot;
@@ -246,263 +898,731 @@ Ciphertext Linear_Transform_Plain(Ciphertext ct, vector<Plaintext> U_diagonals,
     Ciphertext ct_new;
     evaluator.add(ct, ct_rot, ct_new);
 
-    vector<Ciphertext> ct_result(U_diagonals.size());
-    evaluator.multiply_plain(ct_new, U_diagonals[0], ct_result[0]);
+    // Rotations of ct_new by 0 ... d - 1
+    vector<int> steps(U_diagonals.size());
+    for (int l = 0; l < U_diagonals.size(); l++)
+    {
+        steps[l] = l;
+    }
+    Ciphertext ct_prime;
+    for_each_rotation(ct_new, steps, gal_keys, evaluator, [&](int l, const Ciphertext &ct_rot_l) {
+        evaluator.multiply_plain_accumulate(ct_rot_l, U_diagonals[l], ct_prime);
+    });
+
+    return ct_prime;
+}
+
+// Rotations Linear_Transform_Plain and Linear_Transform_Cipher need for a dimension x dimension matrix
+vector<int> get_linear_transform_steps(int dimension)
+{
+    vector<int> rots(dimension);
+    for (int l = 0; l < dimension; l++)
+    {
+        rots[l] = l;
+    }
+    vector<int> steps = get_rotation_plan_steps(rots);
+    steps.push_back(-dimension);
+
+    return steps;
+}
+
+// Rotates an encoded diagonal to the right by steps slots (decoded, rotated and re-encoded at the same level and scale)
+Plaintext rotate_plain_diagonal(const Plaintext &pt, int steps, CKKSEncoder &ckks_encoder)
+{
+    vector<double> values;
+    ckks_encoder.decode(pt, values);
+
+    int slot_count = values.size();
+    vector<double> rotated(slot_count);
+    for (int i = 0; i < slot_count; i++)
+    {
+        rotated[(i + steps) % slot_count] = values[i];
+    }
+
+    Plaintext rotated_pt;
+    ckks_encoder.encode(rotated, pt.parms_id(), pt.scale(), rotated_pt);
+
+    return rotated_pt;
+}
+
+// Pre-rotates plaintext diagonals for Linear_Transform_Plain_BSGS
+// Diagonal l = g * n1 + b is rotated by -g * n1. This only depends on the matrix so it can be done once and reused for every vector
+vector<Plaintext> get_bsgs_plain_diagonals(const vector<Plaintext> &U_diagonals, CKKSEncoder &ckks_encoder)
+{
+    int dimension = U_diagonals.size();
+    int n1 = ceil(sqrt(dimension));
 
-    for (int l = 1; l < U_diagonals.size(); l++)
+    vector<Plaintext> bsgs_diagonals(dimension);
+    for (int l = 0; l < dimension; l++)
     {
-        Ciphertext temp_rot;
-        evaluator.rotate_vector(ct_new, l, gal_keys, temp_rot);
-        evaluator.multiply_plain(temp_rot, U_diagonals[l], ct_result[l]);
+        int giant_step = (l / n1) * n1;
+        if (giant_step == 0)
+        {
+            bsgs_diagonals[l] = U_diagonals[l];
+        }
+        else
+        {
+            bsgs_diagonals[l] = rotate_plain_diagonal(U_diagonals[l], giant_step, ckks_encoder);
+        }
     }
+
+    return bsgs_diagonals;
+}
+
+// Baby-step giant-step linear transformation between plaintext matrix and ciphertext vector
+// With n1 = ceil(sqrt(d)), diagonal l = g * n1 + b is pre-rotated by -g * n1 so that
+// sum_l U_l * rot(ct, l) = sum_g rot(sum_b rot(U_l, -g * n1) * rot(ct, b), g * n1)
+// which needs n1 - 1 baby step and d / n1 - 1 giant step rotations instead of d - 1
+// U_diagonals must be pre-rotated with get_bsgs_plain_diagonals
+Ciphertext Linear_Transform_Plain_BSGS(const Ciphertext &ct, const vector<Plaintext> &U_diagonals, FHESession &session)
+{
+    TraceScope trace_scope(__func__);
+
+    TracedEvaluator &evaluator = session.evaluator;
+    GaloisKeys &gal_keys = session.gal_keys;
+
+    if (U_diagonals.empty())
+    {
+        cerr << "Linear transformation matrix has no diagonals" << endl;
+        exit(1);
+    }
+
+    int dimension = U_diagonals.size();
+    int n1 = ceil(sqrt(dimension));
+    int n2 = (dimension + n1 - 1) / n1;
+
+    // Fill ct with duplicate
+    Ciphertext ct_rot;
+    evaluator.rotate_vector(ct, -dimension, gal_keys, ct_rot);
+    Ciphertext ct_new;
+    evaluator.add(ct, ct_rot, ct_new);
+
+    // Baby steps: rot(ct_new, b) for b = 0 ... n1 - 1
+    vector<int> baby_step_rots(n1);
+    for (int b = 0; b < n1; b++)
+    {
+        baby_step_rots[b] = b;
+    }
+    vector<Ciphertext> baby_steps = rotate_vector_many(ct_new, baby_step_rots, gal_keys, evaluator);
+
+    // Giant steps, each block is accumulated and rotated into ct_prime right away
     Ciphertext ct_prime;
-    evaluator.add_many(ct_result, ct_prime);
+    for (int g = 0; g < n2; g++)
+    {
+        int giant_step = g * n1;
+        int block_size = min(n1, dimension - giant_step);
+        Ciphertext block_result;
+
+        for (int b = 0; b < block_size; b++)
+        {
+            evaluator.multiply_plain_accumulate(baby_steps[b], U_diagonals[giant_step + b], block_result);
+        }
+
+        if (g == 0)
+        {
+            ct_prime = move(block_result);
+            continue;
+        }
+        evaluator.rotate_vector_inplace(block_result, giant_step, gal_keys);
+        evaluator.add_inplace(ct_prime, block_result);
+    }
 
     return ct_prime;
 }
 
-// Linear transformation function between ciphertext matrix and plaintext vector
-Ciphertext Linear_Transform_CipherMatrix_PlainVector(vector<Plaintext> pt_rotations, vector<Ciphertext> U_diagonals, GaloisKeys gal_keys, Evaluator &evaluator)
+// Rotations Linear_Transform_Plain_BSGS and Linear_Transform_Cipher_BSGS need for a dimension x dimension matrix
+vector<int> get_bsgs_steps(int dimension)
 {
-    vector<Ciphertext> ct_result(pt_rotations.size());
+    int n1 = ceil(sqrt(dimension));
+    int n2 = (dimension + n1 - 1) / n1;
 
-    for (int i = 0; i < pt_rotations.size(); i++)
+    vector<int> baby_step_rots(n1);
+    for (int b = 0; b < n1; b++)
     {
-        evaluator.multiply_plain(U_diagonals[i], pt_rotations[i], ct_result[i]);
+        baby_step_rots[b] = b;
     }
+    vector<int> steps = get_rotation_plan_steps(baby_step_rots);
+    for (int g = 1; g < n2; g++)
+    {
+        steps.push_back(g * n1);
+    }
+    steps.push_back(-dimension);
+
+    return steps;
+}
 
+// Pre-rotates ciphertext diagonals for Linear_Transform_Cipher_BSGS
+// Diagonal l = g * n1 + b is rotated by -g * n1. This only depends on the matrix so it can be done once and reused for every vector
+vector<Ciphertext> get_bsgs_cipher_diagonals(const vector<Ciphertext> &U_diagonals, const GaloisKeys &gal_keys, TracedEvaluator &evaluator)
+{
+    int dimension = U_diagonals.size();
+    int n1 = ceil(sqrt(dimension));
+
+    vector<Ciphertext> bsgs_diagonals(dimension);
+    for (int l = 0; l < dimension; l++)
+    {
+        int giant_step = (l / n1) * n1;
+        if (giant_step == 0)
+        {
+            bsgs_diagonals[l] = U_diagonals[l];
+        }
+        else
+        {
+            evaluator.rotate_vector(U_diagonals[l], -giant_step, gal_keys, bsgs_diagonals[l]);
+        }
+    }
+
+    return bsgs_diagonals;
+}
+
+// Rotations get_bsgs_cipher_diagonals needs for a dimension x dimension matrix
+vector<int> get_bsgs_cipher_diagonals_steps(int dimension)
+{
+    int n1 = ceil(sqrt(dimension));
+    int n2 = (dimension + n1 - 1) / n1;
+
+    vector<int> steps;
+    for (int g = 1; g < n2; g++)
+    {
+        steps.push_back(-g * n1);
+    }
+
+    return steps;
+}
+
+// Baby-step giant-step linear transformation between ciphertext matrix and ciphertext vector
+// U_diagonals must be pre-rotated with get_bsgs_cipher_diagonals
+Ciphertext Linear_Transform_Cipher_BSGS(const Ciphertext &ct, const vector<Ciphertext> &U_diagonals, const GaloisKeys &gal_keys, TracedEvaluator &evaluator)
+{
+    TraceScope trace_scope(__func__);
+
+    if (U_diagonals.empty())
+    {
+        cerr << "Linear transformation matrix has no diagonals" << endl;
+        exit(1);
+    }
+
+    int dimension = U_diagonals.size();
+    int n1 = ceil(sqrt(dimension));
+    int n2 = (dimension + n1 - 1) / n1;
+
+    // Fill ct with duplicate
+    Ciphertext ct_rot;
+    evaluator.rotate_vector(ct, -dimension, gal_keys, ct_rot);
+    Ciphertext ct_new;
+    evaluator.add(ct, ct_rot, ct_new);
+
+    // Baby steps
+    vector<int> baby_step_rots(n1);
+    for (int b = 0; b < n1; b++)
+    {
+        baby_step_rots[b] = b;
+    }
+    vector<Ciphertext> baby_steps = rotate_vector_many(ct_new, baby_step_rots, gal_keys, evaluator);
+
+    // Giant steps, each block is accumulated and rotated into ct_prime right away
     Ciphertext ct_prime;
-    evaluator.add_many(ct_result, ct_prime);
+    for (int g = 0; g < n2; g++)
+    {
+        int giant_step = g * n1;
+        int block_size = min(n1, dimension - giant_step);
+        Ciphertext block_result;
+
+        for (int b = 0; b < block_size; b++)
+        {
+            evaluator.multiply_accumulate(baby_steps[b], U_diagonals[giant_step + b], block_result);
+        }
+
+        if (g == 0)
+        {
+            ct_prime = move(block_result);
+            continue;
+        }
+        evaluator.rotate_vector_inplace(block_result, giant_step, gal_keys);
+        evaluator.add_inplace(ct_prime, block_result);
+    }
 
     return ct_prime;
 }
 
-template <typename T>
-vector<vector<double>> get_matrix_of_ones(int position, vector<vector<T>> U)
+// Non-zero diagonals of a matrix: diagonals[i] is the encoded diagonal indices[i] of a dimension x dimension matrix
+struct SparseDiagonals
+{
+    int dimension = 0;
+    vector<int> indices;
+    vector<Plaintext> diagonals;
+};
+
+// Encodes only the diagonals (from get_all_diagonals) that have a non-zero entry
+// Permutation matrices such as U_sigma, U_tau, V_k, W_k and U_transpose have O(d) of them out of d^2
+SparseDiagonals get_sparse_diagonals(const Matrix<double> &U_diagonals, CKKSEncoder &ckks_encoder, double scale)
+{
+    SparseDiagonals sparse;
+    sparse.dimension = U_diagonals.rows();
+    for (int l = 0; l < U_diagonals.rows(); l++)
+    {
+        const double *row = U_diagonals.row_data(l);
+        if (any_of(row, row + U_diagonals.cols(), [](double x) { return x != 0; }))
+        {
+            Plaintext diagonal;
+            ckks_encoder.encode(U_diagonals.row(l), scale, diagonal);
+            sparse.indices.push_back(l);
+            sparse.diagonals.push_back(diagonal);
+        }
+    }
+
+    return sparse;
+}
+
+// Rotations Linear_Transform_Plain_Sparse needs for this matrix
+vector<int> get_sparse_diagonal_steps(const SparseDiagonals &U)
+{
+    vector<int> steps = get_rotation_plan_steps(U.indices);
+    steps.push_back(-U.dimension);
+
+    return steps;
+}
+
+// Linear Transformation function between plaintext matrix and ciphertext vector that only rotates for the non-zero diagonals
+Ciphertext Linear_Transform_Plain_Sparse(const Ciphertext &ct, const SparseDiagonals &U, FHESession &session)
+{
+    TraceScope trace_scope(__func__);
+
+    TracedEvaluator &evaluator = session.evaluator;
+    GaloisKeys &gal_keys = session.gal_keys;
+
+    if (U.indices.empty())
+    {
+        cerr << "Linear transformation matrix has no non-zero diagonal" << endl;
+        exit(1);
+    }
+
+    // Fill ct with duplicate
+    Ciphertext ct_rot;
+    evaluator.rotate_vector(ct, -U.dimension, gal_keys, ct_rot);
+    Ciphertext ct_new;
+    evaluator.add(ct, ct_rot, ct_new);
+
+    // Rotations of ct_new by the non-zero diagonal indices
+    Ciphertext ct_prime;
+    for_each_rotation(ct_new, U.indices, gal_keys, evaluator, [&](int i, const Ciphertext &ct_rot_i) {
+        evaluator.multiply_plain_accumulate(ct_rot_i, U.diagonals[i], ct_prime);
+    });
+
+    return ct_prime;
+}
+
+// Linear transformation function between ciphertext matrix and plaintext vector
+Ciphertext Linear_Transform_CipherMatrix_PlainVector(const vector<Plaintext> &pt_rotations, const vector<Ciphertext> &U_diagonals, const GaloisKeys &gal_keys, TracedEvaluator &evaluator)
+{
+    TraceScope trace_scope(__func__);
+
+    Ciphertext ct_prime;
+    for (int i = 0; i < pt_rotations.size(); i++)
+    {
+        evaluator.multiply_plain_accumulate(U_diagonals[i], pt_rotations[i], ct_prime);
+    }
+
+    return ct_prime;
+}
+
+// ----------------------------- LEVEL AND SCALE MANAGEMENT -----------------------------
+// Operands are aligned when they are combined instead of clamping scales by hand after every step:
+// - a ciphertext is only rescaled when that brings its scale closer to the scale it is combined with
+// - the higher level operand is mod switched down to the lower one and plaintexts are encoded at the level they are used
+// - plaintext multiplications encode at the scale of the prime the rescale divides by, so they leave the scale unchanged
+// Rescaling divides by primes close to, but not exactly, 2^bits. The scales of ciphertexts that took different paths
+// to the same level only differ by that rounding and count as equal when they are within get_scale_tolerance
+
+int get_chain_index(const Ciphertext &ct, FHESession &session)
 {
-    vector<vector<double>> diagonal_of_ones(U.size(), vector<double>(U.size()));
-    vector<T> U_diag = get_diagonal(position, U);
+    return session.context.get_context_data(ct.parms_id())->chain_index();
+}
 
-    int k = 0;
-    for (int i = 0; i < U.size(); i++)
+// Relative difference under which two scales at the level of ct are treated as the same
+// Every rescale above that level divided by its prime instead of the nearest power of two (about 1e-7 to 1e-6 for
+// 40 bit primes) and a multiplication at most doubles the drift of its operands. Anything larger is a plaintext
+// encoded at the wrong scale and not rounding
+double get_scale_tolerance(const Ciphertext &ct, FHESession &session)
+{
+    int chain_index = get_chain_index(ct, session);
+    double drift = 0;
+    for (auto context_data = session.context.first_context_data(); context_data && context_data->chain_index() > chain_index; context_data = context_data->next_context_data())
     {
-        for (int j = 0; j < U.size(); j++)
+        double prime = (double)context_data->parms().coeff_modulus().back().value();
+        drift = 2 * drift + fabs(prime / pow(2.0, round(log2(prime))) - 1);
+    }
+
+    // Both operands drift
+    return max(2 * drift, 1e-12);
+}
+
+// Prime the next rescale of ct divides its scale by
+double get_rescale_prime(const Ciphertext &ct, FHESession &session)
+{
+    return (double)session.context.get_context_data(ct.parms_id())->parms().coeff_modulus().back().value();
+}
+
+// Rescales ct as long as that brings its scale closer to target_scale (a pending rescale after a multiplication)
+void rescale_towards_inplace(Ciphertext &ct, double target_scale, FHESession &session)
+{
+    while (get_chain_index(ct, session) > 0)
+    {
+        double rescaled_scale = ct.scale() / get_rescale_prime(ct, session);
+        if (fabs(log2(rescaled_scale / target_scale)) >= fabs(log2(ct.scale() / target_scale)))
         {
-            if (U[i][j] == U_diag[k])
-            {
-                diagonal_of_ones[i][j] = 1;
-            }
-            else
-            {
-                diagonal_of_ones[i][j] = 0;
-            }
+            break;
         }
-        k++;
+        session.evaluator.rescale_to_next_inplace(ct);
     }
+}
 
-    return diagonal_of_ones;
+// Mod switches the higher level ciphertext of a and b down to the level of the other one
+void match_levels(Ciphertext &a, Ciphertext &b, FHESession &session)
+{
+    int a_level = get_chain_index(a, session);
+    int b_level = get_chain_index(b, session);
+    if (a_level > b_level)
+    {
+        session.evaluator.mod_switch_to_inplace(a, b.parms_id());
+    }
+    else if (a_level < b_level)
+    {
+        session.evaluator.mod_switch_to_inplace(b, a.parms_id());
+    }
+}
+
+// Copy of ct mod switched down to the level of target (ct has to be at the same or a higher level)
+Ciphertext at_level_of(const Ciphertext &ct, const Ciphertext &target, FHESession &session)
+{
+    if (ct.parms_id() == target.parms_id())
+    {
+        return ct;
+    }
+    Ciphertext switched;
+    session.evaluator.mod_switch_to(ct, target.parms_id(), switched);
+    return switched;
+}
+
+// Brings a and b to the same level and scale so that they can be added
+// The one with the larger scale is rescaled first if it has a pending rescale, then the higher level one is mod switched
+void align_inplace(Ciphertext &a, Ciphertext &b, FHESession &session)
+{
+    if (a.scale() > b.scale())
+    {
+        rescale_towards_inplace(a, b.scale(), session);
+    }
+    else
+    {
+        rescale_towards_inplace(b, a.scale(), session);
+    }
+    match_levels(a, b, session);
+
+    if (a.scale() != b.scale())
+    {
+        double difference = fabs(a.scale() / b.scale() - 1);
+        double tolerance = get_scale_tolerance(a, session);
+        if (difference > tolerance)
+        {
+            cerr << "Can't align scales 2^" << log2(a.scale()) << " and 2^" << log2(b.scale()) << ": relative difference " << difference << " is above the rescaling drift " << tolerance << endl;
+            exit(1);
+        }
+    }
+    b.scale() = a.scale();
+}
+
+// a += b
+void add_aligned_inplace(Ciphertext &a, Ciphertext b, FHESession &session)
+{
+    align_inplace(a, b, session);
+    session.evaluator.add_inplace(a, b);
+}
+
+// a -= b
+void sub_aligned_inplace(Ciphertext &a, Ciphertext b, FHESession &session)
+{
+    align_inplace(a, b, session);
+    session.evaluator.sub_inplace(a, b);
+}
+
+// a * b relinearized, the rescale is left to the next operation (pending rescales of a and b are done first)
+Ciphertext multiply_aligned(Ciphertext a, Ciphertext b, FHESession &session)
+{
+    rescale_towards_inplace(a, session.scale, session);
+    rescale_towards_inplace(b, session.scale, session);
+    match_levels(a, b, session);
+
+    Ciphertext result;
+    session.evaluator.multiply(a, b, result);
+    session.evaluator.relinearize_inplace(result, session.relin_keys);
+
+    return result;
+}
+
+// a * b, relinearized and rescaled (one level below the lower of a and b)
+Ciphertext multiply_rescale(const Ciphertext &a, const Ciphertext &b, FHESession &session)
+{
+    Ciphertext result = multiply_aligned(a, b, session);
+    session.evaluator.rescale_to_next_inplace(result);
+
+    return result;
+}
+
+// Encodes values at the level of ct with the scale of its rescale prime
+// multiply_plain with it followed by a rescale leaves the scale of ct exactly unchanged
+Plaintext encode_for_multiply(const vector<double> &values, const Ciphertext &ct, FHESession &session)
+{
+    Plaintext pt;
+    session.ckks_encoder.encode(values, ct.parms_id(), get_rescale_prime(ct, session), pt);
+    return pt;
+}
+
+Plaintext encode_for_multiply(double value, const Ciphertext &ct, FHESession &session)
+{
+    Plaintext pt;
+    session.ckks_encoder.encode(value, ct.parms_id(), get_rescale_prime(ct, session), pt);
+    return pt;
+}
+
+// a * values (slot-wise), rescaled (one level below a, same scale as a)
+Ciphertext multiply_plain_rescale(Ciphertext a, const vector<double> &values, FHESession &session)
+{
+    rescale_towards_inplace(a, session.scale, session);
+
+    Ciphertext result;
+    session.evaluator.multiply_plain(a, encode_for_multiply(values, a, session), result);
+    session.evaluator.rescale_to_next_inplace(result);
+
+    return result;
+}
+
+// a * c for a constant c, rescaled (one level below a, same scale as a)
+Ciphertext multiply_const_rescale(Ciphertext a, double c, FHESession &session)
+{
+    rescale_towards_inplace(a, session.scale, session);
+
+    Ciphertext result;
+    session.evaluator.multiply_plain(a, encode_for_multiply(c, a, session), result);
+    session.evaluator.rescale_to_next_inplace(result);
+
+    return result;
+}
+
+// a += c for a constant c (encoded at the level and scale of a)
+void add_const_inplace(Ciphertext &a, double c, FHESession &session)
+{
+    Plaintext c_pt;
+    session.ckks_encoder.encode(c, a.parms_id(), a.scale(), c_pt);
+    session.evaluator.add_plain_inplace(a, c_pt);
 }
 
 // Encodes Ciphertext Matrix into a single vector (Row ordering of a matix)
-Ciphertext C_Matrix_Encode(vector<Ciphertext> matrix, GaloisKeys gal_keys, Evaluator &evaluator)
+// The rows (values in their first dimension slots, zeros after) are merged pairwise: after round j, entry i holds the rows
+// i * 2^(j + 1) ... one after the other. That is dimension - 1 rotations by only log2(dimension) different steps,
+// and the merges of a round are independent so they run in parallel
+Ciphertext C_Matrix_Encode(const vector<Ciphertext> &matrix, const GaloisKeys &gal_keys, TracedEvaluator &evaluator, int num_threads = 0)
 {
-    Ciphertext ct_result;
+    TraceScope trace_scope(__func__);
+
     int dimension = matrix.size();
-    vector<Ciphertext> ct_rots(dimension);
-    ct_rots[0] = matrix[0];
+    vector<Ciphertext> merged = matrix;
+    for (int stride = 1; merged.size() > 1; stride *= 2)
+    {
+        vector<Ciphertext> next((merged.size() + 1) / 2);
+        parallel_for(next.size(), num_threads, [&](int i) {
+            next[i] = move(merged[2 * i]);
+            if (2 * i + 1 < merged.size())
+            {
+                Ciphertext ct_rot;
+                evaluator.rotate_vector(merged[2 * i + 1], -stride * dimension, gal_keys, ct_rot);
+                evaluator.add_inplace(next[i], ct_rot);
+            }
+        });
+        merged = move(next);
+    }
+
+    return merged[0];
+}
 
-    for (int i = 1; i < dimension; i++)
+// Rotations C_Matrix_Encode needs for a dimension x dimension matrix
+vector<int> get_matrix_encode_steps(int dimension)
+{
+    vector<int> steps;
+    for (int stride = 1; stride < dimension; stride *= 2)
     {
-        evaluator.rotate_vector(matrix[i], (i * -dimension), gal_keys, ct_rots[i]);
+        steps.push_back(-stride * dimension);
     }
 
-    evaluator.add_many(ct_rots, ct_result);
+    return steps;
+}
+
+// Row rotations used by C_Matrix_Decode
+vector<int> get_matrix_decode_rows(int dimension)
+{
+    vector<int> steps(dimension);
+    for (int i = 0; i < dimension; i++)
+    {
+        steps[i] = i * dimension;
+    }
+
+    return steps;
+}
+
+// Rotations C_Matrix_Decode needs for a dimension x dimension matrix
+vector<int> get_matrix_decode_steps(int dimension)
+{
+    return get_rotation_plan_steps(get_matrix_decode_rows(dimension));
+}
+
+// Decodes Ciphertext Matrix into vector of Ciphertexts
+// Row i is rotated to the front first so that every row can be extracted with the same mask.
+// A pending rescale of matrix is done first, the rows are one level below it with the scale of the session
+vector<Ciphertext> C_Matrix_Decode(const Ciphertext &matrix, int dimension, FHESession &session, int num_threads = 0)
+{
+    TraceScope trace_scope(__func__);
+
+    Ciphertext rows = matrix;
+    rescale_towards_inplace(rows, session.scale, session);
+
+    // Mask with 1s in the first row and 0s everywhere else (from the mask cache of the session), its scale is divided out by the rescale
+    const Plaintext &mask_pt = session.masks.get(0, dimension, 1, rows.parms_id(), get_rescale_prime(rows, session));
+
+    // Rotate each row to the front
+    vector<Ciphertext> ct_result = rotate_vector_many(rows, get_matrix_decode_rows(dimension), session.gal_keys, session.evaluator);
+
+    // multiply rows with mask
+    parallel_for(dimension, num_threads, [&](int i) {
+        session.evaluator.multiply_plain_inplace(ct_result[i], mask_pt);
+        session.evaluator.rescale_to_next_inplace(ct_result[i]);
+    });
 
     return ct_result;
 }
 
-// Decodes Ciphertext Matrix into vector of Ciphertexts
-vector<Ciphertext> C_Matrix_Decode(Ciphertext matrix, int dimension, double scale, GaloisKeys gal_keys, CKKSEncoder &ckks_encoder, Evaluator &evaluator)
+// ----------------------------- RESULT PACKING -----------------------------
+
+// Number of slots pack_slots fills per block: all the results up to 64 of them, about sqrt(count) beyond,
+// and never more than the max_block_size slots each result is replicated over
+int get_pack_block_size(int count, int max_block_size)
 {
+    int block_size = count <= 64 ? count : ceil(sqrt(count));
+    return max(1, min(block_size, max_block_size));
+}
 
-    vector<Ciphertext> ct_result(dimension);
-    for (int i = 0; i < dimension; i++)
+// Rotations pack_slots needs for count results
+vector<int> get_pack_slots_steps(int count, int max_block_size)
+{
+    int block_size = get_pack_block_size(count, max_block_size);
+    if (block_size >= count)
     {
-        // Create masks vector with 1s and 0s
-        // Fill mask vector with 0s
-        vector<double> mask_vec(pow(dimension, 2), 0);
+        return {};
+    }
+    return {-block_size};
+}
 
-        // Store 1s in mask vector at dimension offset. Offset = j + (i * dimension)
-        for (int j = 0; j < dimension; j++)
-        {
-            mask_vec[j + (i * dimension)] = 1;
-        }
+// Packs results whose value is replicated over (at least) their first max_block_size slots, e.g. cipher_dot_product results,
+// into one ciphertext holding factor * results[i] in slot i.
+// Blocks of results are multiplied by the one-hot masks of the session mask cache, so after the first call nothing is encoded.
+// The blocks are rescaled and merged with rotations by -block_size (a single Galois key, see get_pack_slots_steps):
+// count plaintext multiplications and count / block_size rotations instead of count encoded masks.
+// The result is one level below the results with the same scale
+Ciphertext pack_slots(const vector<Ciphertext> &results, int max_block_size, FHESession &session, double factor = 1, int num_threads = 0)
+{
+    TraceScope trace_scope(__func__);
 
-        // Encode mask vector
-        Plaintext mask_pt;
-        ckks_encoder.encode(mask_vec, scale, mask_pt);
+    int count = results.size();
+    int block_size = get_pack_block_size(count, max_block_size);
+    int num_blocks = (count + block_size - 1) / block_size;
+    parms_id_type parms_id = results[0].parms_id();
+    double mask_scale = get_rescale_prime(results[0], session);
 
-        // multiply matrix with mask
-        Ciphertext ct_row;
-        evaluator.multiply_plain(matrix, mask_pt, ct_row);
+    vector<Ciphertext> blocks(num_blocks);
+    parallel_for(num_blocks, num_threads, [&](int g) {
+        int begin = g * block_size;
+        int end = min(count, begin + block_size);
 
-        // rotate row (not the first one)
-        if (i != 0)
+        for (int i = begin; i < end; i++)
         {
-            evaluator.rotate_vector_inplace(ct_row, i * dimension, gal_keys);
+            const Plaintext &mask_pt = session.masks.get(i - begin, i - begin + 1, factor, parms_id, mask_scale);
+            session.evaluator.multiply_plain_accumulate(results[i], mask_pt, blocks[g]);
         }
+        session.evaluator.rescale_to_next_inplace(blocks[g]);
+    });
 
-        // store in result
-        ct_result[i] = ct_row;
+    // packed = blocks[0] + rot(blocks[1] + rot(blocks[2] + ..., -block_size), -block_size)
+    Ciphertext packed = blocks[num_blocks - 1];
+    for (int g = num_blocks - 2; g >= 0; g--)
+    {
+        session.evaluator.rotate_vector_inplace(packed, -block_size, session.gal_keys);
+        session.evaluator.add_inplace(packed, blocks[g]);
     }
 
-    return ct_result;
+    return packed;
 }
 
-template <typename T>
-vector<double> pad_zero(int offset, vector<T> U_vec)
-{
+// ----------------------------- DOT PRODUCT -----------------------------
 
-    vector<double> result_vec(pow(U_vec.size(), 2));
-    // Fill before U_vec
-    for (int i = 0; i < offset; i++)
-    {
-        result_vec[i] = 0;
-    }
-    // Fill U_vec
-    for (int i = 0; i < U_vec.size(); i++)
-    {
-        result_vec[i + offset] = U_vec[i];
-    }
-    // Fill after U_vec
-    for (int i = offset + U_vec.size(); i < result_vec.size(); i++)
+// Number of leading slots cipher_dot_product replicates its result over (size rounded up to a power of two)
+int get_dot_product_width(int size)
+{
+    int padded_size = 1;
+    while (padded_size < size)
     {
-        result_vec[i] = 0;
+        padded_size *= 2;
     }
-    return result_vec;
+
+    return padded_size;
 }
 
-// U_transpose
-template <typename T>
-vector<vector<double>> get_U_transpose(vector<vector<T>> U)
+// Rotation steps used by cipher_dot_product for vectors of a given size
+// Pass them to session.create_galois_keys(steps) to only generate the keys the dot product needs
+vector<int> get_dot_product_steps(int size)
 {
+    int padded_size = get_dot_product_width(size);
 
-    int dimension = U.size();
-    int dimensionSq = pow(dimension, 2);
-    vector<vector<double>> U_transpose(dimensionSq, vector<double>(dimensionSq));
-
-    int tranposed_row = 0;
-
-    for (int i = 0; i < dimension; i++)
+    vector<int> steps = {-padded_size};
+    for (int step = 1; step < padded_size; step *= 2)
     {
-        // Get matrix of ones at position k
-        vector<vector<double>> one_matrix = get_matrix_of_ones(i, U);
-        print_full_matrix(one_matrix);
-
-        // Loop over matrix of ones
-        for (int offset = 0; offset < dimension; offset++)
-        {
-            vector<double> temp_fill = pad_zero(offset * dimension, one_matrix[0]);
-
-            U_transpose[tranposed_row] = temp_fill;
-            tranposed_row++;
-        }
+        steps.push_back(step);
     }
 
-    return U_transpose;
+    return steps;
 }
 
 // Ciphertext dot product
-Ciphertext cipher_dot_product(Ciphertext ctA, Ciphertext ctB, int size, RelinKeys relin_keys, GaloisKeys gal_keys, Evaluator &evaluator)
+Ciphertext cipher_dot_product(const Ciphertext &ctA, const Ciphertext &ctB, int size, const RelinKeys &relin_keys, const GaloisKeys &gal_keys, TracedEvaluator &evaluator)
 {
-
-    // cout << "\nCTA Info:\n";
-    // cout << "\tLevel:\t" << context->get_context_data(ctA.parms_id())->chain_index() << endl;
-    // cout << "\tScale:\t" << log2(ctA.scale()) << endl;
-    // ios old_fmt(nullptr);
-    // old_fmt.copyfmt(cout);
-    // cout << fixed << setprecision(10);
-    // cout << "\tExact Scale:\t" << ctA.scale() << endl;
-    // cout.copyfmt(old_fmt);
-    // cout << "\tSize:\t" << ctA.size() << endl;
+    TraceScope trace_scope(__func__);
 
     Ciphertext mult;
 
     // Component-wise multiplication
     evaluator.multiply(ctA, ctB, mult);
 
-    // cout << "\nMult Info:\n";
-    // cout << "\tLevel:\t" << context->get_context_data(mult.parms_id())->chain_index() << endl;
-    // cout << "\tScale:\t" << log2(mult.scale()) << endl;
-    // cout << "\tExact Scale:\t" << mult.scale() << endl;
-    // cout << "\tSize:\t" << mult.size() << endl;
-
     evaluator.relinearize_inplace(mult, relin_keys);
     evaluator.rescale_to_next_inplace(mult);
 
-    // cout << "\nMult Info:\n";
-    // cout << "\tLevel:\t" << context->get_context_data(mult.parms_id())->chain_index() << endl;
-    // cout << "\tScale:\t" << log2(mult.scale()) << endl;
-    // ios old_fmt1(nullptr);
-    // old_fmt1.copyfmt(cout);
-    // cout << fixed << setprecision(10);
-    // cout << "\tExact Scale:\t" << mult.scale() << endl;
-    // cout.copyfmt(old_fmt1);
-    // cout << "\tSize:\t" << mult.size() << endl;
-
-    // Fill with duplicate
+    // Round size up to a power of two, slots between size and padded_size hold zeros
+    int padded_size = get_dot_product_width(size);
+
+    // Fill with duplicate so that every slot in [0, padded_size) sees the whole vector
     Ciphertext zero_filled;
-    evaluator.rotate_vector(mult, -size, gal_keys, zero_filled); // vector has zeros now
-
-    // cout << "\nZero Filled Info:\n";
-    // cout << "\tLevel:\t" << context->get_context_data(zero_filled.parms_id())->chain_index() << endl;
-    // cout << "\tScale:\t" << log2(zero_filled.scale()) << endl;
-    // cout << "\tExact Scale:\t" << zero_filled.scale() << endl;
-    // cout << "\tSize:\t" << zero_filled.size() << endl;
-
-    Ciphertext dup;
-    evaluator.add(mult, zero_filled, dup); // vector has duplicate now
-
-    // cout << "\nDup Info:\n";
-    // cout << "\tLevel:\t" << context->get_context_data(dup.parms_id())->chain_index() << endl;
-    // cout << "\tScale:\t" << log2(dup.scale()) << endl;
-    // cout << "\tExact Scale:\t" << dup.scale() << endl;
-    // cout << "\tSize:\t" << dup.size() << endl;
-
-    for (int i = 1; i < size; i++)
-    {
-        evaluator.rotate_vector_inplace(dup, 1, gal_keys);
-        evaluator.add_inplace(mult, dup);
-    }
-
-    // cout << "\nMult Info:\n";
-    // cout << "\tLevel:\t" << context->get_context_data(mult.parms_id())->chain_index() << endl;
-    // cout << "\tScale:\t" << log2(mult.scale()) << endl;
-    // ios old_fmt2(nullptr);
-    // old_fmt2.copyfmt(cout);
-    // cout << fixed << setprecision(10);
-    // cout << "\tExact Scale:\t" << mult.scale() << endl;
-    // cout.copyfmt(old_fmt2);
-    // cout << "\tSize:\t" << mult.size() << endl;
-
-    // Manual Rescale
-    mult.scale() = pow(2, (int)log2(mult.scale()));
-
-    // cout << "\nMult Info:\n";
-    // cout << "\tLevel:\t" << context->get_context_data(mult.parms_id())->chain_index() << endl;
-    // cout << "\tScale:\t" << log2(mult.scale()) << endl;
-    // ios old_fmt3(nullptr);
-    // old_fmt3.copyfmt(cout);
-    // cout << fixed << setprecision(10);
-    // cout << "\tExact Scale:\t" << mult.scale() << endl;
-    // cout.copyfmt(old_fmt3);
-    // cout << "\tSize:\t" << mult.size() << endl;
+    evaluator.rotate_vector(mult, -padded_size, gal_keys, zero_filled); // vector has zeros now
+    evaluator.add_inplace(mult, zero_filled);                           // vector has duplicate now
+
+    // Rotate and sum with power-of-two steps (log2(size) rotations)
+    for (int step = 1; step < padded_size; step *= 2)
+    {
+        Ciphertext ct_rot;
+        evaluator.rotate_vector(mult, step, gal_keys, ct_rot);
+        evaluator.add_inplace(mult, ct_rot);
+    }
 
     return mult;
 }
 
 // Helper for Tree method, computes powers of x in a tree
-void compute_all_powers(const Ciphertext &ctx, int degree, Evaluator &evaluator, RelinKeys &relin_keys, vector<Ciphertext> &powers)
+void compute_all_powers(const Ciphertext &ctx, int degree, TracedEvaluator &evaluator, RelinKeys &relin_keys, vector<Ciphertext> &powers)
 {
 
     powers.resize(degree + 1);
@@ -546,60 +1666,208 @@ void compute_all_powers(const Ciphertext &ctx, int degree, Evaluator &evaluator,
     return;
 }
 
-// Gets a random float between a and b
-float RandomFloat(float a, float b)
-{
-    float random = ((float)rand()) / (float)RAND_MAX;
-    float diff = b - a;
-    float r = random * diff;
-    return a + r;
-}
+// ----------------------------- POLYNOMIAL EVALUATION -----------------------------
+// Products are rescaled right away and the operands are aligned with the helpers of the level and scale management
 
-// CSV to string matrix converter
-vector<vector<string>> CSVtoMatrix(string filename)
+// Baby-step giant-step evaluation of sum_i coeffs[i] * t^i
+// baby_powers holds t^0 ... t^k (t^0 unused) and giant_powers holds t^k, t^2k, t^4k, ...
+// Blocks of k coefficients only need scalar multiplications with the baby powers, they are then combined
+// recursively as p = p_high * t^(k * 2^j) + p_low. Zero coefficients are skipped, false is returned if all of them are zero
+bool evaluate_polynomial_bsgs(const vector<double> &coeffs, const vector<Ciphertext> &baby_powers, const vector<Ciphertext> &giant_powers, FHESession &session, Ciphertext &result)
 {
-    vector<vector<string>> result_matrix;
+    int k = baby_powers.size() - 1;
+    int n = coeffs.size();
 
-    ifstream data(filename);
-    string line;
-    int line_count = 0;
-    while (getline(data, line))
+    if (n <= k)
     {
-        stringstream lineStream(line);
-        string cell;
-        vector<string> parsedRow;
-        while (getline(lineStream, cell, ','))
+        bool has_terms = false;
+        for (int i = 1; i < n; i++)
         {
-            parsedRow.push_back(cell);
+            if (coeffs[i] == 0)
+            {
+                continue;
+            }
+            Ciphertext term = multiply_const_rescale(baby_powers[i], coeffs[i], session);
+            if (has_terms)
+            {
+                add_aligned_inplace(result, term, session);
+            }
+            else
+            {
+                result = term;
+                has_terms = true;
+            }
         }
-        // Skip first line since it has text instead of numbers
-        if (line_count != 0)
+
+        if (n > 0 && coeffs[0] != 0)
         {
-            result_matrix.push_back(parsedRow);
+            if (!has_terms)
+            {
+                Plaintext c_pt;
+                session.ckks_encoder.encode(coeffs[0], session.scale, c_pt);
+                session.encryptor.encrypt(c_pt, result);
+                return true;
+            }
+            add_const_inplace(result, coeffs[0], session);
         }
-        line_count++;
+
+        return has_terms;
     }
-    return result_matrix;
+
+    // Split at the largest m = k * 2^j below n
+    int j = 0;
+    while (k * (2 << j) < n)
+    {
+        j++;
+    }
+    int m = k << j;
+
+    vector<double> low_coeffs(coeffs.begin(), coeffs.begin() + m);
+    vector<double> high_coeffs(coeffs.begin() + m, coeffs.end());
+    auto is_zero = [](double c) { return c == 0; };
+    bool high_is_const = all_of(high_coeffs.begin() + 1, high_coeffs.end(), is_zero);
+    bool low_is_const = all_of(low_coeffs.begin() + 1, low_coeffs.end(), is_zero);
+
+    if (high_is_const && high_coeffs[0] == 0)
+    {
+        return evaluate_polynomial_bsgs(low_coeffs, baby_powers, giant_powers, session, result);
+    }
+
+    // Constant parts are applied with plaintext operations instead of encrypting them
+    if (high_is_const)
+    {
+        result = multiply_const_rescale(giant_powers[j], high_coeffs[0], session);
+    }
+    else
+    {
+        Ciphertext high;
+        evaluate_polynomial_bsgs(high_coeffs, baby_powers, giant_powers, session, high);
+        result = multiply_rescale(high, giant_powers[j], session);
+    }
+
+    if (low_is_const)
+    {
+        if (low_coeffs[0] != 0)
+        {
+            add_const_inplace(result, low_coeffs[0], session);
+        }
+    }
+    else
+    {
+        Ciphertext low;
+        evaluate_polynomial_bsgs(low_coeffs, baby_powers, giant_powers, session, low);
+        add_aligned_inplace(result, low, session);
+    }
+
+    return true;
+}
+
+// Powers of t used by evaluate_polynomial_bsgs for a polynomial with num_coeffs coefficients
+// k is the smallest power of two with k^2 >= num_coeffs so that the baby powers need ceil(log2(k)) levels.
+// t^k and the giant powers are only computed when the polynomial has more than k coefficients
+void compute_bsgs_powers(const Ciphertext &t, int num_coeffs, FHESession &session, vector<Ciphertext> &baby_powers, vector<Ciphertext> &giant_powers)
+{
+    int k = 1;
+    while (k * k < num_coeffs)
+    {
+        k *= 2;
+    }
+
+    int max_power = max(1, min(k, num_coeffs - 1));
+    compute_all_powers(t, max_power, session.evaluator, session.relin_keys, baby_powers);
+    baby_powers.resize(k + 1);
+
+    giant_powers.clear();
+    if (num_coeffs > k)
+    {
+        giant_powers.push_back(baby_powers[k]);
+        for (int m = 2 * k; m < num_coeffs; m *= 2)
+        {
+            giant_powers.push_back(multiply_rescale(giant_powers.back(), giant_powers.back(), session));
+        }
+    }
+}
+
+// Levels evaluate_polynomial consumes for a polynomial of the given degree
+int get_polynomial_depth(int degree)
+{
+    int depth = 1;
+    for (int power = 1; power < degree; power *= 2)
+    {
+        depth++;
+    }
+    return depth;
 }
 
-// String matrix to float matrix converter
-vector<vector<double>> stringToDoubleMatrix(vector<vector<string>> matrix)
+// Evaluates the polynomial sum_i coeffs[i] * x^i on a ciphertext
+// Uses baby-step giant-step evaluation, i.e. O(sqrt(d)) non-scalar multiplications and about ceil(log2(d)) + 1 levels.
+// Polynomials whose even coefficients are all zero except the constant (like the sigmoid approximations) are
+// evaluated as c_0 + x * q(x^2), which only computes the powers of x^2
+Ciphertext evaluate_polynomial(const Ciphertext &ctx, const vector<double> &coeffs, FHESession &session)
 {
-    vector<vector<double>> result(matrix.size(), vector<double>(matrix[0].size()));
-    for (int i = 0; i < matrix.size(); i++)
+    TraceScope trace_scope(__func__);
+
+    // ctx may still have a pending rescale (e.g. straight out of a linear transformation)
+    Ciphertext x = ctx;
+    rescale_towards_inplace(x, session.scale, session);
+
+    int degree = coeffs.size() - 1;
+    bool odd = degree >= 3;
+    for (int i = 2; i <= degree; i += 2)
+    {
+        odd = odd && coeffs[i] == 0;
+    }
+
+    Ciphertext result;
+    vector<Ciphertext> baby_powers, giant_powers;
+    if (odd)
+    {
+        // q(y) = c_1 + c_3 * y + c_5 * y^2 + ... with y = x^2
+        vector<double> q_coeffs;
+        for (int i = 1; i <= degree; i += 2)
+        {
+            q_coeffs.push_back(coeffs[i]);
+        }
+
+        Ciphertext y = multiply_rescale(x, x, session);
+        compute_bsgs_powers(y, q_coeffs.size(), session, baby_powers, giant_powers);
+        Ciphertext q;
+        if (!evaluate_polynomial_bsgs(q_coeffs, baby_powers, giant_powers, session, q))
+        {
+            cerr << "Polynomial has no non-zero coefficient" << endl;
+            exit(1);
+        }
+
+        result = multiply_rescale(x, q, session);
+        if (coeffs[0] != 0)
+        {
+            add_const_inplace(result, coeffs[0], session);
+        }
+    }
+    else
     {
-        for (int j = 0; j < matrix[0].size(); j++)
+        compute_bsgs_powers(x, coeffs.size(), session, baby_powers, giant_powers);
+        if (!evaluate_polynomial_bsgs(coeffs, baby_powers, giant_powers, session, result))
         {
-            result[i][j] = ::atof(matrix[i][j].c_str());
-            result[i][j] = static_cast<double>(result[i][j]);
+            cerr << "Polynomial has no non-zero coefficient" << endl;
+            exit(1);
         }
     }
 
     return result;
 }
 
+// Gets a random float between a and b
+float RandomFloat(float a, float b)
+{
+    float random = ((float)rand()) / (float)RAND_MAX;
+    float diff = b - a;
+    float r = random * diff;
+    return a + r;
+}
+
 // Mean calculation
-double getMean(vector<double> input_vec)
+double getMean(const vector<double> &input_vec)
 {
     float mean = 0;
     for (int i = 0; i < input_vec.size(); i++)
@@ -612,7 +1880,7 @@ double getMean(vector<double> input_vec)
 }
 
 // Standard Dev calculation
-double getStandardDev(vector<double> input_vec, double mean)
+double getStandardDev(const vector<double> &input_vec, double mean)
 {
     double variance = 0;
     for (int i = 0; i < input_vec.size(); i++)
@@ -626,11 +1894,11 @@ double getStandardDev(vector<double> input_vec, double mean)
 }
 
 // Standard Scaler
-vector<vector<double>> standard_scaler_double(vector<vector<double>> input_matrix)
+Matrix<double> standard_scaler_double(const Matrix<double> &input_matrix)
 {
-    int rowSize = input_matrix.size();
-    int colSize = input_matrix[0].size();
-    vector<vector<double>> result_matrix(rowSize, vector<double>(colSize));
+    int rowSize = input_matrix.rows();
+    int colSize = input_matrix.cols();
+    Matrix<double> result_matrix(rowSize, colSize);
 
     // Optimization: Get Means and Standard Devs first then do the scaling
     // first pass: get means and standard devs
@@ -638,13 +1906,7 @@ vector<vector<double>> standard_scaler_double(vector<vector<double>> input_matri
     vector<double> stdev_vec(colSize);
     for (int i = 0; i < colSize; i++)
     {
-        vector<double> column(rowSize);
-        for (int j = 0; j < rowSize; j++)
-        {
-            // cout << input_matrix[j][i] << ", ";
-            column[j] = input_matrix[j][i];
-            // cout << column[j] << ", ";
-        }
+        vector<double> column = input_matrix.transposed().row(i);
 
         means_vec[i] = getMean(column);
         stdev_vec[i] = getStandardDev(column, means_vec[i]);
@@ -657,7 +1919,7 @@ vector<vector<double>> standard_scaler_double(vector<vector<double>> input_matri
     {
         for (int j = 0; j < colSize; j++)
         {
-            result_matrix[i][j] = (input_matrix[i][j] - means_vec[j]) / stdev_vec[j];
+            result_matrix(i, j) = (input_matrix(i, j) - means_vec[j]) / stdev_vec[j];
             // cout << "RESULT at i = " << i << ":\t" << result_matrix[i][j] << endl;
         }
     }
@@ -666,19 +1928,20 @@ vector<vector<double>> standard_scaler_double(vector<vector<double>> input_matri
 }
 
 // Matrix Transpose
+// Contiguous copy, input_matrix.transposed() gives a view without copying
 template <typename T>
-vector<vector<T>> transpose_matrix(vector<vector<T>> input_matrix)
+Matrix<T> transpose_matrix(const Matrix<T> &input_matrix)
 {
 
-    int rowSize = input_matrix.size();
-    int colSize = input_matrix[0].size();
-    vector<vector<T>> transposed(colSize, vector<T>(rowSize));
+    int rowSize = input_matrix.rows();
+    int colSize = input_matrix.cols();
+    Matrix<T> transposed(colSize, rowSize);
 
     for (int i = 0; i < rowSize; i++)
     {
         for (int j = 0; j < colSize; j++)
         {
-            transposed[j][i] = input_matrix[i][j];
+            transposed(j, i) = input_matrix(i, j);
         }
     }
 
@@ -687,7 +1950,7 @@ vector<vector<T>> transpose_matrix(vector<vector<T>> input_matrix)
 
 // Print entire vector
 template <typename T>
-void print_full_vector(vector<T> vec)
+void print_full_vector(const vector<T> &vec)
 {
     cout << "\t[ ";
     for (unsigned int i = 0; i < vec.size() - 1; i++)
@@ -697,155 +1960,471 @@ void print_full_vector(vector<T> vec)
     cout << vec[vec.size() - 1] << " ]" << endl;
 }
 
-// U_sigma
-template <typename T>
-vector<vector<double>> get_U_sigma(vector<vector<T>> U)
+// Non-zero diagonals of a dimensionSq x dimensionSq permutation matrix, diagonal indices[i] is values.row(i)
+struct PermutationDiagonals
+{
+    int dimension = 0;
+    vector<int> indices;
+    Matrix<double> values;
+};
+
+// Diagonals of the permutation matrix with a single one per row, at column permutation(t) of row t
+// Row t puts its one on diagonal (permutation(t) - t) mod size, so only the diagonals that are hit are allocated
+// This never materializes the size x size matrix: a permutation with m non-zero diagonals needs m * size doubles
+PermutationDiagonals get_permutation_diagonals(int size, function<int(int)> permutation)
 {
-    int dimension = U.size();
-    int dimensionSq = pow(dimension, 2);
-    vector<vector<double>> U_sigma(dimensionSq, vector<double>(dimensionSq));
+    vector<int> diagonal_of_row(size);
+    vector<bool> is_used(size, false);
+    for (int t = 0; t < size; t++)
+    {
+        int l = ((permutation(t) - t) % size + size) % size;
+        diagonal_of_row[t] = l;
+        is_used[l] = true;
+    }
 
-    int k = 0;
-    int sigma_row = 0;
-    for (int offset = 0; offset < dimensionSq; offset += dimension)
+    // Row of each used diagonal in result.values, in increasing diagonal order
+    PermutationDiagonals result;
+    result.dimension = size;
+    vector<int> position(size, -1);
+    for (int l = 0; l < size; l++)
     {
-        // Get the matrix of ones at position k
-        vector<vector<double>> one_matrix = get_matrix_of_ones(k, U);
-        // print_full_matrix(one_matrix);
-        // Loop over the matrix of ones
-        for (int one_matrix_index = 0; one_matrix_index < dimension; one_matrix_index++)
+        if (is_used[l])
         {
-            // Pad with zeros the vector of one
-            vector<double> temp_fill = pad_zero(offset, one_matrix[one_matrix_index]);
-            // Store vector in U_sigma at position index_sigma
-            // print_full_vector(temp_fill);
-            U_sigma[sigma_row] = temp_fill;
-            sigma_row++;
+            position[l] = result.indices.size();
+            result.indices.push_back(l);
         }
+    }
 
-        k++;
+    result.values = Matrix<double>(result.indices.size(), size);
+    for (int t = 0; t < size; t++)
+    {
+        result.values(position[diagonal_of_row[t]], t) = 1;
     }
 
-    return U_sigma;
+    return result;
 }
 
-// U_sigma
-template <typename T>
-vector<vector<double>> get_U_tau(vector<vector<T>> U)
+// Permutation matrices of the matrix multiplication (U_sigma, U_tau, V_k, W_k) and of the transposition
+// Row t = i * dimension + j of the d^2 x d^2 matrix acts on entry (i, j) of a row-major encoded d x d matrix
+// U_sigma: row (i, j) picks column (i, (i + j) % d), 2d - 1 diagonals
+PermutationDiagonals get_U_sigma_diagonals(int dimension)
 {
-    int dimension = U.size();
-    int dimensionSq = pow(dimension, 2);
-    vector<vector<double>> U_tau(dimensionSq, vector<double>(dimensionSq));
+    return get_permutation_diagonals(dimension * dimension, [dimension](int t) {
+        int i = t / dimension, j = t % dimension;
+        return i * dimension + (i + j) % dimension;
+    });
+}
 
-    int tau_row = 0;
-    // Divide the matrix into blocks of size = dimension
-    for (int i = 0; i < dimension; i++)
+// U_tau: row (i, j) picks column ((i + j) % d, j), d diagonals
+PermutationDiagonals get_U_tau_diagonals(int dimension)
+{
+    return get_permutation_diagonals(dimension * dimension, [dimension](int t) {
+        int i = t / dimension, j = t % dimension;
+        return ((i + j) % dimension) * dimension + j;
+    });
+}
+
+// V_k: row (i, j) picks column (i, (j + k) % d), 2 diagonals
+PermutationDiagonals get_V_k_diagonals(int dimension, int k)
+{
+    if (k < 1 || k >= dimension)
+    {
+        cerr << "Invalid K for matrix V_k: " << to_string(k) << ". Choose k to be between 1 and " << to_string(dimension) << endl;
+        exit(1);
+    }
+    return get_permutation_diagonals(dimension * dimension, [dimension, k](int t) {
+        int i = t / dimension, j = t % dimension;
+        return i * dimension + (j + k) % dimension;
+    });
+}
+
+// W_k: row (i, j) picks column ((i + k) % d, j), 1 diagonal
+PermutationDiagonals get_W_k_diagonals(int dimension, int k)
+{
+    if (k < 1 || k >= dimension)
+    {
+        cerr << "Invalid K for matrix W_k: " << to_string(k) << ". Choose k to be between 1 and " << to_string(dimension) << endl;
+        exit(1);
+    }
+    return get_permutation_diagonals(dimension * dimension, [dimension, k](int t) {
+        int i = t / dimension, j = t % dimension;
+        return ((i + k) % dimension) * dimension + j;
+    });
+}
+
+// U_transpose: row (i, j) picks column (j, i), 2d - 1 diagonals
+PermutationDiagonals get_U_transpose_diagonals(int dimension)
+{
+    return get_permutation_diagonals(dimension * dimension, [dimension](int t) {
+        int i = t / dimension, j = t % dimension;
+        return j * dimension + i;
+    });
+}
+
+// Encodes the diagonals of a permutation matrix (all of them are non-zero)
+SparseDiagonals get_sparse_diagonals(const PermutationDiagonals &U_diagonals, CKKSEncoder &ckks_encoder, double scale)
+{
+    SparseDiagonals sparse;
+    sparse.dimension = U_diagonals.dimension;
+    sparse.indices = U_diagonals.indices;
+    sparse.diagonals.resize(U_diagonals.indices.size());
+    for (int i = 0; i < U_diagonals.indices.size(); i++)
+    {
+        ckks_encoder.encode(U_diagonals.values.row(i), scale, sparse.diagonals[i]);
+    }
+
+    return sparse;
+}
+
+// Encoded non-zero diagonals of U_sigma, U_tau, V_k and W_k used by the ciphertext-ciphertext matrix multiplication
+struct MatMulDiagonals
+{
+    SparseDiagonals U_sigma;
+    SparseDiagonals U_tau;
+    vector<SparseDiagonals> V;
+    vector<SparseDiagonals> W;
+};
+
+// Rotations the matrix multiplication linear transformations need
+vector<int> get_matmul_steps(const MatMulDiagonals &diagonals)
+{
+    vector<int> steps = get_sparse_diagonal_steps(diagonals.U_sigma);
+    vector<int> U_tau_steps = get_sparse_diagonal_steps(diagonals.U_tau);
+    steps.insert(steps.end(), U_tau_steps.begin(), U_tau_steps.end());
+    for (int k = 0; k < diagonals.V.size(); k++)
     {
-        // Get the matrix of ones at position i
-        vector<vector<double>> one_matrix = get_matrix_of_ones(0, U);
-        // print_full_matrix(one_matrix);
-        // Loop over the matrix of ones and store in U_tau the rows of the matrix of ones with the offset
-        int offset = i * dimension;
+        vector<int> V_steps = get_sparse_diagonal_steps(diagonals.V[k]);
+        vector<int> W_steps = get_sparse_diagonal_steps(diagonals.W[k]);
+        steps.insert(steps.end(), V_steps.begin(), V_steps.end());
+        steps.insert(steps.end(), W_steps.begin(), W_steps.end());
+    }
+
+    return steps;
+}
 
-        for (int j = 0; j < dimension; j++)
+// Number of independent d x d products one ciphertext holds
+// Matrix b of a batch lives in the slots [b * 2d^2, b * 2d^2 + d^2), the d^2 slots after it are the room the
+// linear transformations duplicate it into, so rotations never move values from one matrix into another
+int get_matmul_batch_capacity(int dimension, size_t slot_count)
+{
+    return slot_count / (2 * dimension * dimension);
+}
+
+// Encodes the diagonals of a permutation matrix once for every matrix of a batch (see get_matmul_batch_capacity)
+// A single matrix in the first d^2 slots is the batch of size 1, the same diagonals serve both
+SparseDiagonals get_batched_sparse_diagonals(const PermutationDiagonals &U_diagonals, parms_id_type parms_id, double scale, CKKSEncoder &ckks_encoder)
+{
+    int size = U_diagonals.dimension;
+    int batch_capacity = ckks_encoder.slot_count() / (2 * size);
+
+    SparseDiagonals sparse;
+    sparse.dimension = size;
+    sparse.indices = U_diagonals.indices;
+    sparse.diagonals.resize(U_diagonals.indices.size());
+    vector<double> diagonal(ckks_encoder.slot_count(), 0);
+    for (int i = 0; i < U_diagonals.indices.size(); i++)
+    {
+        for (int b = 0; b < batch_capacity; b++)
         {
-            vector<double> temp_fill = pad_zero(offset, one_matrix[j]);
-            // print_full_vector(temp_fill);
-            U_tau[tau_row] = temp_fill;
-            tau_row++;
-            // Update offset
-            if (offset + dimension == dimensionSq)
-            {
-                offset = 0;
-            }
-            else
-            {
-                offset += dimension;
-            }
+            copy(U_diagonals.values.row_data(i), U_diagonals.values.row_data(i) + size, diagonal.begin() + b * 2 * size);
         }
+        ckks_encoder.encode(diagonal, parms_id, scale, sparse.diagonals[i]);
     }
 
-    return U_tau;
+    return sparse;
 }
 
-// V_k
-template <typename T>
-vector<vector<double>> get_V_k(vector<vector<T>> U, int k)
+// Encodes the diagonals CC_Matrix_Multiplication needs
+// U_sigma and U_tau are encoded at the first level and V_k and W_k at the next one, each with the prime the following
+// rescale divides by as scale, so the rescaled linear transformations keep the scale of the inputs exactly
+MatMulDiagonals get_matmul_diagonals(int dimension, FHESession &session)
+{
+    auto first_data = session.context.first_context_data();
+    auto next_data = first_data->next_context_data() ? first_data->next_context_data() : first_data;
+    double first_scale = (double)first_data->parms().coeff_modulus().back().value();
+    double next_scale = (double)next_data->parms().coeff_modulus().back().value();
+
+    MatMulDiagonals diagonals;
+    diagonals.U_sigma = get_batched_sparse_diagonals(get_U_sigma_diagonals(dimension), first_data->parms_id(), first_scale, session.ckks_encoder);
+    diagonals.U_tau = get_batched_sparse_diagonals(get_U_tau_diagonals(dimension), first_data->parms_id(), first_scale, session.ckks_encoder);
+    diagonals.V.resize(dimension - 1);
+    diagonals.W.resize(dimension - 1);
+    parallel_for(dimension - 1, 0, [&](int k) {
+        diagonals.V[k] = get_batched_sparse_diagonals(get_V_k_diagonals(dimension, k + 1), next_data->parms_id(), next_scale, session.ckks_encoder);
+        diagonals.W[k] = get_batched_sparse_diagonals(get_W_k_diagonals(dimension, k + 1), next_data->parms_id(), next_scale, session.ckks_encoder);
+    });
+
+    return diagonals;
+}
+
+// Ciphertext-ciphertext matrix multiplication of d x d matrices encoded row by row in ctA and ctB (A.B = sum_k (V_k . U_sigma . A) * (W_k . U_tau . B))
+// ctA and ctB can hold a batch of matrices (encrypt_matrix_batch), each one is multiplied with the matrix at the same position.
+// The inputs have to be at the first level, the diagonals from get_matmul_diagonals (or a DiagonalCache).
+// Step 1 and the d shifted V_k / W_k transformations of step 2 run in parallel, the d products stay unrelinearized until
+// they are summed, then the sum is relinearized and rescaled once.
+// Result is three levels below the inputs with a scale of scale(ctA) * scale(ctB) / prime
+Ciphertext CC_Matrix_Multiplication(const Ciphertext &ctA, const Ciphertext &ctB, int dimension, const MatMulDiagonals &diagonals, FHESession &session, int num_threads = 0)
 {
+    TraceScope trace_scope(__func__);
 
-    int dimension = U.size();
-    if (k < 1 || k >= dimension)
+    TracedEvaluator &evaluator = session.evaluator;
+
+    if (ctA.parms_id() != diagonals.U_sigma.diagonals[0].parms_id() || ctB.parms_id() != diagonals.U_tau.diagonals[0].parms_id())
     {
-        cerr << "Invalid K for matrix V_k: " << to_string(k) << ". Choose k to be between 1 and " << to_string(dimension) << endl;
+        cerr << "Matrix multiplication inputs have to be at the level of the U_sigma and U_tau diagonals" << endl;
         exit(1);
     }
 
-    int dimensionSq = pow(dimension, 2);
-    vector<vector<double>> V_k(dimensionSq, vector<double>(dimensionSq));
+    // Step 1: U_sigma . A and U_tau . B
+    Ciphertext ctA_sigma;
+    Ciphertext ctB_tau;
+    parallel_for(2, num_threads, [&](int side) {
+        Ciphertext &result = side == 0 ? ctA_sigma : ctB_tau;
+        result = Linear_Transform_Plain_Sparse(side == 0 ? ctA : ctB, side == 0 ? diagonals.U_sigma : diagonals.U_tau, session);
+        evaluator.rescale_to_next_inplace(result);
+    });
+
+    // Step 2: the k-th terms (V_k . U_sigma . A) * (W_k . U_tau . B), all at the same level and scale
+    vector<Ciphertext> products(dimension);
+    parallel_for(dimension, num_threads, [&](int k) {
+        Ciphertext ctA_k;
+        Ciphertext ctB_k;
+        if (k == 0)
+        {
+            evaluator.mod_switch_to_next(ctA_sigma, ctA_k);
+            evaluator.mod_switch_to_next(ctB_tau, ctB_k);
+        }
+        else
+        {
+            ctA_k = Linear_Transform_Plain_Sparse(ctA_sigma, diagonals.V[k - 1], session);
+            ctB_k = Linear_Transform_Plain_Sparse(ctB_tau, diagonals.W[k - 1], session);
+            evaluator.rescale_to_next_inplace(ctA_k);
+            evaluator.rescale_to_next_inplace(ctB_k);
+        }
+        evaluator.multiply(ctA_k, ctB_k, products[k]);
+    });
+
+    // Step 3: sum the size 3 products, then relinearize and rescale once
+    Ciphertext ctAB;
+    evaluator.add_many(products, ctAB);
+    evaluator.relinearize_inplace(ctAB, session.relin_keys);
+    evaluator.rescale_to_next_inplace(ctAB);
+
+    return ctAB;
+}
+
+// Encodes and encrypts a batch of at most get_matmul_batch_capacity d x d matrices in one ciphertext for CC_Matrix_Multiplication
+Ciphertext encrypt_matrix_batch(const vector<Matrix<double>> &matrices, FHESession &session)
+{
+    int dimension = matrices[0].rows();
+    int dimensionSq = dimension * dimension;
+    if (matrices.size() > get_matmul_batch_capacity(dimension, session.ckks_encoder.slot_count()))
+    {
+        cerr << "A ciphertext holds at most " << get_matmul_batch_capacity(dimension, session.ckks_encoder.slot_count()) << " " << dimension << " x " << dimension << " matrices" << endl;
+        exit(1);
+    }
 
-    int V_row = 0;
-    for (int offset = 0; offset < dimensionSq; offset += dimension)
+    vector<double> slots(session.ckks_encoder.slot_count(), 0);
+    for (int b = 0; b < matrices.size(); b++)
     {
-        // Get the matrix of ones at position k
-        vector<vector<double>> one_matrix = get_matrix_of_ones(k, U);
-        // print_full_matrix(one_matrix);
-        // Loop over the matrix of ones
-        for (int one_matrix_index = 0; one_matrix_index < dimension; one_matrix_index++)
+        if (matrices[b].rows() != dimension || matrices[b].cols() != dimension)
         {
-            // Pad with zeros the vector of one
-            vector<double> temp_fill = pad_zero(offset, one_matrix[one_matrix_index]);
-            // Store vector in V_k at position V_row
-            // print_full_vector(temp_fill);
-            V_k[V_row] = temp_fill;
-            V_row++;
+            cerr << "Matrix " << b << " of the batch is not " << dimension << " x " << dimension << endl;
+            exit(1);
         }
+        copy(matrices[b].data(), matrices[b].data() + dimensionSq, slots.begin() + b * 2 * dimensionSq);
     }
 
-    return V_k;
+    Plaintext pt;
+    session.ckks_encoder.encode(slots, session.scale, pt);
+    Ciphertext ct;
+    session.encryptor.encrypt(pt, ct);
+
+    return ct;
 }
 
-// W_k
-template <typename T>
-vector<vector<double>> get_W_k(vector<vector<T>> U, int k)
+// Decrypts the first count d x d matrices of a batch
+vector<Matrix<double>> decrypt_matrix_batch(const Ciphertext &ct, int dimension, int count, FHESession &session)
 {
+    int dimensionSq = dimension * dimension;
 
-    int dimension = U.size();
-    if (k < 1 || k >= dimension)
+    Plaintext pt;
+    session.decryptor.decrypt(ct, pt);
+    vector<double> slots;
+    session.ckks_encoder.decode(pt, slots);
+
+    vector<Matrix<double>> matrices;
+    for (int b = 0; b < count; b++)
     {
-        cerr << "Invalid K for matrix V_k: " << to_string(k) << ". Choose k to be between 1 and " << to_string(dimension) << endl;
-        exit(1);
+        auto begin = slots.begin() + b * 2 * dimensionSq;
+        matrices.emplace_back(dimension, dimension, vector<double>(begin, begin + dimensionSq));
     }
 
-    int dimensionSq = pow(dimension, 2);
-    vector<vector<double>> W_k(dimensionSq, vector<double>(dimensionSq));
+    return matrices;
+}
 
-    int W_row = 0;
-    // Get matrix of ones at position 0
-    vector<vector<double>> one_matrix = get_matrix_of_ones(0, U);
-    int offset = k * dimension;
+// Cache of MatMulDiagonals keyed by (dimension, poly_modulus_degree, scale, parms_id)
+// The permutation matrices only depend on the dimension, so their diagonals are built and encoded once.
+// With a cache_dir they are also saved with SEAL serialization and reloaded by later runs
+class DiagonalCache
+{
+public:
+    DiagonalCache(string cache_dir = "") : cache_dir(cache_dir)
+    {
+    }
 
-    // Divide the W matrix into several blocks of size dxd and store matrix of ones in them with offsets
-    for (int i = 0; i < dimension; i++)
+    const MatMulDiagonals &get(int dimension, FHESession &session)
     {
-        // Loop over the matrix of ones
-        for (int one_matrix_index = 0; one_matrix_index < dimension; one_matrix_index++)
+        size_t poly_modulus_degree = session.params.poly_modulus_degree();
+        parms_id_type parms_id = session.context.first_parms_id();
+        auto key = make_tuple(dimension, poly_modulus_degree, session.scale, parms_id);
+
+        auto it = cache.find(key);
+        if (it != cache.end())
         {
-            // Pad with zeros the vector of one
-            vector<double> temp_fill = pad_zero(offset, one_matrix[one_matrix_index]);
-            // Store vector in W_k at position W_row
-            // print_full_vector(temp_fill);
-            W_k[W_row] = temp_fill;
-            W_row++;
+            return it->second;
         }
-        if (offset + dimension == dimensionSq)
+
+        MatMulDiagonals diagonals;
+        string path = get_path(dimension, poly_modulus_degree, session.scale);
+        if (path.empty() || !load(path, dimension, poly_modulus_degree, session.scale, parms_id, session.context, diagonals))
         {
-            offset = 0;
+            diagonals = get_matmul_diagonals(dimension, session);
+            if (!path.empty())
+            {
+                save(path, dimension, poly_modulus_degree, session.scale, parms_id, diagonals);
+            }
         }
-        else
+
+        return cache.emplace(key, move(diagonals)).first->second;
+    }
+
+private:
+    // Bumped whenever the file layout changes so that old files are rebuilt
+    static const int file_version = 3;
+
+    string cache_dir;
+    map<tuple<int, size_t, double, parms_id_type>, MatMulDiagonals> cache;
+
+    string get_path(int dimension, size_t poly_modulus_degree, double scale)
+    {
+        if (cache_dir.empty())
         {
-            offset += dimension;
+            return "";
         }
+        return cache_dir + "/matmul_diagonals_d" + to_string(dimension) + "_p" + to_string(poly_modulus_degree) + "_s" + to_string((int)log2(scale)) + ".bin";
     }
 
-    return W_k;
-}
+    // File layout: file_version, dimension, poly_modulus_degree, scale, parms_id, then U_sigma, U_tau, V_1 ... V_d-1, W_1 ... W_d-1
+    // each as the number of non-zero diagonals, their indices and the serialized plaintexts
+    static void save(const string &path, int dimension, size_t poly_modulus_degree, double scale, const parms_id_type &parms_id, const MatMulDiagonals &diagonals)
+    {
+        ofstream out(path, ios::binary);
+        if (!out)
+        {
+            cerr << "Couldn't open file: " << path << endl;
+            return;
+        }
+
+        int version = file_version;
+        out.write(reinterpret_cast<const char *>(&version), sizeof(version));
+        out.write(reinterpret_cast<const char *>(&dimension), sizeof(dimension));
+        out.write(reinterpret_cast<const char *>(&poly_modulus_degree), sizeof(poly_modulus_degree));
+        out.write(reinterpret_cast<const char *>(&scale), sizeof(scale));
+        out.write(reinterpret_cast<const char *>(parms_id.data()), sizeof(parms_id));
+
+        save_diagonals(out, diagonals.U_sigma);
+        save_diagonals(out, diagonals.U_tau);
+        for (int k = 0; k < dimension - 1; k++)
+        {
+            save_diagonals(out, diagonals.V[k]);
+        }
+        for (int k = 0; k < dimension - 1; k++)
+        {
+            save_diagonals(out, diagonals.W[k]);
+        }
+    }
+
+    static void save_diagonals(ostream &out, const SparseDiagonals &U)
+    {
+        int count = U.indices.size();
+        out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+        out.write(reinterpret_cast<const char *>(U.indices.data()), count * sizeof(int));
+        for (int i = 0; i < count; i++)
+        {
+            U.diagonals[i].save(out, compr_mode_type::none);
+        }
+    }
+
+    // Returns false if the file is missing, was written for other parameters or can't be loaded
+    static bool load(const string &path, int dimension, size_t poly_modulus_degree, double scale, const parms_id_type &parms_id, const SEALContext &context, MatMulDiagonals &diagonals)
+    {
+        ifstream in(path, ios::binary);
+        if (!in)
+        {
+            return false;
+        }
+
+        int version;
+        int file_dimension;
+        size_t file_poly_modulus_degree;
+        double file_scale;
+        parms_id_type file_parms_id;
+        in.read(reinterpret_cast<char *>(&version), sizeof(version));
+        in.read(reinterpret_cast<char *>(&file_dimension), sizeof(file_dimension));
+        in.read(reinterpret_cast<char *>(&file_poly_modulus_degree), sizeof(file_poly_modulus_degree));
+        in.read(reinterpret_cast<char *>(&file_scale), sizeof(file_scale));
+        in.read(reinterpret_cast<char *>(file_parms_id.data()), sizeof(file_parms_id));
+        if (!in || version != file_version || file_dimension != dimension || file_poly_modulus_degree != poly_modulus_degree || file_scale != scale || file_parms_id != parms_id)
+        {
+            return false;
+        }
+
+        int dimensionSq = pow(dimension, 2);
+        try
+        {
+            diagonals.U_sigma = load_diagonals(in, dimensionSq, context);
+            diagonals.U_tau = load_diagonals(in, dimensionSq, context);
+            diagonals.V.clear();
+            diagonals.W.clear();
+            for (int k = 1; k < dimension; k++)
+            {
+                diagonals.V.push_back(load_diagonals(in, dimensionSq, context));
+            }
+            for (int k = 1; k < dimension; k++)
+            {
+                diagonals.W.push_back(load_diagonals(in, dimensionSq, context));
+            }
+        }
+        catch (const exception &e)
+        {
+            cerr << "Couldn't load diagonals from " << path << ": " << e.what() << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    static SparseDiagonals load_diagonals(istream &in, int dimension, const SEALContext &context)
+    {
+        SparseDiagonals U;
+        U.dimension = dimension;
+
+        int count;
+        in.read(reinterpret_cast<char *>(&count), sizeof(count));
+        if (!in || count < 0 || count > dimension)
+        {
+            throw runtime_error("invalid number of diagonals");
+        }
+
+        U.indices.resize(count);
+        in.read(reinterpret_cast<char *>(U.indices.data()), count * sizeof(int));
+        U.diagonals.resize(count);
+        for (int i = 0; i < count; i++)
+        {
+            U.diagonals[i].load(context, in);
+        }
+
+        return U;
+    }
+};
@@ -0,0 +1,401 @@
+#pragma once
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <map>
+#include <deque>
+#include <memory>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "seal/seal.h"
+#include "helper.h"
+#include "logistic_regression_ckks.h"
+
+using namespace std;
+using namespace seal;
+
+// Latencies in power-of-two buckets of microseconds (bucket b holds [2^(b - 1), 2^b)), safe to record from several threads
+class LatencyHistogram
+{
+public:
+    static const int num_buckets = 40;
+
+    void record(long long micros)
+    {
+        int bucket = 0;
+        while (bucket < num_buckets - 1 && (1LL << bucket) <= micros)
+        {
+            bucket++;
+        }
+
+        lock_guard<mutex> lock(histogram_mutex);
+        buckets[bucket]++;
+        count++;
+        total_micros += micros;
+        max_micros = max(max_micros, micros);
+    }
+
+    // Upper bound of the bucket holding the p-th percentile (0 < p <= 100)
+    long long percentile(double p)
+    {
+        lock_guard<mutex> lock(histogram_mutex);
+        long long target = ceil(count * p / 100);
+        long long seen = 0;
+        for (int b = 0; b < num_buckets; b++)
+        {
+            seen += buckets[b];
+            if (seen >= target && seen > 0)
+            {
+                return min(1LL << b, max_micros);
+            }
+        }
+        return max_micros;
+    }
+
+    void print(const string &name)
+    {
+        long long p50 = percentile(50);
+        long long p90 = percentile(90);
+        long long p99 = percentile(99);
+
+        lock_guard<mutex> lock(histogram_mutex);
+        cout << name << ": " << count << " requests, mean " << (count ? total_micros / count : 0) << " us, p50 <= " << p50 << " us, p90 <= " << p90 << " us, p99 <= " << p99 << " us, max " << max_micros << " us" << endl;
+        for (int b = 0; b < num_buckets; b++)
+        {
+            if (buckets[b] > 0)
+            {
+                cout << "\t< " << setw(10) << (1LL << b) << " us: " << buckets[b] << endl;
+            }
+        }
+    }
+
+private:
+    mutex histogram_mutex;
+    long long buckets[num_buckets] = {};
+    long long count = 0;
+    long long total_micros = 0;
+    long long max_micros = 0;
+};
+
+// Prediction of one request: the batch ciphertext it was evaluated in (shared with the other requests of the batch)
+// and the slot of its sigmoid(x.w)
+struct InferenceResult
+{
+    shared_ptr<const Ciphertext> predictions;
+    int slot;
+};
+
+// Rotations the inference server needs for models with num_features features
+// Queries are merged with rotations by -width * 2^j, the dot products are summed with rotations by 1, 2, ..., width / 2
+vector<int> get_inference_steps(int num_features, int slot_count)
+{
+    int width = get_packed_width(num_features);
+    vector<int> steps;
+    for (int step = width; step < slot_count; step *= 2)
+    {
+        steps.push_back(-step);
+    }
+    for (int step = 1; step < width; step *= 2)
+    {
+        steps.push_back(step);
+    }
+
+    return steps;
+}
+
+// Concurrent logistic regression inference for several models
+// A query is the encrypted feature vector of one observation in the first slots (encrypt_vector / encrypt_rows).
+// Queries to the same model are batched, query q of a batch moves to slot q * width, so a ciphertext holds slot_count / width of them.
+// A batch costs batch size - 1 rotations to merge the queries, one multiplication with the weights, log2(width) rotations for the
+// dot products and the sigmoid polynomial for all its queries at once. Batches of every model share one pool of workers.
+// A batch is started once it is full or its oldest query waited max_wait
+class InferenceServer
+{
+public:
+    InferenceServer(FHESession &session, int num_workers = 0, int max_batch = 0, chrono::microseconds max_wait = chrono::microseconds(2000))
+        : session(session), max_batch(max_batch), max_wait(max_wait)
+    {
+        if (num_workers <= 0)
+        {
+            num_workers = thread::hardware_concurrency();
+        }
+        for (int t = 0; t < max(1, num_workers); t++)
+        {
+            workers.emplace_back([this]() { worker_loop(); });
+        }
+    }
+
+    ~InferenceServer()
+    {
+        stop();
+    }
+
+    InferenceServer(const InferenceServer &) = delete;
+    InferenceServer &operator=(const InferenceServer &) = delete;
+
+    // Model with plaintext weights, encoded once (replicated with period width) for the level of the queries
+    void add_model(const string &name, const vector<double> &weights, int degree = 3)
+    {
+        Model model(weights.size(), degree, session.ckks_encoder.slot_count(), max_batch);
+        auto first_data = session.context.first_context_data();
+        model.packed_weights = get_packed_weights(weights, model.width, session.ckks_encoder.slot_count());
+        session.ckks_encoder.encode(model.packed_weights, first_data->parms_id(), (double)first_data->parms().coeff_modulus().back().value(), model.plain_weights);
+        insert_model(name, move(model));
+    }
+
+    // Model with encrypted weights replicated with period get_packed_width(num_features), e.g. the output of train_cipher_packed
+    void add_model(const string &name, const Ciphertext &weights, int num_features, int degree = 3)
+    {
+        Model model(num_features, degree, session.ckks_encoder.slot_count(), max_batch);
+        model.cipher_weights = weights;
+        model.encrypted = true;
+        insert_model(name, move(model));
+    }
+
+    future<InferenceResult> submit(const string &name, const Ciphertext &query)
+    {
+        lock_guard<mutex> lock(server_mutex);
+        auto it = models.find(name);
+        if (it == models.end())
+        {
+            cerr << "Unknown model: " << name << endl;
+            exit(1);
+        }
+        if (stopping)
+        {
+            cerr << "Request for " << name << " after the inference server was stopped" << endl;
+            exit(1);
+        }
+
+        it->second.pending.push_back(PendingRequest{query, promise<InferenceResult>(), chrono::steady_clock::now()});
+        future<InferenceResult> result = it->second.pending.back().result.get_future();
+        work_available.notify_one();
+        return result;
+    }
+
+    // Answers every pending request, then stops the workers
+    void stop()
+    {
+        {
+            lock_guard<mutex> lock(server_mutex);
+            if (stopping)
+            {
+                return;
+            }
+            stopping = true;
+        }
+        work_available.notify_all();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    // Latency from submit to the result of every request of a model
+    LatencyHistogram &latencies(const string &name)
+    {
+        lock_guard<mutex> lock(server_mutex);
+        return *models.at(name).latencies;
+    }
+
+    void print_latencies()
+    {
+        lock_guard<mutex> lock(server_mutex);
+        for (auto &model : models)
+        {
+            model.second.latencies->print(model.first);
+        }
+    }
+
+private:
+    struct PendingRequest
+    {
+        Ciphertext query;
+        promise<InferenceResult> result;
+        chrono::steady_clock::time_point submitted;
+    };
+
+    struct Model
+    {
+        Model(int num_features, int degree, int slot_count, int max_batch)
+            : width(get_packed_width(num_features)), coeffs(get_sigmoid_coeffs(degree)), latencies(make_shared<LatencyHistogram>())
+        {
+            batch_capacity = slot_count / width;
+            if (max_batch > 0)
+            {
+                batch_capacity = min(batch_capacity, max_batch);
+            }
+        }
+
+        int width;
+        int batch_capacity;
+        vector<double> coeffs;
+        bool encrypted = false;
+        vector<double> packed_weights;
+        Plaintext plain_weights;
+        Ciphertext cipher_weights;
+        deque<PendingRequest> pending;
+        shared_ptr<LatencyHistogram> latencies;
+    };
+
+    FHESession &session;
+    int max_batch;
+    chrono::microseconds max_wait;
+    map<string, Model> models;
+    mutex server_mutex;
+    condition_variable work_available;
+    bool stopping = false;
+    vector<thread> workers;
+
+    void insert_model(const string &name, Model &&model)
+    {
+        lock_guard<mutex> lock(server_mutex);
+        if (!models.emplace(name, move(model)).second)
+        {
+            cerr << "Model " << name << " already exists" << endl;
+            exit(1);
+        }
+    }
+
+    // Model with a batch to start (full, waited too long or the server is stopping), nullptr otherwise
+    // deadline is set to the time the next batch becomes due
+    Model *find_ready_model(chrono::steady_clock::time_point now, chrono::steady_clock::time_point &deadline)
+    {
+        deadline = chrono::steady_clock::time_point::max();
+        for (auto &entry : models)
+        {
+            Model &model = entry.second;
+            if (model.pending.empty())
+            {
+                continue;
+            }
+            auto due = model.pending.front().submitted + max_wait;
+            if (stopping || model.pending.size() >= model.batch_capacity || due <= now)
+            {
+                return &model;
+            }
+            deadline = min(deadline, due);
+        }
+
+        return nullptr;
+    }
+
+    void worker_loop()
+    {
+        unique_lock<mutex> lock(server_mutex);
+        while (true)
+        {
+            chrono::steady_clock::time_point deadline;
+            Model *model = find_ready_model(chrono::steady_clock::now(), deadline);
+            if (!model)
+            {
+                if (stopping)
+                {
+                    return;
+                }
+                if (deadline == chrono::steady_clock::time_point::max())
+                {
+                    work_available.wait(lock);
+                }
+                else
+                {
+                    work_available.wait_until(lock, deadline);
+                }
+                continue;
+            }
+
+            int batch_size = min((int)model->pending.size(), model->batch_capacity);
+            vector<PendingRequest> batch;
+            for (int q = 0; q < batch_size; q++)
+            {
+                batch.push_back(move(model->pending.front()));
+                model->pending.pop_front();
+            }
+
+            lock.unlock();
+            run_batch(*model, batch);
+            lock.lock();
+        }
+    }
+
+    void run_batch(const Model &model, vector<PendingRequest> &batch)
+    {
+        TraceScope trace_scope(__func__);
+
+        try
+        {
+            auto predictions = make_shared<const Ciphertext>(predict_batch(model, batch));
+            auto done = chrono::steady_clock::now();
+            for (int q = 0; q < batch.size(); q++)
+            {
+                model.latencies->record(chrono::duration_cast<chrono::microseconds>(done - batch[q].submitted).count());
+                batch[q].result.set_value(InferenceResult{predictions, q * model.width});
+            }
+        }
+        catch (...)
+        {
+            for (auto &request : batch)
+            {
+                request.result.set_exception(current_exception());
+            }
+        }
+    }
+
+    Ciphertext predict_batch(const Model &model, const vector<PendingRequest> &batch)
+    {
+        TracedEvaluator &evaluator = session.evaluator;
+
+        // Merge the queries pairwise: after round j, entry i holds the queries i * 2^(j + 1) ... in consecutive blocks of width slots
+        vector<Ciphertext> merged(batch.size());
+        for (int q = 0; q < batch.size(); q++)
+        {
+            merged[q] = batch[q].query;
+        }
+        for (int stride = 1; merged.size() > 1; stride *= 2)
+        {
+            vector<Ciphertext> next((merged.size() + 1) / 2);
+            for (int i = 0; i < next.size(); i++)
+            {
+                next[i] = move(merged[2 * i]);
+                if (2 * i + 1 < merged.size())
+                {
+                    Ciphertext shifted;
+                    evaluator.rotate_vector(merged[2 * i + 1], -stride * model.width, session.gal_keys, shifted);
+                    evaluator.add_inplace(next[i], shifted);
+                }
+            }
+            merged = move(next);
+        }
+        Ciphertext queries = move(merged[0]);
+
+        // x * w in every block, then the sum of each block in its first slot
+        Ciphertext products;
+        if (model.encrypted)
+        {
+            products = multiply_rescale(queries, model.cipher_weights, session);
+        }
+        // The weights are encoded for queries at the first level, others get them encoded for their level
+        else if (queries.parms_id() == model.plain_weights.parms_id())
+        {
+            evaluator.multiply_plain(queries, model.plain_weights, products);
+            evaluator.rescale_to_next_inplace(products);
+        }
+        else
+        {
+            products = multiply_plain_rescale(queries, model.packed_weights, session);
+        }
+        for (int step = 1; step < model.width; step *= 2)
+        {
+            Ciphertext products_rot;
+            evaluator.rotate_vector(products, step, session.gal_keys, products_rot);
+            evaluator.add_inplace(products, products_rot);
+        }
+
+        return evaluate_polynomial(products, model.coeffs, session);
+    }
+};
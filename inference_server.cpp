@@ -0,0 +1,130 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <chrono>
+#include "seal/seal.h"
+#include "helper.h"
+
+using namespace std;
+using namespace seal;
+
+#define NUM_FEATURES 8
+#define NUM_MODELS 4
+#define NUM_CLIENTS 8
+#define QUERIES_PER_CLIENT 256
+#define SIGMOID_DEGREE 3
+// Worker threads of the server (0 = all hardware threads)
+#define NUM_THREADS 0
+
+#include "inference.h"
+
+// Plaintext sigmoid approximation of x.w, what the server computes homomorphically
+double expected_prediction(const vector<double> &x, const vector<double> &w, const vector<double> &coeffs)
+{
+    double dot = 0;
+    for (int j = 0; j < x.size(); j++)
+    {
+        dot += x[j] * w[j];
+    }
+
+    double result = 0;
+    for (int k = coeffs.size() - 1; k >= 0; k--)
+    {
+        result = result * dot + coeffs[k];
+    }
+    return result;
+}
+
+int main()
+{
+    // HE_TRACE=1 prints the evaluator operation counts and times per call site
+    bool trace = EvaluatorTrace::enable_from_env();
+
+    // One level for the product with the weights, then the sigmoid
+    ParameterPlan plan = plan_parameters(1 + get_polynomial_depth(SIGMOID_DEGREE), 40, 2 * get_packed_width(NUM_FEATURES));
+    print_plan(plan);
+    FHESession session(plan.get_parameters(), plan.scale(), KeyCache::dir_from_env());
+    int slot_count = session.ckks_encoder.slot_count();
+    session.create_galois_keys(get_inference_steps(NUM_FEATURES, slot_count));
+
+    // Trained weights of every tenant, loaded once
+    InferenceServer server(session, NUM_THREADS);
+    vector<vector<double>> weights(NUM_MODELS, vector<double>(NUM_FEATURES));
+    for (int m = 0; m < NUM_MODELS; m++)
+    {
+        for (int j = 0; j < NUM_FEATURES; j++)
+        {
+            weights[m][j] = RandomFloat(-0.5, 0.5);
+        }
+        server.add_model("model_" + to_string(m), weights[m], SIGMOID_DEGREE);
+    }
+    cout << "Models: " << NUM_MODELS << ", queries per batch: up to " << slot_count / get_packed_width(NUM_FEATURES) << endl;
+
+    // Every client encrypts its queries and sends them to random models
+    Matrix<double> queries(NUM_CLIENTS * QUERIES_PER_CLIENT, NUM_FEATURES);
+    vector<int> query_models(queries.rows());
+    for (int i = 0; i < queries.rows(); i++)
+    {
+        for (int j = 0; j < NUM_FEATURES; j++)
+        {
+            queries(i, j) = RandomFloat(-1, 1);
+        }
+        query_models[i] = rand() % NUM_MODELS;
+    }
+    vector<Ciphertext> queries_ct = encrypt_rows(queries, session, NUM_THREADS);
+
+    cout << "\nSERVING " << queries.rows() << " QUERIES FROM " << NUM_CLIENTS << " CLIENTS..." << endl;
+    vector<future<InferenceResult>> results(queries.rows());
+    auto start = chrono::high_resolution_clock::now();
+    vector<thread> clients;
+    for (int c = 0; c < NUM_CLIENTS; c++)
+    {
+        clients.emplace_back([&, c]() {
+            for (int i = c * QUERIES_PER_CLIENT; i < (c + 1) * QUERIES_PER_CLIENT; i++)
+            {
+                results[i] = server.submit("model_" + to_string(query_models[i]), queries_ct[i]);
+            }
+        });
+    }
+    for (auto &client : clients)
+    {
+        client.join();
+    }
+    for (auto &result : results)
+    {
+        result.wait();
+    }
+    auto stop = chrono::high_resolution_clock::now();
+    auto duration = chrono::duration_cast<chrono::microseconds>(stop - start);
+    cout << "Done in " << duration.count() << " microseconds (" << queries.rows() * 1e6 / duration.count() << " queries / s)" << endl;
+
+    // Latency from submit to result per model
+    cout << "\nLATENCIES" << endl;
+    server.print_latencies();
+
+    // Check the predictions (the clients would decrypt their own slot), every batch ciphertext is decrypted once
+    double max_error = 0;
+    vector<double> coeffs = get_sigmoid_coeffs(SIGMOID_DEGREE);
+    map<const Ciphertext *, vector<double>> decrypted_batches;
+    for (int i = 0; i < queries.rows(); i++)
+    {
+        InferenceResult result = results[i].get();
+        vector<double> &predictions = decrypted_batches[result.predictions.get()];
+        if (predictions.empty())
+        {
+            Plaintext pt;
+            session.decryptor.decrypt(*result.predictions, pt);
+            session.ckks_encoder.decode(pt, predictions);
+        }
+        max_error = max(max_error, abs(predictions[result.slot] - expected_prediction(queries.row(i), weights[query_models[i]], coeffs)));
+    }
+    cout << "\nBatches: " << decrypted_batches.size() << endl;
+    cout << "Max error against the plaintext sigmoid approximation: " << max_error << endl;
+
+    server.stop();
+    if (trace)
+    {
+        EvaluatorTrace::report();
+    }
+    return 0;
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <mutex>
+#include "seal/seal.h"
+#include "helper.h"
+
+using namespace std;
+using namespace seal;
+
+// Slot layouts of an encrypted d x d matrix A
+// - per-row: d ciphertexts, ciphertext i holds row i in its first d slots (encrypt_rows)
+// - row-packed: one ciphertext, A[i][j] in slot i * d + j (C_Matrix_Encode, the input of CC_Matrix_Multiplication)
+// - column-packed: one ciphertext, A[i][j] in slot j * d + i (the row-packed layout of the transpose)
+// - diagonals: d ciphertexts, ciphertext l holds the diagonal A[i][(i + l) % d] in slot i (what Linear_Transform_Cipher takes)
+// Conversions between the packed layouts are permutations of the d^2 slots, each applied as a sparse linear transformation
+// with O(d) non-zero diagonals and one rescale. Their diagonals are encoded once per level and dimension and cached.
+// The packed layouts need 2d^2 slots (the linear transformations duplicate the matrix into the d^2 slots after it)
+
+// Row-packed to diagonals: slot l * d + i of the result takes slot i * d + (i + l) % d, so row l of the result is diagonal l
+PermutationDiagonals get_packed_to_diagonals_permutation(int dimension)
+{
+    return get_permutation_diagonals(dimension * dimension, [dimension](int t) {
+        int l = t / dimension, i = t % dimension;
+        return i * dimension + (i + l) % dimension;
+    });
+}
+
+// Inverse of get_packed_to_diagonals_permutation: slot i * d + j takes slot ((j - i) mod d) * d + i
+PermutationDiagonals get_diagonals_to_packed_permutation(int dimension)
+{
+    return get_permutation_diagonals(dimension * dimension, [dimension](int t) {
+        int i = t / dimension, j = t % dimension;
+        return ((j - i + dimension) % dimension) * dimension + i;
+    });
+}
+
+// Rotations Linear_Transform_Plain_Sparse needs for a permutation (as get_sparse_diagonal_steps before encoding)
+vector<int> get_permutation_steps(const PermutationDiagonals &U)
+{
+    vector<int> steps = get_rotation_plan_steps(U.indices);
+    steps.push_back(-U.dimension);
+
+    return steps;
+}
+
+// Converts encrypted d x d matrices between the layouts above
+// Every conversion keeps the scale of the session exactly. rows_to_packed needs no level, transpose and packed_to_rows
+// one level each and the conversions between the diagonals and the rows or the packed matrix two
+class LayoutConverter
+{
+public:
+    LayoutConverter(FHESession &session, int num_threads = 0) : session(session), num_threads(num_threads)
+    {
+    }
+
+    // Rotations every conversion of a d x d matrix needs, pass them to session.create_galois_keys
+    static vector<int> get_steps(int dimension)
+    {
+        vector<int> steps = get_matrix_encode_steps(dimension);
+        for (const vector<int> &more : {get_matrix_decode_steps(dimension),
+                                        get_permutation_steps(get_U_transpose_diagonals(dimension)),
+                                        get_permutation_steps(get_packed_to_diagonals_permutation(dimension)),
+                                        get_permutation_steps(get_diagonals_to_packed_permutation(dimension))})
+        {
+            steps.insert(steps.end(), more.begin(), more.end());
+        }
+
+        return steps;
+    }
+
+    // Per-row to row-packed, log2(d) rounds of parallel merges
+    Ciphertext rows_to_packed(const vector<Ciphertext> &rows)
+    {
+        return C_Matrix_Encode(rows, session.gal_keys, session.evaluator, num_threads);
+    }
+
+    // Row-packed to per-row with one shared mask
+    vector<Ciphertext> packed_to_rows(const Ciphertext &packed, int dimension)
+    {
+        return C_Matrix_Decode(packed, dimension, session, num_threads);
+    }
+
+    // Row-packed to column-packed and back (the transpose is its own inverse)
+    Ciphertext transpose(const Ciphertext &packed, int dimension)
+    {
+        TraceScope trace_scope(__func__);
+        return permute(packed, dimension, Permutation::transpose);
+    }
+
+    Ciphertext packed_to_diagonals_packed(const Ciphertext &packed, int dimension)
+    {
+        TraceScope trace_scope(__func__);
+        return permute(packed, dimension, Permutation::to_diagonals);
+    }
+
+    Ciphertext diagonals_packed_to_packed(const Ciphertext &diagonals_packed, int dimension)
+    {
+        TraceScope trace_scope(__func__);
+        return permute(diagonals_packed, dimension, Permutation::from_diagonals);
+    }
+
+    // Row-packed to one ciphertext per diagonal
+    vector<Ciphertext> packed_to_diagonals(const Ciphertext &packed, int dimension)
+    {
+        return packed_to_rows(packed_to_diagonals_packed(packed, dimension), dimension);
+    }
+
+    // One ciphertext per diagonal to row-packed
+    Ciphertext diagonals_to_packed(const vector<Ciphertext> &diagonals)
+    {
+        return diagonals_packed_to_packed(rows_to_packed(diagonals), diagonals.size());
+    }
+
+    vector<Ciphertext> rows_to_diagonals(const vector<Ciphertext> &rows)
+    {
+        return packed_to_diagonals(rows_to_packed(rows), rows.size());
+    }
+
+    vector<Ciphertext> diagonals_to_rows(const vector<Ciphertext> &diagonals)
+    {
+        return packed_to_rows(diagonals_to_packed(diagonals), diagonals.size());
+    }
+
+private:
+    enum class Permutation
+    {
+        transpose,
+        to_diagonals,
+        from_diagonals
+    };
+
+    FHESession &session;
+    int num_threads;
+    map<tuple<Permutation, int, parms_id_type>, SparseDiagonals> cache;
+    mutex cache_mutex;
+
+    // Diagonals of the permutation encoded at the level of parms_id with the scale of its rescale prime
+    const SparseDiagonals &get_diagonals(Permutation permutation, int dimension, const Ciphertext &ct)
+    {
+        lock_guard<mutex> lock(cache_mutex);
+        auto key = make_tuple(permutation, dimension, ct.parms_id());
+        auto it = cache.find(key);
+        if (it == cache.end())
+        {
+            PermutationDiagonals U;
+            switch (permutation)
+            {
+            case Permutation::transpose:
+                U = get_U_transpose_diagonals(dimension);
+                break;
+            case Permutation::to_diagonals:
+                U = get_packed_to_diagonals_permutation(dimension);
+                break;
+            case Permutation::from_diagonals:
+                U = get_diagonals_to_packed_permutation(dimension);
+                break;
+            }
+            SparseDiagonals encoded = get_batched_sparse_diagonals(U, ct.parms_id(), get_rescale_prime(ct, session), session.ckks_encoder);
+            it = cache.emplace(key, move(encoded)).first;
+        }
+
+        return it->second;
+    }
+
+    Ciphertext permute(const Ciphertext &packed, int dimension, Permutation permutation)
+    {
+        if (2 * dimension * dimension > session.ckks_encoder.slot_count())
+        {
+            cerr << "A packed " << dimension << " x " << dimension << " matrix needs " << 2 * dimension * dimension << " slots" << endl;
+            exit(1);
+        }
+
+        Ciphertext input = packed;
+        rescale_towards_inplace(input, session.scale, session);
+
+        Ciphertext result = Linear_Transform_Plain_Sparse(input, get_diagonals(permutation, dimension, input), session);
+        session.evaluator.rescale_to_next_inplace(result);
+        return result;
+    }
+};
@@ -5,66 +5,151 @@
 #include <cmath>
 #include <vector>
 #include <string.h>
+#include <thread>
+#include <tuple>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define LR_X86_KERNELS
+#endif
+#include "matrix.h"
+#include "csv.h"
+#include "sgd.h"
 
 using namespace std;
 
-// Dot Product
-float vector_dot_product(vector<float> vec_A, vector<float> vec_B)
+// Threads used for the prediction and gradient pass (1 keeps it single threaded, 0 uses every hardware thread)
+#define NUM_THREADS 1
+
+// Scalar tails of the kernels, from element i on (result is the sum of the elements before i)
+float dot_product_tail(const float *a, const float *b, int i, int n, float result)
 {
-    if (vec_A.size() != vec_B.size())
+    for (; i < n; i++)
     {
-        cerr << "Vector size mismatch" << endl;
-        exit(1);
+        result += a[i] * b[i];
     }
 
-    float result = 0;
-    for (unsigned int i = 0; i < vec_A.size(); i++)
+    return result;
+}
+
+void axpy_tail(float alpha, const float *x, float *y, int i, int n)
+{
+    for (; i < n; i++)
     {
-        result += vec_A[i] * vec_B[i];
+        y[i] += alpha * x[i];
     }
+}
 
-    return result;
+float dot_product_scalar(const float *a, const float *b, int n)
+{
+    return dot_product_tail(a, b, 0, n, 0);
 }
 
-// Matrix Transpose
-vector<vector<float>> transpose_matrix(vector<vector<float>> input_matrix)
+void axpy_scalar(float alpha, const float *x, float *y, int n)
 {
+    axpy_tail(alpha, x, y, 0, n);
+}
 
-    int rowSize = input_matrix.size();
-    int colSize = input_matrix[0].size();
-    vector<vector<float>> transposed(colSize, vector<float>(rowSize));
+#ifdef LR_X86_KERNELS
+// AVX-512 and AVX2 kernels, compiled for their instruction set whatever the target of the rest of the file
+__attribute__((target("avx512f"))) float dot_product_avx512(const float *a, const float *b, int n)
+{
+    int i = 0;
+    __m512 acc = _mm512_setzero_ps();
+    for (; i + 16 <= n; i += 16)
+    {
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc);
+    }
 
-    for (int i = 0; i < rowSize; i++)
+    return dot_product_tail(a, b, i, n, _mm512_reduce_add_ps(acc));
+}
+
+__attribute__((target("avx512f"))) void axpy_avx512(float alpha, const float *x, float *y, int n)
+{
+    int i = 0;
+    __m512 alpha_vec = _mm512_set1_ps(alpha);
+    for (; i + 16 <= n; i += 16)
     {
-        for (int j = 0; j < colSize; j++)
-        {
-            transposed[j][i] = input_matrix[i][j];
-        }
+        _mm512_storeu_ps(y + i, _mm512_fmadd_ps(alpha_vec, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+    }
+    axpy_tail(alpha, x, y, i, n);
+}
+
+__attribute__((target("avx2"))) float dot_product_avx2(const float *a, const float *b, int n)
+{
+    int i = 0;
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8)
+    {
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
     }
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    sum = _mm_hadd_ps(sum, sum);
+    sum = _mm_hadd_ps(sum, sum);
 
-    return transposed;
+    return dot_product_tail(a, b, i, n, _mm_cvtss_f32(sum));
 }
 
-// Linear Transformation (or Matrix * Vector)
-vector<float> linear_transformation(vector<vector<float>> input_matrix, vector<float> input_vec)
+__attribute__((target("avx2"))) void axpy_avx2(float alpha, const float *x, float *y, int n)
 {
+    int i = 0;
+    __m256 alpha_vec = _mm256_set1_ps(alpha);
+    for (; i + 8 <= n; i += 8)
+    {
+        _mm256_storeu_ps(y + i, _mm256_add_ps(_mm256_loadu_ps(y + i), _mm256_mul_ps(alpha_vec, _mm256_loadu_ps(x + i))));
+    }
+    axpy_tail(alpha, x, y, i, n);
+}
+#endif
 
-    int rowSize = input_matrix.size();
-    int colSize = input_matrix[0].size();
+// Kernels of the widest instruction set the CPU supports, selected once at startup
+// so that one binary runs on every x86-64 CPU and still uses AVX-512 or AVX2 where they exist
+struct LRKernels
+{
+    const char *name;
+    float (*dot_product)(const float *a, const float *b, int n);
+    void (*axpy)(float alpha, const float *x, float *y, int n);
+};
 
-    if (colSize != input_vec.size())
+LRKernels select_kernels()
+{
+#ifdef LR_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
     {
-        cerr << "Matrix Vector sizes error" << endl;
-        exit(EXIT_FAILURE);
+        return {"AVX-512", dot_product_avx512, axpy_avx512};
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return {"AVX2", dot_product_avx2, axpy_avx2};
     }
+#endif
+    return {"scalar", dot_product_scalar, axpy_scalar};
+}
+
+const LRKernels kernels = select_kernels();
 
-    vector<float> result_vec(rowSize);
-    for (int i = 0; i < input_matrix.size(); i++)
+// Dot product of two float arrays of size n
+inline float dot_product(const float *a, const float *b, int n)
+{
+    return kernels.dot_product(a, b, n);
+}
+
+// y += alpha * x for float arrays of size n
+inline void axpy(float alpha, const float *x, float *y, int n)
+{
+    kernels.axpy(alpha, x, y, n);
+}
+
+// Dot Product
+float vector_dot_product(const vector<float> &vec_A, const vector<float> &vec_B)
+{
+    if (vec_A.size() != vec_B.size())
     {
-        result_vec[i] = vector_dot_product(input_matrix[i], input_vec);
+        cerr << "Vector size mismatch" << endl;
+        exit(1);
     }
 
-    return result_vec;
+    return dot_product(vec_A.data(), vec_B.data(), vec_A.size());
 }
 
 // Sigmoid
@@ -73,141 +158,208 @@ float sigmoid(float z)
     return 1 / (1 + exp(-z));
 }
 
-// Predict
-vector<float> predict(vector<vector<float>> features, vector<float> weights)
+// Buffers reused by every training iteration so that the loop does not allocate
+struct LRWorkspace
 {
-    vector<float> lintransf_vec = linear_transformation(features, weights);
-
-    vector<float> result_sigmoid_vec(features.size());
-
-    for (int i = 0; i < result_sigmoid_vec.size(); i++)
+    vector<float> predictions;
+    vector<float> gradient;
+    // One gradient and cost per thread, summed after the pass
+    vector<float> partial_gradients;
+    vector<float> partial_costs;
+
+    LRWorkspace(int observations, int num_weights, int num_threads)
+        : predictions(observations), gradient(num_weights), partial_gradients(num_threads * num_weights), partial_costs(num_threads)
     {
-        result_sigmoid_vec[i] = sigmoid(lintransf_vec[i]);
-
-        // DEBUG
-        // cout << "lintransf_vec[i] = " << lintransf_vec[i] << endl;
-        // cout << "result_sigmoid_vec[i] = " << result_sigmoid_vec[i] << endl;
-        // if (i == 10)
-        // {
-        //     exit(0);
-        // }
     }
+};
 
-    return result_sigmoid_vec;
+// Resolves NUM_THREADS style counts (0 = every hardware thread) against the number of rows
+int get_num_threads(int num_threads, int rows)
+{
+    if (num_threads <= 0)
+    {
+        num_threads = thread::hardware_concurrency();
+    }
+    return max(1, min(num_threads, rows));
 }
 
-// Cost Function
-float cost_function(vector<vector<float>> features, vector<float> labels, vector<float> weights)
+// Predictions, gradient and cost of rows [begin, end) in a single pass over the features
+// gradient must hold num_weights zeros, returns the summed cost of the rows
+float predict_gradient_rows(const Matrix<float> &features, const vector<float> &labels, const vector<float> &weights, int begin, int end, float *predictions, float *gradient)
 {
-    int observations = labels.size();
-
-    vector<float> predictions = predict(features, weights);
-
-    vector<float> cost_result_vec(observations);
+    int num_weights = features.cols();
     float cost_sum = 0;
 
-    for (int i = 0; i < observations; i++)
+    for (int i = begin; i < end; i++)
     {
+        const float *row = features.row_data(i);
+        float prediction = sigmoid(dot_product(row, weights.data(), num_weights));
+        predictions[i] = prediction;
+
+        // gradient += (prediction - label) * row, accumulated row by row instead of transposing the features
+        axpy(prediction - labels[i], row, gradient, num_weights);
 
         // Handle Prediction = 1 issue: Epsilon subtraction
         float epsilon = 0.0001;
-        if (predictions[i] == 1)
+        if (prediction == 1)
         {
-            predictions[i] -= epsilon;
+            prediction -= epsilon;
         }
 
         // Calculate Cost 0 and 1
-        float cost0 = (1.0 - labels[i]) * log(1.0 - predictions[i]);
-        float cost1 = (-labels[i]) * log(predictions[i]);
+        float cost0 = (1.0 - labels[i]) * log(1.0 - prediction);
+        float cost1 = (-labels[i]) * log(prediction);
+        cost_sum += cost1 - cost0;
+    }
 
-        cost_result_vec[i] = cost1 - cost0;
-        cost_sum += cost_result_vec[i];
+    return cost_sum;
+}
 
-        // Log Progress
-        if (i % 2000 == 0)
+// Fills ws.predictions = sigmoid(features.weights) and ws.gradient = features^T.(predictions - labels)
+// Returns the average cost, the rows are split between num_threads threads and their gradients reduced at the end
+float predict_gradient(const Matrix<float> &features, const vector<float> &labels, const vector<float> &weights, LRWorkspace &ws, int num_threads)
+{
+    int observations = features.rows();
+    int num_weights = features.cols();
+    fill(ws.partial_gradients.begin(), ws.partial_gradients.end(), 0);
+
+    if (num_threads == 1)
+    {
+        ws.partial_costs[0] = predict_gradient_rows(features, labels, weights, 0, observations, ws.predictions.data(), ws.partial_gradients.data());
+    }
+    else
+    {
+        vector<thread> workers;
+        int chunk = (observations + num_threads - 1) / num_threads;
+        for (int t = 0; t < num_threads; t++)
         {
-            cout << "i = " << i << "\t\t";
-            cout << "labels[i] = " << labels[i] << "\t\t";
-            cout << "predictions[i] = " << predictions[i] << "\t\t";
-            cout << "cost 0 = " << cost0 << "\t\t";
-            cout << "cost 1 = " << cost1 << "\t\t";
-            cout << "cost sum = " << cost_sum << endl;
+            workers.emplace_back([&, t]() {
+                int begin = min(observations, t * chunk);
+                int end = min(observations, begin + chunk);
+                ws.partial_costs[t] = predict_gradient_rows(features, labels, weights, begin, end, ws.predictions.data(), ws.partial_gradients.data() + t * num_weights);
+            });
+        }
+        for (auto &worker : workers)
+        {
+            worker.join();
         }
-
-        // // DEBUG
-        // if (i == 100)
-        // {
-        //     exit(0);
-        // }
     }
 
-    float cost_result = cost_sum / observations;
+    float cost_sum = 0;
+    fill(ws.gradient.begin(), ws.gradient.end(), 0);
+    for (int t = 0; t < num_threads; t++)
+    {
+        cost_sum += ws.partial_costs[t];
+        axpy(1, ws.partial_gradients.data() + t * num_weights, ws.gradient.data(), num_weights);
+    }
 
-    return cost_result;
+    return cost_sum / observations;
 }
 
-// Gradient Descent (or Update Weights)
-vector<float> update_weights(vector<vector<float>> features, vector<float> labels, vector<float> weights, float learning_rate)
+// Predict
+vector<float> predict(const Matrix<float> &features, const vector<float> &weights)
 {
-    vector<float> new_weights(weights.size());
-
-    int N = features.size();
-
-    // Get predictions
-    vector<float> predictions = predict(features, weights);
-
-    // Tranpose features matrix
-    vector<vector<float>> features_T = transpose_matrix(features);
+    vector<float> result_sigmoid_vec(features.rows());
 
-    // Calculate Predictions - Labels vector
-    vector<float> pred_labels(labels.size());
-    for (int i = 0; i < labels.size(); i++)
+    for (int i = 0; i < features.rows(); i++)
     {
-        pred_labels[i] = predictions[i] - labels[i];
+        result_sigmoid_vec[i] = sigmoid(dot_product(features.row_data(i), weights.data(), features.cols()));
     }
 
-    // Calculate Gradient vector
-    vector<float> gradient = linear_transformation(features_T, pred_labels);
+    return result_sigmoid_vec;
+}
 
-    for (int i = 0; i < gradient.size(); i++)
+// Cost Function
+float cost_function(const Matrix<float> &features, const vector<float> &labels, const vector<float> &weights)
+{
+    LRWorkspace ws(features.rows(), features.cols(), 1);
+    return predict_gradient(features, labels, weights, ws, 1);
+}
+
+// Gradient Descent (or Update Weights) in place
+void update_weights(vector<float> &weights, const vector<float> &gradient, int N, float learning_rate)
+{
+    for (int i = 0; i < weights.size(); i++)
     {
-        // Divide by N to get average
-        gradient[i] /= N;
-        // Multiply by learning rate
-        gradient[i] *= learning_rate;
-        // Subtract from weights to minimize cost
-        new_weights[i] = weights[i] - gradient[i];
+        // Divide by N to get average, multiply by learning rate and subtract from weights to minimize cost
+        weights[i] -= learning_rate * gradient[i] / N;
     }
-
-    return new_weights;
 }
 
 // Training
-tuple<vector<float>, vector<float>> train(vector<vector<float>> features, vector<float> labels, vector<float> weights, float learning_rate, int iters)
+// Gradient descent over the mini-batches of sgd (by default full batches with the cost of every step), for at most iters steps.
+// A full batch pass gives the gradient of the new weights together with their cost, so its cost is free. Mini-batches only see
+// part of the data, their cost is a separate pass over all observations, made every sgd.cost_every steps only.
+// Training stops early once the cost converged, returns the weights and the recorded costs
+tuple<vector<float>, vector<float>> train(const Matrix<float> &features, const vector<float> &labels, const vector<float> &weights, float learning_rate, int iters, int num_threads = NUM_THREADS, const SGDOptions &sgd = SGDOptions())
 {
-
     int colSize = weights.size();
-    vector<float> new_weights(colSize);
-    vector<float> cost_history(iters);
+    int N = features.rows();
+    num_threads = get_num_threads(num_threads, N);
 
-    // Set temp weights
-    vector<float> temp_weights(colSize);
-    for (int i = 0; i < colSize; i++)
+    SGDSchedule schedule(N, 1, learning_rate, sgd);
+    bool full_batch = schedule.is_full_batch();
+    int batch_rows = schedule.get_batch(0).size();
+    int batch_threads = get_num_threads(num_threads, batch_rows);
+
+    vector<float> new_weights = weights;
+    vector<float> cost_history;
+    LRWorkspace ws(batch_rows, colSize, full_batch ? num_threads : batch_threads);
+
+    // Rows of the current mini-batch, gathered so that the pass reads them contiguously
+    Matrix<float> batch_features;
+    vector<float> batch_labels;
+    LRWorkspace cost_ws(full_batch ? 0 : N, colSize, full_batch ? 0 : num_threads);
+
+    // Gradient of the initial weights
+    if (full_batch)
     {
-        temp_weights[i] = weights[i];
+        predict_gradient(features, labels, new_weights, ws, num_threads);
     }
 
     for (int i = 0; i < iters; i++)
     {
+        int batch_count = N;
+        if (!full_batch)
+        {
+            vector<int> batch = schedule.get_batch(i);
+            batch_count = batch.size();
+            if (batch_features.rows() != batch_count)
+            {
+                batch_features = Matrix<float>(batch_count, colSize);
+                batch_labels.resize(batch_count);
+            }
+            for (int b = 0; b < batch_count; b++)
+            {
+                copy(features.row_data(batch[b]), features.row_data(batch[b]) + colSize, batch_features.row_data(b));
+                batch_labels[b] = labels[batch[b]];
+            }
+            predict_gradient(batch_features, batch_labels, new_weights, ws, get_num_threads(batch_threads, batch_count));
+        }
+
         // Get new weights
-        new_weights = update_weights(features, labels, temp_weights, learning_rate);
+        update_weights(new_weights, ws.gradient, batch_count, schedule.get_learning_rate(i));
 
-        // Get cost
-        float cost = cost_function(features, labels, new_weights);
-        cost_history[i] = cost;
+        // Get cost (and with full batches the gradient for the next iteration)
+        bool cost_step = schedule.is_cost_step(i);
+        float cost = 0;
+        if (full_batch)
+        {
+            cost = predict_gradient(features, labels, new_weights, ws, num_threads);
+        }
+        else if (cost_step)
+        {
+            cost = predict_gradient(features, labels, new_weights, cost_ws, num_threads);
+        }
+        if (!cost_step)
+        {
+            continue;
+        }
+        cost_history.push_back(cost);
+        bool converged = schedule.record_cost(i, cost);
 
         // Log Progress
-        if (i % 100 == 0)
+        if (cost_history.size() % 100 == 1 || converged)
         {
             cout << "Iteration:\t" << i << "\t" << cost << endl;
             cout << "Weights: ";
@@ -217,61 +369,18 @@ tuple<vector<float>, vector<float>> train(vector<vector<float>> features, vector
             }
             cout << endl;
         }
-
-        // Set temp weights to new weights
-        for (int j = 0; j < colSize; j++)
+        if (converged)
         {
-            temp_weights[j] = new_weights[j];
+            cout << "Converged after " << i + 1 << " of " << iters << " iterations" << endl;
+            break;
         }
     }
 
     return make_tuple(new_weights, cost_history);
 }
 
-// CSV to string matrix converter
-vector<vector<string>> CSVtoMatrix(string filename)
-{
-    vector<vector<string>> result_matrix;
-
-    ifstream data(filename);
-    string line;
-    int line_count = 0;
-    while (getline(data, line))
-    {
-        stringstream lineStream(line);
-        string cell;
-        vector<string> parsedRow;
-        while (getline(lineStream, cell, ','))
-        {
-            parsedRow.push_back(cell);
-        }
-        // Skip first line since it has text instead of numbers
-        if (line_count != 0)
-        {
-            result_matrix.push_back(parsedRow);
-        }
-        line_count++;
-    }
-    return result_matrix;
-}
-
-// String matrix to float matrix converter
-vector<vector<float>> stringToFloatMatrix(vector<vector<string>> matrix)
-{
-    vector<vector<float>> result(matrix.size(), vector<float>(matrix[0].size()));
-    for (int i = 0; i < matrix.size(); i++)
-    {
-        for (int j = 0; j < matrix[0].size(); j++)
-        {
-            result[i][j] = ::atof(matrix[i][j].c_str());
-        }
-    }
-
-    return result;
-}
-
 // Mean calculation
-float getMean(vector<float> input_vec)
+float getMean(const vector<float> &input_vec)
 {
     float mean = 0;
     for (int i = 0; i < input_vec.size(); i++)
@@ -284,7 +393,7 @@ float getMean(vector<float> input_vec)
 }
 
 // Standard Dev calculation
-float getStandardDev(vector<float> input_vec, float mean)
+float getStandardDev(const vector<float> &input_vec, float mean)
 {
     float variance = 0;
     for (int i = 0; i < input_vec.size(); i++)
@@ -298,11 +407,11 @@ float getStandardDev(vector<float> input_vec, float mean)
 }
 
 // Standard Scaler
-vector<vector<float>> standard_scaler(vector<vector<float>> input_matrix)
+Matrix<float> standard_scaler(const Matrix<float> &input_matrix)
 {
-    int rowSize = input_matrix.size();
-    int colSize = input_matrix[0].size();
-    vector<vector<float>> result_matrix(rowSize, vector<float>(colSize));
+    int rowSize = input_matrix.rows();
+    int colSize = input_matrix.cols();
+    Matrix<float> result_matrix(rowSize, colSize);
 
     // Optimization: Get Means and Standard Devs first then do the scaling
     // first pass: get means and standard devs
@@ -310,13 +419,7 @@ vector<vector<float>> standard_scaler(vector<vector<float>> input_matrix)
     vector<float> stdev_vec(colSize);
     for (int i = 0; i < colSize; i++)
     {
-        vector<float> column(rowSize);
-        for (int j = 0; j < rowSize; j++)
-        {
-            // cout << input_matrix[j][i] << ", ";
-            column[j] = input_matrix[j][i];
-            // cout << column[j] << ", ";
-        }
+        vector<float> column = input_matrix.transposed().row(i);
 
         means_vec[i] = getMean(column);
         stdev_vec[i] = getStandardDev(column, means_vec[i]);
@@ -329,7 +432,7 @@ vector<vector<float>> standard_scaler(vector<vector<float>> input_matrix)
     {
         for (int j = 0; j < colSize; j++)
         {
-            result_matrix[i][j] = (input_matrix[i][j] - means_vec[j]) / stdev_vec[j];
+            result_matrix(i, j) = (input_matrix(i, j) - means_vec[j]) / stdev_vec[j];
             // cout << "RESULT at i = " << i << ":\t" << result_matrix[i][j] << endl;
         }
     }
@@ -337,7 +440,7 @@ vector<vector<float>> standard_scaler(vector<vector<float>> input_matrix)
     return result_matrix;
 }
 
-float accuracy(vector<float> predicted_labels, vector<float> actual_labels)
+float accuracy(const vector<float> &predicted_labels, const vector<float> &actual_labels)
 {
     // handle error
     if (predicted_labels.size() != actual_labels.size())
@@ -375,40 +478,39 @@ int main()
 {
     // Read File
     string filename = "pulsar_stars.csv";
-    vector<vector<string>> s_matrix = CSVtoMatrix(filename);
-    vector<vector<float>> f_matrix = stringToFloatMatrix(s_matrix);
+    Matrix<float> f_matrix = load_csv<float>(filename);
 
     // Test print first 10 rows
     cout << "First 10 rows of CSV file --------\n"
          << endl;
     for (int i = 0; i < 10; i++)
     {
-        for (int j = 0; j < f_matrix[0].size(); j++)
+        for (int j = 0; j < f_matrix.cols(); j++)
         {
-            cout << f_matrix[i][j] << ", ";
+            cout << f_matrix(i, j) << ", ";
         }
         cout << endl;
     }
     cout << "...........\nLast 10 rows of CSV file ----------\n"
          << endl;
     // Test print last 10 rows
-    for (int i = f_matrix.size() - 10; i < f_matrix.size(); i++)
+    for (int i = f_matrix.rows() - 10; i < f_matrix.rows(); i++)
     {
-        for (int j = 0; j < f_matrix[0].size(); j++)
+        for (int j = 0; j < f_matrix.cols(); j++)
         {
-            cout << f_matrix[i][j] << ", ";
+            cout << f_matrix(i, j) << ", ";
         }
         cout << endl;
     }
 
     // Init features, labels and weights
     // Init features (rows of f_matrix , cols of f_matrix - 1)
-    int rows = f_matrix.size();
+    int rows = f_matrix.rows();
     cout << "\nNumber of rows  = " << rows << endl;
-    int cols = f_matrix[0].size() - 1;
+    int cols = f_matrix.cols() - 1;
     cout << "\nNumber of cols  = " << cols << endl;
 
-    vector<vector<float>> features(rows, vector<float>(cols));
+    Matrix<float> features(rows, cols);
     // Init labels (rows of f_matrix)
     vector<float> labels(rows);
     // Init weight vector with zeros (cols of features)
@@ -419,9 +521,9 @@ int main()
     {
         for (int j = 0; j < cols; j++)
         {
-            features[i][j] = f_matrix[i][j];
+            features(i, j) = f_matrix(i, j);
         }
-        labels[i] = f_matrix[i][cols];
+        labels[i] = f_matrix(i, cols);
     }
 
     // Fill the weights with random numbers (from 1 - 2)
@@ -436,17 +538,17 @@ int main()
          << endl;
 
     // Features Print test
-    cout << "Features row size = " << features.size() << endl;
-    cout << "Features col size = " << features[0].size() << endl;
+    cout << "Features row size = " << features.rows() << endl;
+    cout << "Features col size = " << features.cols() << endl;
 
     cout << "Labels row size = " << labels.size() << endl;
     cout << "Weights row size = " << weights.size() << endl;
 
     for (int i = 0; i < 10; i++)
     {
-        for (int j = 0; j < features[0].size(); j++)
+        for (int j = 0; j < features.cols(); j++)
         {
-            cout << features[i][j] << ", ";
+            cout << features(i, j) << ", ";
         }
         cout << endl;
     }
@@ -455,14 +557,14 @@ int main()
     cout << "\nSTANDARDIZE TEST---------\n"
          << endl;
 
-    vector<vector<float>> standard_features = standard_scaler(features);
+    Matrix<float> standard_features = standard_scaler(features);
 
     // Test print first 10 rows
     for (int i = 0; i < 10; i++)
     {
         for (int j = 0; j < cols; j++)
         {
-            cout << standard_features[i][j] << ", ";
+            cout << standard_features(i, j) << ", ";
         }
         cout << endl;
     }
@@ -472,7 +574,7 @@ int main()
     {
         for (int j = 0; j < cols; j++)
         {
-            cout << standard_features[i][j] << ", ";
+            cout << standard_features(i, j) << ", ";
         }
         cout << endl;
     }
@@ -526,6 +628,19 @@ int main()
     }
     cout << endl;
 
+    // Mini-batch SGD: shuffled batches of 512 observations, the cost of all observations every 10 steps,
+    // stops once the cost improved by less than 0.01% twice in a row
+    cout << "\nMini-batch Training--------------\n"
+         << endl;
+    SGDOptions sgd;
+    sgd.batch_size = 512;
+    sgd.decay = 0.1;
+    sgd.cost_every = 10;
+    sgd.tolerance = 1e-4;
+    tuple<vector<float>, vector<float>> sgd_tuple = train(standard_features, labels, weights, 0.1, 5000, NUM_THREADS, sgd);
+    vector<float> sgd_cost_history = get<1>(sgd_tuple);
+    cout << "Costs computed: " << sgd_cost_history.size() << ", final cost: " << sgd_cost_history.back() << endl;
+
     // Print Accuracy
     cout << "\nACCURACY\n-------------------" << endl;
     
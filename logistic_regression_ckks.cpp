@@ -1,449 +1,289 @@
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <sstream>
 #include "seal/seal.h"
 #include "helper.h"
 
 using namespace std;
 using namespace seal;
 
-#define POLY_MOD_DEGREE 16384
-#define DEGREE 3
-#define ITERS 10
-#define LEARNING_RATE 0.1
+#include "logistic_regression_ckks.h"
+#include "sharding.h"
 
-template <typename T>
-vector<T> rotate_vec(vector<T> input_vec, int num_rotations)
+// Settings of a run, set with --key value on the command line or key=value lines in a --config file
+struct LRConfig
 {
-    if (num_rotations > input_vec.size())
+    string data_path = "pulsar_stars_copy.csv";
+    // 0 = the smallest poly_modulus_degree that fits the depth of the training step
+    size_t poly_modulus_degree = 0;
+    int scale_bits = 40;
+    // Maximum number of steps, training stops earlier once the cost converged (sgd.tolerance)
+    int iters = 10;
+    double learning_rate = 0.1;
+    bool packed = true;
+    // Data-parallel shards of the observations (1 = no sharding)
+    int shards = 1;
+    // Directory of the key cache (empty = keys are generated every run), HE_KEY_CACHE by default
+    string key_cache_dir = KeyCache::dir_from_env();
+    // Mini-batches, learning rate schedule and early stopping (the default is full-batch gradient descent)
+    SGDOptions sgd;
+    LROptions options;
+};
+
+// Shard workers of a sharded run, each one behind a serialized channel in this process
+// (in a deployment the bytes go to the node holding the shard, which runs the ShardWorker)
+struct LoopbackShards
+{
+    vector<unique_ptr<ShardWorker>> workers;
+    vector<unique_ptr<SerializedShardTransport>> transports;
+    vector<ShardTransport *> shards;
+
+    void add(PartialGradient gradient, FHESession &session)
     {
-        cerr << "Invalid number of rotations" << endl;
-        exit(EXIT_FAILURE);
+        workers.push_back(make_unique<ShardWorker>(session.context, gradient));
+        ShardWorker *worker = workers.back().get();
+        transports.push_back(make_unique<SerializedShardTransport>(session.context, [worker](const string &request) { return worker->handle(request); }));
+        shards.push_back(transports.back().get());
     }
 
-    vector<T> rotated_res(input_vec.size());
-    for (int i = 0; i < input_vec.size(); i++)
+    void print_traffic()
     {
-        rotated_res[i] = input_vec[(i + num_rotations) % (input_vec.size())];
+        size_t sent = 0;
+        size_t received = 0;
+        for (auto &transport : transports)
+        {
+            sent += transport->bytes_sent;
+            received += transport->bytes_received;
+        }
+        cout << "\nShard traffic: " << sent << " bytes of weights sent, " << received << " bytes of partial gradients received" << endl;
     }
+};
 
-    return rotated_res;
-}
-
-void print_Ciphertext_Info(string ctx_name, Ciphertext ctx, shared_ptr<SEALContext> context)
+void print_usage(const char *program)
 {
-    cout << "/" << endl;
-    cout << "| " << ctx_name << " Info:" << endl;
-    cout << "|\tLevel:\t" << context->get_context_data(ctx.parms_id())->chain_index() << endl;
-    cout << "|\tScale:\t" << log2(ctx.scale()) << endl;
-    ios old_fmt(nullptr);
-    old_fmt.copyfmt(cout);
-    cout << fixed << setprecision(10);
-    cout << "|\tExact Scale:\t" << ctx.scale() << endl;
-    cout.copyfmt(old_fmt);
-    cout << "|\tSize:\t" << ctx.size() << endl;
-    cout << "\\" << endl;
+    cerr << "Usage: " << program << " [options]" << endl;
+    cerr << "  --config FILE       read key=value lines with the keys of the options below (later options override it)" << endl;
+    cerr << "  --data FILE         CSV with the features and the label in the last column (default pulsar_stars_copy.csv)" << endl;
+    cerr << "  --poly N            poly_modulus_degree (default 0, the smallest that fits the depth)" << endl;
+    cerr << "  --scale-bits B      bits of the scale and of the rescale primes (default 40)" << endl;
+    cerr << "  --degree D          degree of the sigmoid approximation, 3, 5 or 7 (default 3)" << endl;
+    cerr << "  --iters I           maximum gradient descent iterations (default 10)" << endl;
+    cerr << "  --lr R              learning rate (default 0.1)" << endl;
+    cerr << "  --batch-size B      observations per step, rounded to whole packed batches or encrypted row groups, 0 = all (default 0)" << endl;
+    cerr << "  --shuffle B         visit the mini-batches in a new order every epoch, true or false (default true)" << endl;
+    cerr << "  --decay D           learning rate of epoch e is lr / (1 + D * e) (default 0)" << endl;
+    cerr << "  --cost-every K      the client computes the cost from the refreshed weights every K steps, 0 = never (default 1)" << endl;
+    cerr << "  --tolerance T       stop once the cost improved by less than T (relative) --patience times in a row, 0 = never (default 0)" << endl;
+    cerr << "  --patience P        see --tolerance (default 2)" << endl;
+    cerr << "  --layout L          packed or unpacked (default packed)" << endl;
+    cerr << "  --pipelined B       compute the next gradient during the refresh, true or false (default false)" << endl;
+    cerr << "  --threads T         worker threads, 0 = all hardware threads (default 0)" << endl;
+    cerr << "  --shards S          split the observations into S data-parallel shards whose partial gradients are summed (default 1)" << endl;
+    cerr << "  --key-cache DIR     load the keys from DIR and save new ones there (default $HE_KEY_CACHE, none if unset)" << endl;
 }
 
-// Sigmoid
-float sigmoid(float z)
+bool parse_bool(const string &key, const string &value)
 {
-    return 1 / (1 + exp(-z));
-}
-
-// Tree Method
-Ciphertext Tree_cipher(Ciphertext ctx, int degree, double scale, vector<double> coeffs, CKKSEncoder &ckks_encoder, Evaluator &evaluator, Encryptor &encryptor, RelinKeys relin_keys, EncryptionParameters params)
-{
-    cout << "->" << __func__ << endl;
-
-    SEALContext context(params);
-    auto tmp = make_shared<SEALContext>(context);
-    
-    // Print Ciphertext Information
-    print_Ciphertext_Info("CTX", ctx, tmp);
-
-    int depth = ceil(log2(degree));
-
-    // Form the polynomial
-    vector<Plaintext> plain_coeffs(degree + 1);
-    cout << "Polynomial = ";
-    int counter = 0;
-    for (size_t i = 0; i < degree + 1; i++)
+    if (value == "true" || value == "1")
     {
-        // cout << "-> " << __LINE__ << endl;
-        if (coeffs[i] == 0)
-        {
-            continue;
-        }
-        ckks_encoder.encode(coeffs[i], scale, plain_coeffs[i]);
-        cout << "x^" << counter << " * (" << coeffs[i] << ")"
-             << ", ";
-        counter++;
+        return true;
     }
-    cout << endl;
-
-    Plaintext plain_result;
-    vector<double> result;
-
-    double expected_result = coeffs[degree];
-
-    // Compute all powers
-    vector<Ciphertext> powers(degree + 1);
-    compute_all_powers(ctx, degree, evaluator, relin_keys, powers);
-    cout << "All powers computed " << endl;
-
-    // Print Ciphertext Information
-    print_Ciphertext_Info("CTX", ctx, tmp);
-
-    // Encrypt First Coefficient
-    Ciphertext enc_result;
-    cout << "Encrypt first coeff...";
-    encryptor.encrypt(plain_coeffs[0], enc_result);
-    cout << "Done" << endl;
-
-    // Print Ciphertext Information
-    print_Ciphertext_Info("enc_result", enc_result, tmp);
-
-    Ciphertext temp;
-
-    for (int i = 1; i <= degree; i++)
+    if (value == "false" || value == "0")
     {
-        // cout << "-> " << __LINE__ << endl;
-
-        evaluator.mod_switch_to_inplace(plain_coeffs[i], powers[i].parms_id());
-        // cout << "-> " << __LINE__ << endl;
-
-        evaluator.multiply_plain(powers[i], plain_coeffs[i], temp);
-        // cout << "-> " << __LINE__ << endl;
-
-        evaluator.rescale_to_next_inplace(temp);
-        // cout << "-> " << __LINE__ << endl;
-
-        evaluator.mod_switch_to_inplace(enc_result, temp.parms_id());
-        // cout << "-> " << __LINE__ << endl;
-
-        // Manual Rescale
-        enc_result.scale() = pow(2.0, (int)log2(enc_result.scale()));
-        temp.scale() = pow(2.0, (int)log2(enc_result.scale()));
-        // cout << "-> " << __LINE__ << endl;
-
-        evaluator.add_inplace(enc_result, temp);
+        return false;
     }
-
-    // Print Ciphertext Information
-    print_Ciphertext_Info("enc_result", enc_result, tmp);
-
-    return enc_result;
+    cerr << "Invalid value for " << key << ": " << value << " (true or false)" << endl;
+    exit(1);
 }
 
-Ciphertext Horner_cipher(Ciphertext ctx, int degree, vector<double> coeffs, CKKSEncoder &ckks_encoder, double scale, Evaluator &evaluator, Encryptor &encryptor, RelinKeys relin_keys, EncryptionParameters params)
-{
-    SEALContext context(params);
-    auto tmp = make_shared<SEALContext>(context);
-
-    cout << "->" << __func__ << endl;
-    cout << "->" << __LINE__ << endl;
-
-    print_Ciphertext_Info("CTX", ctx, tmp);
-
-    vector<Plaintext> plain_coeffs(degree + 1);
+void read_config_file(const string &path, LRConfig &config);
 
-    // Random Coefficients from 0-1
-    cout << "Polynomial = ";
-    int counter = 0;
-    for (size_t i = 0; i < degree + 1; i++)
+// Sets one option, key is the name of the command line option without the dashes
+void set_config_value(const string &key, const string &value, LRConfig &config)
+{
+    if (key == "config")
     {
-        // coeffs[i] = (double)rand() / RAND_MAX;
-        ckks_encoder.encode(coeffs[i], scale, plain_coeffs[i]);
-        cout << "x^" << counter << " * (" << coeffs[i] << ")"
-             << ", ";
-        counter++;
+        read_config_file(value, config);
     }
-    cout << endl;
-    // cout << "->" << __LINE__ << endl;
-
-    Ciphertext temp;
-    encryptor.encrypt(plain_coeffs[degree], temp);
-
-    Plaintext plain_result;
-    vector<double> result;
-    // cout << "->" << __LINE__ << endl;
-
-    for (int i = degree - 1; i >= 0; i--)
+    else if (key == "data")
     {
-        int ctx_level = tmp->get_context_data(ctx.parms_id())->chain_index();
-        int temp_level = tmp->get_context_data(temp.parms_id())->chain_index();
-        if (ctx_level > temp_level)
-        {
-            evaluator.mod_switch_to_inplace(ctx, temp.parms_id());
-        }
-        else if (ctx_level < temp_level)
+        config.data_path = value;
+    }
+    else if (key == "poly")
+    {
+        config.poly_modulus_degree = stoul(value);
+    }
+    else if (key == "scale-bits")
+    {
+        config.scale_bits = stoi(value);
+    }
+    else if (key == "degree")
+    {
+        config.options.degree = stoi(value);
+    }
+    else if (key == "iters")
+    {
+        config.iters = stoi(value);
+    }
+    else if (key == "lr")
+    {
+        config.learning_rate = stod(value);
+    }
+    else if (key == "batch-size")
+    {
+        config.sgd.batch_size = stoi(value);
+    }
+    else if (key == "shuffle")
+    {
+        config.sgd.shuffle = parse_bool(key, value);
+    }
+    else if (key == "decay")
+    {
+        config.sgd.decay = stod(value);
+    }
+    else if (key == "cost-every")
+    {
+        config.sgd.cost_every = stoi(value);
+    }
+    else if (key == "tolerance")
+    {
+        config.sgd.tolerance = stod(value);
+    }
+    else if (key == "patience")
+    {
+        config.sgd.patience = stoi(value);
+    }
+    else if (key == "layout")
+    {
+        if (value != "packed" && value != "unpacked")
         {
-            evaluator.mod_switch_to_inplace(temp, ctx.parms_id());
+            cerr << "Invalid layout: " << value << " (packed or unpacked)" << endl;
+            exit(1);
         }
-        evaluator.multiply_inplace(temp, ctx);
-        // cout << "->" << __LINE__ << endl;
-
-        evaluator.relinearize_inplace(temp, relin_keys);
-
-        evaluator.rescale_to_next_inplace(temp);
-        // cout << "->" << __LINE__ << endl;
-
-        evaluator.mod_switch_to_inplace(plain_coeffs[i], temp.parms_id());
-
-        // Manual rescale
-        temp.scale() = pow(2.0, 40);
-        // cout << "->" << __LINE__ << endl;
-
-        evaluator.add_plain_inplace(temp, plain_coeffs[i]);
+        config.packed = value == "packed";
     }
-    // cout << "->" << __LINE__ << endl;
-
-    print_Ciphertext_Info("temp", temp, tmp);
-
-    return temp;
-}
-
-// Predict Ciphertext Weights
-Ciphertext predict_cipher_weights(vector<Ciphertext> features, Ciphertext weights, int num_weights, double scale, Evaluator &evaluator, CKKSEncoder &ckks_encoder, GaloisKeys gal_keys, RelinKeys relin_keys, Encryptor &encryptor, EncryptionParameters params)
-{
-    cout << "->" << __func__ << endl;
-    cout << "->" << __LINE__ << endl;
-
-    // Linear Transformation (loop over rows and dot product)
-    int num_rows = features.size();
-    vector<Ciphertext> results(num_rows);
-
-    for (int i = 0; i < num_rows; i++)
+    else if (key == "pipelined")
     {
-        // Dot Product
-        results[i] = cipher_dot_product(features[i], weights, num_weights, relin_keys, gal_keys, evaluator);
-        // Create mask
-        vector<double> mask_vec(num_rows, 0);
-        mask_vec[i] = 1;
-        Plaintext mask_pt;
-        ckks_encoder.encode(mask_vec, scale, mask_pt);
-        // Bring down mask by 1 level since dot product consumed 1 level
-        evaluator.mod_switch_to_next_inplace(mask_pt);
-        // Multiply result with mask
-        evaluator.multiply_plain_inplace(results[i], mask_pt);
+        config.options.pipelined = parse_bool(key, value);
     }
-    // Add all results to ciphertext vec
-    Ciphertext lintransf_vec;
-    evaluator.add_many(results, lintransf_vec);
-    cout << "->" << __LINE__ << endl;
-
-    // Relin
-    evaluator.relinearize_inplace(lintransf_vec, relin_keys);
-    // Rescale
-    evaluator.rescale_to_next_inplace(lintransf_vec);
-    // Manual Rescale
-    lintransf_vec.scale() = pow(2, (int)log2(lintransf_vec.scale()));
-    cout << "->" << __LINE__ << endl;
-    // Sigmoid over result
-    vector<double> coeffs;
-    if (DEGREE == 3)
+    else if (key == "threads")
     {
-        coeffs = {0.5, 1.20069, 0.00001, -0.81562};
+        config.options.num_threads = stoi(value);
     }
-    else if (DEGREE == 5)
+    else if (key == "shards")
     {
-        coeffs = {0.5, 1.53048, 0.00001, -2.3533056, 0.00001, 1.3511295};
+        config.shards = stoi(value);
     }
-    else if (DEGREE == 7)
+    else if (key == "key-cache")
     {
-        coeffs = {0.5, 1.73496, 0.00001, -4.19407, 0.00001, 5.43402, 0.00001, -2.50739};
+        config.key_cache_dir = value;
     }
     else
     {
-        cerr << "Invalid DEGREE" << endl;
-        exit(EXIT_FAILURE);
+        cerr << "Unknown option: " << key << endl;
+        exit(1);
     }
-
-    Ciphertext predict_res = Horner_cipher(lintransf_vec, coeffs.size() - 1, coeffs, ckks_encoder, scale, evaluator, encryptor, relin_keys, params);
-    cout << "->" << __LINE__ << endl;
-    return predict_res;
 }
 
-// Update Weights (or Gradient Descent)
-Ciphertext update_weights(vector<Ciphertext> features, vector<Ciphertext> features_T, Ciphertext labels, Ciphertext weights, float learning_rate, Evaluator &evaluator, CKKSEncoder &ckks_encoder, GaloisKeys gal_keys, RelinKeys relin_keys, Encryptor &encryptor, double scale, EncryptionParameters params)
+// key=value per line, blank lines and lines starting with # are skipped
+void read_config_file(const string &path, LRConfig &config)
 {
-
-    cout << "->" << __func__ << endl;
-    cout << "->" << __LINE__ << endl;
-
-    int num_observations = features.size();
-    int num_weights = features_T.size();
-
-    cout << "num obs = " << num_observations << endl;
-    cout << "num weights = " << num_weights << endl;
-
-    // Get predictions
-    Ciphertext predictions = predict_cipher_weights(features, weights, num_weights, scale, evaluator, ckks_encoder, gal_keys, relin_keys, encryptor, params);
-
-    // Calculate Predictions - Labels
-    // Mod switch labels
-    evaluator.mod_switch_to_inplace(labels, predictions.parms_id());
-    Ciphertext pred_labels;
-    evaluator.sub(predictions, labels, pred_labels);
-
-    cout << "->" << __LINE__ << endl;
-
-    // Calculate Gradient vector (loop over rows and dot product)
-
-    vector<Ciphertext> gradient_results(num_weights);
-    for (int i = 0; i < num_weights; i++)
+    ifstream in(path);
+    if (!in)
     {
-        // Mod switch features T [i]
-        evaluator.mod_switch_to_inplace(features_T[i], pred_labels.parms_id());
-        gradient_results[i] = cipher_dot_product(features_T[i], pred_labels, num_observations, relin_keys, gal_keys, evaluator);
-
-        // Create mask
-        vector<double> mask_vec(num_weights, 0);
-        mask_vec[i] = 1;
-        Plaintext mask_pt;
-        ckks_encoder.encode(mask_vec, scale, mask_pt);
-
-        // Mod switch mask
-        evaluator.mod_switch_to_inplace(mask_pt, gradient_results[i].parms_id());
-        // Multiply result with mask
-        evaluator.multiply_plain_inplace(gradient_results[i], mask_pt);
+        cerr << "Couldn't open file: " << path << endl;
+        exit(1);
     }
-    cout << "->" << __LINE__ << endl;
-
-    // Add all gradient results to gradient
-    Ciphertext gradient;
-    evaluator.add_many(gradient_results, gradient);
-
-    // Relin
-    evaluator.relinearize_inplace(gradient, relin_keys);
-    // Rescale
-    evaluator.rescale_to_next_inplace(gradient);
-    // Manual rescale
-    gradient.scale() = pow(2, (int)log2(gradient.scale()));
-
-    // Multiply by learning_rate/observations
-    double N = learning_rate / num_observations;
-
-    cout << "LR / num_obs = " << N << endl;
-
-    Plaintext N_pt;
-    ckks_encoder.encode(N, scale, N_pt);
-    // Mod Switch N_pt
-    evaluator.mod_switch_to_inplace(N_pt, gradient.parms_id());
-
-    cout << "->" << __LINE__ << endl;
-    evaluator.multiply_plain_inplace(gradient, N_pt); // ERROR HERE: CIPHERTEXT IS TRANSPARENT
-    // I fixed this error, just change "ckks_encoder.encode(N, N_pt);" to "ckks_encoder.encode(N, scale, N_pt);", line 331
 
-    // Subtract from weights
-    Ciphertext new_weights;
-    evaluator.sub(gradient, weights, new_weights);
-    evaluator.negate_inplace(new_weights);
-
-    return new_weights;
-}
-
-// Train model function
-Ciphertext train_cipher(vector<Ciphertext> features, vector<Ciphertext> features_T, Ciphertext labels, Ciphertext weights, float learning_rate, int iters, int observations, int num_weights, Evaluator &evaluator, CKKSEncoder &ckks_encoder, double scale, GaloisKeys gal_keys, RelinKeys relin_keys, Encryptor &encryptor, Decryptor &decryptor, EncryptionParameters params)
-{
-    cout << "->" << __func__ << endl;
-    cout << "->" << __LINE__ << endl;
-
-    // Copy weights to new_weights
-    Ciphertext new_weights = weights;
-
-    for (int i = 0; i < iters; i++)
+    string line;
+    while (getline(in, line))
     {
-        // Get new weights
-        new_weights = update_weights(features, features_T, labels, new_weights, learning_rate, evaluator, ckks_encoder, gal_keys, relin_keys, encryptor, scale, params);
-
-        // Refresh weights (Decrypt and Re-Encrypt)
-        Plaintext new_weights_pt;
-        decryptor.decrypt(new_weights, new_weights_pt);
-        vector<double> new_weights_decoded;
-        ckks_encoder.decode(new_weights_pt, new_weights_decoded);
-
-        // Log Progress
-        if (i % 5 == 0)
+        if (line.empty() || line[0] == '#')
         {
-            cout << "\nIteration:\t" << i << endl;
-
-            // Print weights
-            cout << "Weights:\n\t[";
-            for (int i = 0; i < num_weights; i++)
-            {
-                cout << new_weights_decoded[i] << ", ";
-            }
-            cout << "]" << endl;
+            continue;
         }
-
-        encryptor.encrypt(new_weights_pt, new_weights);
+        size_t equals = line.find('=');
+        if (equals == string::npos)
+        {
+            cerr << "Invalid line in " << path << ": " << line << endl;
+            exit(1);
+        }
+        set_config_value(line.substr(0, equals), line.substr(equals + 1), config);
     }
-
-    return new_weights;
 }
 
-// Sigmoid approximation without encryption
-double sigmoid_approx(double x)
+LRConfig parse_config(int argc, char *argv[])
 {
-    cout << "->" << __func__ << endl;
-    cout << "->" << __LINE__ << endl;
+    LRConfig config;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--help" || arg == "-h")
+        {
+            print_usage(argv[0]);
+            exit(0);
+        }
+        if (arg.compare(0, 2, "--") != 0 || i + 1 >= argc)
+        {
+            cerr << (arg.compare(0, 2, "--") != 0 ? "Unknown option: " : "Missing value for ") << arg << endl;
+            print_usage(argv[0]);
+            exit(1);
+        }
+        set_config_value(arg.substr(2), argv[++i], config);
+    }
 
-    double res;
-    if (DEGREE == 3)
+    if (config.options.degree != 3 && config.options.degree != 5 && config.options.degree != 7)
     {
-        res = 0.5 + (1.20096 * (x / 8)) - (0.81562 * (pow((x / 8), 3)));
+        cerr << "Invalid sigmoid degree: " << config.options.degree << " (3, 5 or 7)" << endl;
+        exit(1);
     }
-    else if (DEGREE == 5)
+    if (config.iters < 1 || config.shards < 1 || config.sgd.patience < 1)
     {
-        res = 0.5 + (1.53048 * (x / 8)) - (2.3533056 * (pow((x / 8), 3))) + (1.3511295 * (pow((x / 8), 5)));
+        cerr << "--iters, --shards and --patience must be at least 1" << endl;
+        exit(1);
     }
-    else if (DEGREE == 7)
+    if (config.sgd.batch_size < 0 || config.sgd.cost_every < 0)
     {
-        res = 0.5 + (1.73496 * (x / 8)) - (4.19407 * (pow((x / 8), 3))) + (5.43402 * (pow((x / 8), 5))) - (2.50739 * (pow((x / 8), 3)));
+        cerr << "--batch-size and --cost-every can't be negative" << endl;
+        exit(1);
     }
-    else
+    // The shards always compute the gradient of all their observations
+    if (config.shards > 1 && config.sgd.batch_size > 0)
     {
-        cerr << "Invalid DEGREE" << endl;
-        exit(EXIT_SUCCESS);
+        cerr << "--batch-size needs --shards 1" << endl;
+        exit(1);
     }
-    return res;
+
+    return config;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
+    // HE_TRACE=1 prints the evaluator operation counts and times per call site, HE_TRACE=events also logs every operation
+    bool trace = EvaluatorTrace::enable_from_env();
+    LRConfig config = parse_config(argc, argv);
+    const LROptions &options = config.options;
 
-    // Test evaluate sigmoid approx
-    EncryptionParameters params(scheme_type::ckks);
-
-    params.set_poly_modulus_degree(POLY_MOD_DEGREE);
-    params.set_coeff_modulus(CoeffModulus::Create(POLY_MOD_DEGREE, {60, 40, 40, 40, 40, 40, 40, 40, 60}));
-    // "scale out of bounds" because primes are not sufficient
-
-    double scale = pow(2.0, 40);
-
-    SEALContext context(params);
-    auto tmp = make_shared<SEALContext>(context);
-
-    // Generate keys, encryptor, decryptor and evaluator
-    KeyGenerator keygen(context);
-    SecretKey sk = keygen.secret_key();
-    PublicKey pk;
-    keygen.create_public_key(pk);
-    RelinKeys relin_keys;
-    keygen.create_relin_keys(relin_keys);
-    GaloisKeys gal_keys;
-    keygen.create_galois_keys(gal_keys);
+    // Read File
+    Matrix<double> f_matrix = load_csv<double>(config.data_path);
+    int rows = f_matrix.rows();
+    int cols = f_matrix.cols() - 1;
 
-    Encryptor encryptor(context, pk);
-    Evaluator evaluator(context);
-    Decryptor decryptor(context, sk);
+    // Smallest parameters that fit one training step between two refreshes
+    int depth = get_lr_depth(options.degree, config.packed);
+    ParameterPlan plan = plan_parameters(depth, config.scale_bits, get_lr_min_slots(rows, cols, config.packed), config.poly_modulus_degree);
+    print_plan(plan);
+    double scale = plan.scale();
 
-    // Create CKKS encoder
-    CKKSEncoder ckks_encoder(context);
+    // Create context, keys, encryptor, decryptor, evaluator and encoder once
+    // Galois keys are generated once the data dimensions are known
+    FHESession session(plan.get_parameters(), scale, config.key_cache_dir);
+    Encryptor &encryptor = session.encryptor;
+    Decryptor &decryptor = session.decryptor;
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
 
-    print_parameters(tmp);
+    print_parameters(make_shared<SEALContext>(session.context));
 
     // -------------------------- TEST SIGMOID APPROXIMATION ---------------------------
     cout << "\n------------------- TEST SIGMOID APPROXIMATION -------------------\n"
@@ -458,24 +298,7 @@ int main()
     encryptor.encrypt(ptx, ctx);
 
     // Create coeffs (Change with degree)
-    vector<double> coeffs;
-    if (DEGREE == 3)
-    {
-        coeffs = {0.5, 1.20069, 0.00001, -0.81562};
-    }
-    else if (DEGREE == 5)
-    {
-        coeffs = {0.5, 1.53048, 0.00001, -2.3533056, 0.00001, 1.3511295};
-    }
-    else if (DEGREE == 7)
-    {
-        coeffs = {0.5, 1.73496, 0.00001, -4.19407, 0.00001, 5.43402, 0.00001, -2.50739};
-    }
-    else
-    {
-        cerr << "Invalid DEGREE" << endl;
-        exit(EXIT_FAILURE);
-    }
+    vector<double> coeffs = get_sigmoid_coeffs(options.degree);
 
     // Multiply x by 1/8
     double eight = 1 / 8;
@@ -486,11 +309,11 @@ int main()
     chrono::microseconds time_diff;
     time_start = chrono::high_resolution_clock::now();
 
-    // Ciphertext ct_res_sigmoid = Tree_cipher(ctx, DEGREE, scale, coeffs, ckks_encoder, evaluator, encryptor, relin_keys, params);
-    Ciphertext ct_res_sigmoid = Horner_cipher(ctx, DEGREE, coeffs, ckks_encoder, scale, evaluator, encryptor, relin_keys, params);
+    Ciphertext ct_res_sigmoid = evaluate_polynomial(ctx, coeffs, session);
     time_end = chrono::high_resolution_clock::now();
     time_diff = chrono::duration_cast<chrono::microseconds>(time_end - time_start);
     cout << "Polynomial Evaluation Duration:\t" << time_diff.count() << " microseconds" << endl;
+    print_Ciphertext_Info("ct_res_sigmoid", ct_res_sigmoid, session.context);
 
     // Decrypt and decode
     Plaintext pt_res_sigmoid;
@@ -502,7 +325,7 @@ int main()
     double true_expected_res = sigmoid(x_eight);
 
     // Get expected approximate result
-    double expected_approx_res = sigmoid_approx(x);
+    double expected_approx_res = sigmoid_approx(x, options.degree);
 
     cout << "Actual Approximate Result =\t\t" << res_sigmoid_vec[0] << endl;
     cout << "Expected Approximate Result =\t\t" << expected_approx_res << endl;
@@ -518,19 +341,12 @@ int main()
     cout << "\n--------------------------- TEST LR CKKS ---------------------------\n"
          << endl;
 
-    // Read File
-    string filename = "pulsar_stars_copy.csv";
-    vector<vector<string>> s_matrix = CSVtoMatrix(filename);
-    vector<vector<double>> f_matrix = stringToDoubleMatrix(s_matrix);
-
     // Init features, labels and weights
     // Init features (rows of f_matrix , cols of f_matrix - 1)
-    int rows = f_matrix.size();
     cout << "\nNumber of rows  = " << rows << endl;
-    int cols = f_matrix[0].size() - 1;
     cout << "\nNumber of cols  = " << cols << endl;
 
-    vector<vector<double>> features(rows, vector<double>(cols));
+    Matrix<double> features(rows, cols);
     // Init labels (rows of f_matrix)
     vector<double> labels(rows);
     // Init weight vector with zeros (cols of features)
@@ -541,9 +357,9 @@ int main()
     {
         for (int j = 0; j < cols; j++)
         {
-            features[i][j] = f_matrix[i][j];
+            features(i, j) = f_matrix(i, j);
         }
-        labels[i] = f_matrix[i][cols];
+        labels[i] = f_matrix(i, cols);
     }
 
     // Fill the weights with random numbers (from 1 - 2)
@@ -557,8 +373,8 @@ int main()
          << endl;
 
     // Features Print test
-    cout << "Features row size = " << features.size() << endl;
-    cout << "Features col size = " << features[0].size() << endl;
+    cout << "Features row size = " << features.rows() << endl;
+    cout << "Features col size = " << features.cols() << endl;
 
     cout << "Labels row size = " << labels.size() << endl;
     cout << "Weights row size = " << weights.size() << endl;
@@ -567,7 +383,7 @@ int main()
     cout << "\nSTANDARDIZE TEST---------\n"
          << endl;
 
-    vector<vector<double>> standard_features = standard_scaler_double(features);
+    Matrix<double> standard_features = standard_scaler_double(features);
 
     // Print old weights
     cout << "\nOLD WEIGHTS\n------------------"
@@ -578,80 +394,222 @@ int main()
     }
     cout << endl;
 
-    // Get tranpose from client
-    vector<vector<double>> features_T = transpose_matrix(features);
+    // Log Progress (the client decodes the weights when it refreshes them, nothing is decrypted just for printing)
+    auto log_weights = [](int iteration, RefreshClient &client) {
+        if (iteration % 5 == 0)
+        {
+            cout << "\nIteration:\t" << iteration << endl;
 
-    // -------------- ENCODING ----------------
-    // Encode features
-    vector<Plaintext> features_pt(features.size());
-    cout << "\nENCODING FEATURES ...";
-    for (int i = 0; i < features.size(); i++)
-    {
-        ckks_encoder.encode(features[i], scale, features_pt[i]);
-    }
-    cout << "Done" << endl;
+            // Print weights
+            cout << "Weights:\n\t[";
+            for (double weight : client.latest_values())
+            {
+                cout << weight << ", ";
+            }
+            cout << "]" << endl;
+        }
+    };
+
+    // The client computes the cost from the weights it refreshed on the cost steps of the schedule, training stops once it converged
+    auto on_refresh = [&](int iteration, RefreshClient &client, SGDSchedule &schedule, const Matrix<double> &cost_features) {
+        log_weights(iteration, client);
+        if (!schedule.is_cost_step(iteration))
+        {
+            return true;
+        }
+
+        double cost = cost_plain(cost_features, labels, client.latest_values());
+        cout << "Cost after iteration " << iteration << ":\t" << cost << endl;
+        if (schedule.record_cost(iteration, cost))
+        {
+            cout << "Converged after " << iteration + 1 << " of " << config.iters << " iterations" << endl;
+            return false;
+        }
+        return true;
+    };
 
-    vector<Plaintext> features_T_pt(features_T.size());
-    cout << "\nENCODING TRANSPOSED FEATURES ...";
-    for (int i = 0; i < features_T.size(); i++)
+    // -------------- PACKED TRAINING ----------------
+    if (config.packed)
     {
-        ckks_encoder.encode(features_T[i], scale, features_T_pt[i]);
+        int width = get_packed_width(cols);
+        int slot_count = ckks_encoder.slot_count();
+        int batch_size = get_packed_batch_size(slot_count, width);
+        int num_batches = (rows + batch_size - 1) / batch_size;
+        cout << "\nPACKED LAYOUT: " << num_batches << " batches of " << batch_size << " observations" << endl;
+
+        // Only generate Galois keys for the steps used by the packed functions
+        session.create_galois_keys(get_packed_steps(slot_count, width));
+
+        // Encode and encrypt every batch
+        vector<vector<Ciphertext>> features_diagonals_ct(num_batches, vector<Ciphertext>(width));
+        vector<vector<Ciphertext>> features_T_diagonals_ct(num_batches, vector<Ciphertext>(width));
+        vector<Ciphertext> labels_ct(num_batches);
+        cout << "\nENCODING AND ENCRYPTING BATCHES ...";
+        for (int b = 0; b < num_batches; b++)
+        {
+            int start = b * batch_size;
+            features_diagonals_ct[b] = encrypt_rows(get_packed_diagonals(standard_features, start, batch_size, width), session, options.num_threads);
+            features_T_diagonals_ct[b] = encrypt_rows(get_packed_T_diagonals(standard_features, start, batch_size, width), session, options.num_threads);
+
+            vector<double> labels_batch(batch_size, 0);
+            for (int i = 0; i < batch_size && start + i < rows; i++)
+            {
+                labels_batch[i] = labels[start + i];
+            }
+            labels_ct[b] = encrypt_rows({labels_batch}, session)[0];
+        }
+        cout << "Done" << endl;
+
+        // Encode and encrypt replicated weights
+        Ciphertext weights_ct = encrypt_rows({get_packed_weights(weights, width, slot_count)}, session)[0];
+
+        cout << "\nTraining--------------\n"
+             << endl;
+        // The weights are refreshed by the client (here in the same process) in the packed layout
+        RefreshClient client(session, cols, [width, slot_count](const vector<double> &values) { return get_packed_weights(values, width, slot_count); });
+        LocalRefreshTransport transport(client);
+        // The units of the mini-batches are the packed batches
+        SGDSchedule schedule(num_batches, batch_size, config.learning_rate, config.sgd);
+        auto on_iteration = [&](int iteration) { return on_refresh(iteration, client, schedule, standard_features); };
+        Ciphertext new_weights;
+        if (config.shards == 1)
+        {
+            // The last batch may be partly filled
+            auto batch_gradient = [&](const Ciphertext &current_weights, const vector<int> &selection, float learning_rate) {
+                int observations = 0;
+                for (int b : selection)
+                {
+                    observations += min(batch_size, rows - b * batch_size);
+                }
+                return gradient_cipher_packed(features_diagonals_ct, features_T_diagonals_ct, labels_ct, selection, current_weights, observations, learning_rate, session, options);
+            };
+            cout << schedule.steps_per_epoch() << " steps per epoch" << endl;
+            new_weights = train_cipher_sgd(weights_ct, config.iters, schedule, batch_gradient, session, transport, options, on_iteration);
+        }
+        else
+        {
+            // Every shard gets a contiguous range of batches, its gradient is scaled by the observations of all shards
+            vector<pair<int, int>> ranges = get_shard_ranges(num_batches, config.shards);
+            vector<vector<vector<Ciphertext>>> shard_diagonals(config.shards);
+            vector<vector<vector<Ciphertext>>> shard_T_diagonals(config.shards);
+            vector<vector<Ciphertext>> shard_labels(config.shards);
+            LoopbackShards shards;
+            for (int s = 0; s < config.shards; s++)
+            {
+                int begin = ranges[s].first;
+                int end = ranges[s].second;
+                shard_diagonals[s].assign(make_move_iterator(features_diagonals_ct.begin() + begin), make_move_iterator(features_diagonals_ct.begin() + end));
+                shard_T_diagonals[s].assign(make_move_iterator(features_T_diagonals_ct.begin() + begin), make_move_iterator(features_T_diagonals_ct.begin() + end));
+                shard_labels[s].assign(labels_ct.begin() + begin, labels_ct.begin() + end);
+                shards.add(make_packed_shard(shard_diagonals[s], shard_T_diagonals[s], shard_labels[s], config.learning_rate, rows, session, options), session);
+            }
+            cout << config.shards << " shards of about " << num_batches / config.shards << " batches" << endl;
+
+            ShardCoordinator coordinator(shards.shards, session);
+            new_weights = train_sharded(weights_ct, config.iters, coordinator, session, transport, options, on_iteration);
+            shards.print_traffic();
+        }
+
+        if (trace)
+        {
+            EvaluatorTrace::report();
+        }
+        return 0;
     }
-    cout << "Done" << endl;
 
-    // Encode weights
-    Plaintext weights_pt;
-    cout << "\nENCODING WEIGHTS...";
-    ckks_encoder.encode(weights, scale, weights_pt);
-    cout << "Done" << endl;
+    int observations = features.rows();
+    int num_weights = features.cols();
 
-    // Encode labels
-    Plaintext labels_pt;
-    cout << "\nENCODING LABELS...";
-    ckks_encoder.encode(labels, scale, labels_pt);
-    cout << "Done" << endl;
+    // Every group holds a contiguous range of rows, the transpose of its rows and its labels
+    // The groups are the shards of a sharded run and the units of the mini-batches otherwise (a single group for full batches)
+    int num_groups = config.shards > 1 ? config.shards : (config.sgd.batch_size > 0 ? max(1, observations / config.sgd.batch_size) : 1);
+    vector<pair<int, int>> ranges = get_shard_ranges(observations, num_groups);
 
-    // -------------- ENCRYPTING ----------------
-    //Encrypt features
-    vector<Ciphertext> features_ct(features.size());
-    cout << "\nENCRYPTING FEATURES ...";
-    for (int i = 0; i < features.size(); i++)
+    // -------------- ENCODING AND ENCRYPTING ----------------
+    // Each plaintext is dropped as soon as it has been encrypted
+    cout << "\nENCODING AND ENCRYPTING FEATURES ...";
+    vector<Ciphertext> features_ct = encrypt_rows(features, session, options.num_threads);
+    vector<vector<Ciphertext>> shard_features(num_groups);
+    for (int s = 0; s < num_groups; s++)
     {
-        encryptor.encrypt(features_pt[i], features_ct[i]);
+        shard_features[s].assign(make_move_iterator(features_ct.begin() + ranges[s].first), make_move_iterator(features_ct.begin() + ranges[s].second));
     }
     cout << "Done" << endl;
 
-    vector<Ciphertext> features_T_ct(features_T.size());
-    cout << "\nENCRYPTING TRANSPOSED FEATURES ...";
-    for (int i = 0; i < features_T.size(); i++)
+    // Get tranpose from client
+    cout << "\nENCODING AND ENCRYPTING TRANSPOSED FEATURES ...";
+    vector<vector<Ciphertext>> shard_features_T(num_groups);
+    for (int s = 0; s < num_groups; s++)
     {
-        encryptor.encrypt(features_T_pt[i], features_T_ct[i]);
+        int begin = ranges[s].first;
+        int end = ranges[s].second;
+        Matrix<double> shard_rows(end - begin, num_weights, vector<double>(features.row_data(begin), features.row_data(begin) + (size_t)(end - begin) * num_weights));
+        shard_features_T[s] = encrypt_rows(transpose_matrix(shard_rows), session, options.num_threads);
     }
     cout << "Done" << endl;
 
-    // Encrypt weights
-    Ciphertext weights_ct;
-    cout << "\nENCRYPTING WEIGHTS...";
-    encryptor.encrypt(weights_pt, weights_ct);
+    // Encode and encrypt weights
+    cout << "\nENCODING AND ENCRYPTING WEIGHTS...";
+    Ciphertext weights_ct = encrypt_rows({weights}, session)[0];
     cout << "Done" << endl;
 
-    // Encrypt labels
-    Ciphertext labels_ct;
-    cout << "\nENCRYPTING LABELS...";
-    encryptor.encrypt(labels_pt, labels_ct);
+    // Encode and encrypt labels
+    cout << "\nENCODING AND ENCRYPTING LABELS...";
+    vector<Ciphertext> shard_labels(num_groups);
+    for (int s = 0; s < num_groups; s++)
+    {
+        shard_labels[s] = encrypt_rows({vector<double>(labels.begin() + ranges[s].first, labels.begin() + ranges[s].second)}, session)[0];
+    }
     cout << "Done" << endl;
 
     // --------------- TRAIN ---------------
     cout << "\nTraining--------------\n"
          << endl;
 
-    int observations = features.size();
-    int num_weights = features[0].size();
+    // Only generate Galois keys for the steps used by the dot products and the packing of their results (for the size of every shard)
+    vector<int> gal_steps = get_dot_product_steps(num_weights);
+    for (auto &range : ranges)
+    {
+        int shard_rows = range.second - range.first;
+        for (const vector<int> &steps : {get_dot_product_steps(shard_rows), get_pack_slots_steps(shard_rows, get_dot_product_width(num_weights)), get_pack_slots_steps(num_weights, get_dot_product_width(shard_rows))})
+        {
+            gal_steps.insert(gal_steps.end(), steps.begin(), steps.end());
+        }
+    }
+    session.create_galois_keys(gal_steps);
 
     Ciphertext predictions;
-    // predictions = predict_cipher_weights(features_ct, weights_ct, num_weights, scale, evaluator, ckks_encoder, gal_keys, relin_keys, encryptor, params);
+    // predictions = predict_cipher_weights(features_ct, weights_ct, num_weights, session);
+
+    RefreshClient client(session, num_weights);
+    LocalRefreshTransport transport(client);
+    SGDSchedule schedule(num_groups, observations / num_groups, config.learning_rate, config.sgd);
+    auto on_iteration = [&](int iteration) { return on_refresh(iteration, client, schedule, features); };
+    Ciphertext new_weights;
+    if (config.shards == 1)
+    {
+        auto batch_gradient = [&](const Ciphertext &current_weights, const vector<int> &selection, float learning_rate) {
+            return gradient_cipher_groups(shard_features, shard_features_T, shard_labels, selection, current_weights, learning_rate, session, options);
+        };
+        cout << num_groups << " row groups, " << schedule.steps_per_epoch() << " steps per epoch" << endl;
+        new_weights = train_cipher_sgd(weights_ct, config.iters, schedule, batch_gradient, session, transport, options, on_iteration);
+    }
+    else
+    {
+        LoopbackShards shards;
+        for (int s = 0; s < num_groups; s++)
+        {
+            shards.add(make_shard(shard_features[s], shard_features_T[s], shard_labels[s], config.learning_rate, observations, session, options), session);
+        }
 
-    Ciphertext new_weights = train_cipher(features_ct, features_T_ct, labels_ct, weights_ct, LEARNING_RATE, ITERS, observations, num_weights, evaluator, ckks_encoder, scale, gal_keys, relin_keys, encryptor, decryptor, params);
+        ShardCoordinator coordinator(shards.shards, session);
+        new_weights = train_sharded(weights_ct, config.iters, coordinator, session, transport, options, on_iteration);
+        shards.print_traffic();
+    }
 
+    if (trace)
+    {
+        EvaluatorTrace::report();
+    }
     return 0;
 }
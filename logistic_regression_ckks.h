@@ -0,0 +1,536 @@
+#pragma once
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include "seal/seal.h"
+#include "helper.h"
+#include "refresh.h"
+#include "sgd.h"
+
+using namespace std;
+using namespace seal;
+
+// Runtime options of the encrypted training and prediction
+struct LROptions
+{
+    // Degree of the sigmoid approximation (3, 5 or 7)
+    int degree = 3;
+    // Worker threads for the dot products (0 = all hardware threads)
+    int num_threads = 0;
+    // Compute the next gradient while the client refreshes the weights (delayed gradient descent, see train_with_refresh)
+    bool pipelined = false;
+};
+
+template <typename T>
+vector<T> rotate_vec(const vector<T> &input_vec, int num_rotations)
+{
+    if (num_rotations > input_vec.size())
+    {
+        cerr << "Invalid number of rotations" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    vector<T> rotated_res(input_vec.size());
+    for (int i = 0; i < input_vec.size(); i++)
+    {
+        rotated_res[i] = input_vec[(i + num_rotations) % (input_vec.size())];
+    }
+
+    return rotated_res;
+}
+
+void print_Ciphertext_Info(const string &ctx_name, const Ciphertext &ctx, const SEALContext &context)
+{
+    cout << "/" << endl;
+    cout << "| " << ctx_name << " Info:" << endl;
+    cout << "|\tLevel:\t" << context.get_context_data(ctx.parms_id())->chain_index() << endl;
+    cout << "|\tScale:\t" << log2(ctx.scale()) << endl;
+    ios old_fmt(nullptr);
+    old_fmt.copyfmt(cout);
+    cout << fixed << setprecision(10);
+    cout << "|\tExact Scale:\t" << ctx.scale() << endl;
+    cout.copyfmt(old_fmt);
+    cout << "|\tSize:\t" << ctx.size() << endl;
+    cout << "\\" << endl;
+}
+
+// Sigmoid
+float sigmoid(float z)
+{
+    return 1 / (1 + exp(-z));
+}
+
+// Coefficients of the sigmoid polynomial approximation for a given degree
+// The even coefficients are zero so evaluate_polynomial only evaluates the odd part
+vector<double> get_sigmoid_coeffs(int degree)
+{
+    vector<double> coeffs;
+    if (degree == 3)
+    {
+        coeffs = {0.5, 1.20069, 0, -0.81562};
+    }
+    else if (degree == 5)
+    {
+        coeffs = {0.5, 1.53048, 0, -2.3533056, 0, 1.3511295};
+    }
+    else if (degree == 7)
+    {
+        coeffs = {0.5, 1.73496, 0, -4.19407, 0, 5.43402, 0, -2.50739};
+    }
+    else
+    {
+        cerr << "Invalid sigmoid degree: " << degree << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    return coeffs;
+}
+
+// Predict Ciphertext Weights
+Ciphertext predict_cipher_weights(const vector<Ciphertext> &features, const Ciphertext &weights, int num_weights, FHESession &session, const LROptions &options = LROptions())
+{
+    TraceScope trace_scope(__func__);
+
+    TracedEvaluator &evaluator = session.evaluator;
+    GaloisKeys &gal_keys = session.gal_keys;
+    RelinKeys &relin_keys = session.relin_keys;
+
+    // Linear Transformation (loop over rows and dot product)
+    int num_rows = features.size();
+    vector<Ciphertext> results(num_rows);
+
+    // Rows are independent, results[i] is only written by row i
+    parallel_for(num_rows, options.num_threads, [&](int i) {
+        // Dot Product
+        results[i] = cipher_dot_product(features[i], weights, num_weights, relin_keys, gal_keys, evaluator);
+    });
+
+    // Pack the dot products into slot i of one ciphertext (in row order, rescaled)
+    Ciphertext lintransf_vec = pack_slots(results, get_dot_product_width(num_weights), session, 1, options.num_threads);
+    // Sigmoid over result
+    vector<double> coeffs = get_sigmoid_coeffs(options.degree);
+
+    Ciphertext predict_res = evaluate_polynomial(lintransf_vec, coeffs, session);
+    return predict_res;
+}
+
+// Gradient of these observations scaled by learning_rate / total_observations
+// With the observations split into shards (see sharding.h) total_observations counts every shard, so the partial gradients add up to the full one
+Ciphertext local_gradient_cipher(const vector<Ciphertext> &features, const vector<Ciphertext> &features_T, const Ciphertext &labels, const Ciphertext &weights, float learning_rate, int total_observations, FHESession &session, const LROptions &options = LROptions())
+{
+    TraceScope trace_scope(__func__);
+
+    TracedEvaluator &evaluator = session.evaluator;
+    GaloisKeys &gal_keys = session.gal_keys;
+    RelinKeys &relin_keys = session.relin_keys;
+
+    int num_observations = features.size();
+    int num_weights = features_T.size();
+
+    // Get predictions
+    Ciphertext predictions = predict_cipher_weights(features, weights, num_weights, session, options);
+
+    // Calculate Predictions - Labels
+    Ciphertext pred_labels = predictions;
+    sub_aligned_inplace(pred_labels, labels, session);
+
+    // Multiply by learning_rate/observations
+    // It is folded into the packing masks below, which saves the level of a separate multiplication
+    double N = learning_rate / total_observations;
+
+    // Calculate Gradient vector (loop over rows and dot product)
+
+    vector<Ciphertext> gradient_results(num_weights);
+    parallel_for(num_weights, options.num_threads, [&](int i) {
+        gradient_results[i] = cipher_dot_product(at_level_of(features_T[i], pred_labels, session), pred_labels, num_observations, relin_keys, gal_keys, evaluator);
+    });
+
+    // Pack N * gradient_results[i] into slot i of the gradient (rescaled)
+    return pack_slots(gradient_results, get_dot_product_width(num_observations), session, N, options.num_threads);
+}
+
+// Gradient scaled by learning_rate / observations, one gradient descent step is weights - gradient
+Ciphertext gradient_cipher(const vector<Ciphertext> &features, const vector<Ciphertext> &features_T, const Ciphertext &labels, const Ciphertext &weights, float learning_rate, FHESession &session, const LROptions &options = LROptions())
+{
+    return local_gradient_cipher(features, features_T, labels, weights, learning_rate, features.size(), session, options);
+}
+
+// Applies a gradient (or the sum of the partial gradients of every shard): weights - gradient, at the level of the gradient
+Ciphertext apply_gradient(const Ciphertext &weights, const Ciphertext &gradient, FHESession &session)
+{
+    Ciphertext new_weights = weights;
+    sub_aligned_inplace(new_weights, gradient, session);
+
+    return new_weights;
+}
+
+// Update Weights (or Gradient Descent)
+Ciphertext update_weights(const vector<Ciphertext> &features, const vector<Ciphertext> &features_T, const Ciphertext &labels, const Ciphertext &weights, float learning_rate, FHESession &session, const LROptions &options = LROptions())
+{
+    TraceScope trace_scope(__func__);
+
+    return apply_gradient(weights, gradient_cipher(features, features_T, labels, weights, learning_rate, session, options), session);
+}
+
+// Train model function
+// The weights are refreshed by the client behind transport after every step, with options.pipelined the next gradient is computed meanwhile (see train_with_refresh)
+Ciphertext train_cipher(const vector<Ciphertext> &features, const vector<Ciphertext> &features_T, const Ciphertext &labels, const Ciphertext &weights, float learning_rate, int iters, FHESession &session, RefreshTransport &transport, const LROptions &options = LROptions(), function<bool(int)> on_iteration = nullptr)
+{
+    TraceScope trace_scope(__func__);
+
+    auto gradient = [&](const Ciphertext &current_weights, int) {
+        return gradient_cipher(features, features_T, labels, current_weights, learning_rate, session, options);
+    };
+
+    return train_with_refresh(weights, iters, gradient, transport, session, options.pipelined, on_iteration);
+}
+
+// Gradient of the row groups in selection scaled by learning_rate / (observations of these groups)
+// Every group holds its rows, the transpose of its rows and its labels (like the shards of sharding.h), the mini-batches of the unpacked layout
+Ciphertext gradient_cipher_groups(const vector<vector<Ciphertext>> &features, const vector<vector<Ciphertext>> &features_T, const vector<Ciphertext> &labels, const vector<int> &selection, const Ciphertext &weights, float learning_rate, FHESession &session, const LROptions &options = LROptions())
+{
+    TraceScope trace_scope(__func__);
+
+    int observations = 0;
+    for (int g : selection)
+    {
+        observations += features[g].size();
+    }
+
+    Ciphertext gradient = local_gradient_cipher(features[selection[0]], features_T[selection[0]], labels[selection[0]], weights, learning_rate, observations, session, options);
+    for (int k = 1; k < selection.size(); k++)
+    {
+        int g = selection[k];
+        add_aligned_inplace(gradient, local_gradient_cipher(features[g], features_T[g], labels[g], weights, learning_rate, observations, session, options), session);
+    }
+
+    return gradient;
+}
+
+// ----------------------------- PACKED LAYOUT -----------------------------
+// Instead of one ciphertext per observation, a batch of observations is stored as generalized diagonals:
+// diagonal l holds X[i][(i + l) % width] in slot i, so X.w = sum_l diagonal_l * rot(w, l) when w is
+// replicated with period width in every slot. The transposed diagonals hold X[s - l][s % width] in slot s
+// so that sum_l diagonal_T_l * rot(r, -l) leaves X^T.r spread over the slots s with s % width = j
+
+// Number of slots per observation in the packed layout (number of features rounded up to a power of two)
+int get_packed_width(int num_features)
+{
+    int width = 1;
+    while (width < num_features)
+    {
+        width *= 2;
+    }
+
+    return width;
+}
+
+// Number of observations per ciphertext in the packed layout
+// The gradient fold needs two copies of the first batch_size + width slots
+int get_packed_batch_size(int slot_count, int width)
+{
+    return slot_count / 2 - width;
+}
+
+// Number of slots the gradient fold sums over (width times the number of strides covering batch_size + width - 1 slots, rounded up to a power of two)
+int get_packed_window(int slot_count, int width)
+{
+    int batch_size = get_packed_batch_size(slot_count, width);
+    return width * get_packed_width((batch_size + 2 * width - 2) / width);
+}
+
+// Rotation steps used by the packed training functions
+vector<int> get_packed_steps(int slot_count, int width)
+{
+    int window = get_packed_window(slot_count, width);
+
+    // Rotations of the weights by 0 ... width - 1 and of the residuals by 0 ... -(width - 1)
+    vector<int> weight_rots(width);
+    vector<int> residual_rots(width);
+    for (int l = 0; l < width; l++)
+    {
+        weight_rots[l] = l;
+        residual_rots[l] = -l;
+    }
+    vector<int> steps = get_rotation_plan_steps(weight_rots);
+    vector<int> residual_steps = get_rotation_plan_steps(residual_rots);
+    steps.insert(steps.end(), residual_steps.begin(), residual_steps.end());
+
+    // Gradient fold
+    steps.push_back(-window);
+    for (int step = width; step < window; step *= 2)
+    {
+        steps.push_back(step);
+    }
+
+    return steps;
+}
+
+// Generalized diagonals of the rows [start, start + batch_size) of the features matrix
+Matrix<double> get_packed_diagonals(const Matrix<double> &features, int start, int batch_size, int width)
+{
+    int num_features = features.cols();
+    Matrix<double> diagonals(width, batch_size);
+
+    for (int l = 0; l < width; l++)
+    {
+        for (int i = 0; i < batch_size && start + i < features.rows(); i++)
+        {
+            int col = (i + l) % width;
+            if (col < num_features)
+            {
+                diagonals(l, i) = features(start + i, col);
+            }
+        }
+    }
+
+    return diagonals;
+}
+
+// Transposed generalized diagonals of the rows [start, start + batch_size) of the features matrix
+Matrix<double> get_packed_T_diagonals(const Matrix<double> &features, int start, int batch_size, int width)
+{
+    int num_features = features.cols();
+    Matrix<double> diagonals(width, batch_size + width);
+
+    for (int l = 0; l < width; l++)
+    {
+        for (int i = 0; i < batch_size && start + i < features.rows(); i++)
+        {
+            int col = (i + l) % width;
+            if (col < num_features)
+            {
+                diagonals(l, i + l) = features(start + i, col);
+            }
+        }
+    }
+
+    return diagonals;
+}
+
+// Weights replicated with period width over all slots
+vector<double> get_packed_weights(const vector<double> &weights, int width, int slot_count)
+{
+    vector<double> packed_weights(slot_count, 0);
+    for (int i = 0; i < slot_count; i++)
+    {
+        int col = i % width;
+        if (col < weights.size())
+        {
+            packed_weights[i] = weights[col];
+        }
+    }
+
+    return packed_weights;
+}
+
+// Predict Ciphertext Weights for a packed batch (sigmoid(X.w) for every observation of the batch)
+Ciphertext predict_cipher_weights_packed(const vector<Ciphertext> &features_diagonals, const Ciphertext &weights, FHESession &session, const LROptions &options = LROptions())
+{
+    TraceScope trace_scope(__func__);
+
+    TracedEvaluator &evaluator = session.evaluator;
+    GaloisKeys &gal_keys = session.gal_keys;
+    RelinKeys &relin_keys = session.relin_keys;
+
+    int width = features_diagonals.size();
+
+    // Linear Transformation with the generalized diagonals
+    vector<int> steps(width);
+    for (int l = 0; l < width; l++)
+    {
+        steps[l] = l;
+    }
+    Ciphertext lintransf_vec;
+    for_each_rotation(weights, steps, gal_keys, evaluator, [&](int l, const Ciphertext &weights_rot) {
+        evaluator.multiply_accumulate(features_diagonals[l], weights_rot, lintransf_vec);
+    });
+
+    // Relin
+    evaluator.relinearize_inplace(lintransf_vec, relin_keys);
+    // Rescale
+    evaluator.rescale_to_next_inplace(lintransf_vec);
+
+    // Sigmoid over result
+    vector<double> coeffs = get_sigmoid_coeffs(options.degree);
+
+    Ciphertext predict_res = evaluate_polynomial(lintransf_vec, coeffs, session);
+    return predict_res;
+}
+
+// Gradient over the packed batches in selection scaled by learning_rate / num_observations, replicated with period width like the weights
+// For a shard of the batches, num_observations is the number of observations of every shard (see sharding.h)
+Ciphertext gradient_cipher_packed(const vector<vector<Ciphertext>> &features_diagonals, const vector<vector<Ciphertext>> &features_T_diagonals, const vector<Ciphertext> &labels, const vector<int> &selection, const Ciphertext &weights, int num_observations, float learning_rate, FHESession &session, const LROptions &options = LROptions())
+{
+    TraceScope trace_scope(__func__);
+
+    TracedEvaluator &evaluator = session.evaluator;
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
+    GaloisKeys &gal_keys = session.gal_keys;
+    RelinKeys &relin_keys = session.relin_keys;
+
+    int width = features_diagonals[0].size();
+
+    vector<int> steps(width);
+    for (int l = 0; l < width; l++)
+    {
+        steps[l] = -l;
+    }
+
+    // Partial gradients of every batch (X^T.(p - y) before folding), accumulated into one ciphertext
+    Ciphertext gradient;
+    for (int b : selection)
+    {
+        // Get predictions
+        Ciphertext predictions = predict_cipher_weights_packed(features_diagonals[b], weights, session, options);
+        TraceScope gradient_scope("batch_gradient");
+
+        // Calculate Predictions - Labels
+        Ciphertext pred_labels = predictions;
+        sub_aligned_inplace(pred_labels, labels[b], session);
+
+        // Transposed Linear Transformation with the generalized diagonals
+        for_each_rotation(pred_labels, steps, gal_keys, evaluator, [&](int l, const Ciphertext &pred_labels_rot) {
+            evaluator.multiply_accumulate(at_level_of(features_T_diagonals[b][l], pred_labels, session), pred_labels_rot, gradient);
+        });
+    }
+
+    // Relin
+    evaluator.relinearize_inplace(gradient, relin_keys);
+    // Rescale
+    evaluator.rescale_to_next_inplace(gradient);
+
+    TraceScope fold_scope("fold");
+    // Fold the slots of the same feature: duplicate then rotate and sum by width, 2 * width, 4 * width, ...
+    // This leaves the gradient replicated with period width like the weights
+    int window = get_packed_window(ckks_encoder.slot_count(), width);
+    Ciphertext gradient_rot;
+    evaluator.rotate_vector(gradient, -window, gal_keys, gradient_rot);
+    evaluator.add_inplace(gradient, gradient_rot);
+    for (int step = width; step < window; step *= 2)
+    {
+        evaluator.rotate_vector(gradient, step, gal_keys, gradient_rot);
+        evaluator.add_inplace(gradient, gradient_rot);
+    }
+
+    // Multiply by learning_rate/observations
+    double N = learning_rate / num_observations;
+    return multiply_const_rescale(gradient, N, session);
+}
+
+// Gradient over all packed batches
+Ciphertext gradient_cipher_packed(const vector<vector<Ciphertext>> &features_diagonals, const vector<vector<Ciphertext>> &features_T_diagonals, const vector<Ciphertext> &labels, const Ciphertext &weights, int num_observations, float learning_rate, FHESession &session, const LROptions &options = LROptions())
+{
+    vector<int> selection(features_diagonals.size());
+    iota(selection.begin(), selection.end(), 0);
+    return gradient_cipher_packed(features_diagonals, features_T_diagonals, labels, selection, weights, num_observations, learning_rate, session, options);
+}
+
+// Update Weights (or Gradient Descent) over all packed batches
+Ciphertext update_weights_packed(const vector<vector<Ciphertext>> &features_diagonals, const vector<vector<Ciphertext>> &features_T_diagonals, const vector<Ciphertext> &labels, const Ciphertext &weights, int num_observations, float learning_rate, FHESession &session, const LROptions &options = LROptions())
+{
+    TraceScope trace_scope(__func__);
+
+    return apply_gradient(weights, gradient_cipher_packed(features_diagonals, features_T_diagonals, labels, weights, num_observations, learning_rate, session, options), session);
+}
+
+// Train model function with packed features
+// The client behind transport has to re-encrypt the weights replicated with the packed layout (RefreshClient with get_packed_weights as relayout)
+Ciphertext train_cipher_packed(const vector<vector<Ciphertext>> &features_diagonals, const vector<vector<Ciphertext>> &features_T_diagonals, const vector<Ciphertext> &labels, const Ciphertext &weights, float learning_rate, int iters, int observations, FHESession &session, RefreshTransport &transport, const LROptions &options = LROptions(), function<bool(int)> on_iteration = nullptr)
+{
+    TraceScope trace_scope(__func__);
+
+    auto gradient = [&](const Ciphertext &current_weights, int) {
+        return gradient_cipher_packed(features_diagonals, features_T_diagonals, labels, current_weights, observations, learning_rate, session, options);
+    };
+
+    return train_with_refresh(weights, iters, gradient, transport, session, options.pipelined, on_iteration);
+}
+
+// ------------------------------ MINI-BATCH SGD ------------------------------
+// Step i uses the units schedule.get_batch(i) (packed batches or row groups) and the learning rate schedule.get_learning_rate(i):
+// batch_gradient(w, units, learning_rate) returns the gradient of these units scaled by learning_rate / (their observations),
+// e.g. gradient_cipher_packed or gradient_cipher_groups with the units as selection.
+// Nothing is evaluated homomorphically for the cost: the client computes it from the weights it refreshes (cost_plain).
+// on_iteration (see train_with_refresh) records it with schedule.record_cost and stops training once it converged
+Ciphertext train_cipher_sgd(const Ciphertext &weights, int iters, const SGDSchedule &schedule, function<Ciphertext(const Ciphertext &, const vector<int> &, float)> batch_gradient, FHESession &session, RefreshTransport &transport, const LROptions &options = LROptions(), function<bool(int)> on_iteration = nullptr)
+{
+    TraceScope trace_scope(__func__);
+
+    auto gradient = [&](const Ciphertext &current_weights, int step) {
+        return batch_gradient(current_weights, schedule.get_batch(step), schedule.get_learning_rate(step));
+    };
+    auto same_gradient = [&](int step) {
+        return schedule.same_gradient(step, step - 1);
+    };
+
+    return train_with_refresh(weights, iters, gradient, transport, session, options.pipelined, on_iteration, same_gradient);
+}
+
+// Log loss of plaintext weights (the values a RefreshClient decoded) over every observation, with the exact sigmoid
+double cost_plain(const Matrix<double> &features, const vector<double> &labels, const vector<double> &weights)
+{
+    double cost_sum = 0;
+    for (int i = 0; i < features.rows(); i++)
+    {
+        const double *row = features.row_data(i);
+        double z = 0;
+        for (int j = 0; j < features.cols(); j++)
+        {
+            z += row[j] * weights[j];
+        }
+
+        // Clamped so that a saturated prediction doesn't give an infinite cost
+        double prediction = min(max(1 / (1 + exp(-z)), 1e-7), 1 - 1e-7);
+        cost_sum -= labels[i] * log(prediction) + (1 - labels[i]) * log(1 - prediction);
+    }
+
+    return cost_sum / features.rows();
+}
+
+// Sigmoid approximation without encryption
+double sigmoid_approx(double x, int degree)
+{
+    double res;
+    if (degree == 3)
+    {
+        res = 0.5 + (1.20096 * (x / 8)) - (0.81562 * (pow((x / 8), 3)));
+    }
+    else if (degree == 5)
+    {
+        res = 0.5 + (1.53048 * (x / 8)) - (2.3533056 * (pow((x / 8), 3))) + (1.3511295 * (pow((x / 8), 5)));
+    }
+    else if (degree == 7)
+    {
+        res = 0.5 + (1.73496 * (x / 8)) - (4.19407 * (pow((x / 8), 3))) + (5.43402 * (pow((x / 8), 5))) - (2.50739 * (pow((x / 8), 3)));
+    }
+    else
+    {
+        cerr << "Invalid sigmoid degree: " << degree << endl;
+        exit(EXIT_SUCCESS);
+    }
+    return res;
+}
+
+// ------------------------------ PARAMETERS --------------------------------
+
+// Levels one training step consumes before the weights are refreshed
+// Unpacked: dot products and packing of the predictions, the sigmoid, dot products and packing (with the learning rate) of the gradient.
+// Packed: the diagonal product, the sigmoid, the transposed diagonal product and the learning rate
+int get_lr_depth(int degree, bool packed)
+{
+    return (packed ? 3 : 4) + get_polynomial_depth(degree);
+}
+
+// Slots a step needs for num_observations x num_features data
+// Unpacked, a row (or a column of the transpose) is padded to a power of two and duplicated for the rotations.
+// Packed, a batch has to hold at least width observations, beyond that the slots only decide the number of batches
+size_t get_lr_min_slots(int num_observations, int num_features, bool packed)
+{
+    if (packed)
+    {
+        return 4 * get_packed_width(num_features);
+    }
+    return 2 * get_dot_product_width(max(num_observations, num_features));
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+using namespace std;
+
+// Strided view of a matrix, element (i, j) is data[i * row_stride + j * col_stride]
+// Views don't own their data, transposed() only swaps the strides
+template <typename T>
+struct MatrixView
+{
+    T *data = nullptr;
+    int rows = 0;
+    int cols = 0;
+    size_t row_stride = 0;
+    size_t col_stride = 1;
+
+    T &operator()(int i, int j) const
+    {
+        return data[i * row_stride + j * col_stride];
+    }
+
+    MatrixView<T> transposed() const
+    {
+        return MatrixView<T>{data, cols, rows, col_stride, row_stride};
+    }
+
+    // Copy of row i
+    vector<remove_const_t<T>> row(int i) const
+    {
+        vector<remove_const_t<T>> result(cols);
+        for (int j = 0; j < cols; j++)
+        {
+            result[j] = (*this)(i, j);
+        }
+        return result;
+    }
+};
+
+// Dense matrix stored row-major in a single buffer
+// Replaces vector<vector<T>> so that a rows x cols matrix is one allocation and rows are contiguous
+template <typename T>
+class Matrix
+{
+public:
+    Matrix()
+    {
+    }
+
+    Matrix(int rows, int cols, T value = T()) : num_rows(rows), num_cols(cols), values((size_t)rows * cols, value)
+    {
+    }
+
+    // Takes over a row-major buffer of rows * cols values
+    Matrix(int rows, int cols, vector<T> &&row_major_values) : num_rows(rows), num_cols(cols), values(move(row_major_values))
+    {
+        if (values.size() != (size_t)rows * cols)
+        {
+            cerr << "Matrix buffer has " << values.size() << " values, expected " << (size_t)rows * cols << endl;
+            exit(1);
+        }
+    }
+
+    // Copies a vector of rows, every row must have the size of the first one
+    explicit Matrix(const vector<vector<T>> &matrix_rows) : Matrix(matrix_rows.size(), matrix_rows.empty() ? 0 : matrix_rows[0].size())
+    {
+        for (int i = 0; i < num_rows; i++)
+        {
+            if ((int)matrix_rows[i].size() != num_cols)
+            {
+                cerr << "Matrix row " << i << " has " << matrix_rows[i].size() << " columns, expected " << num_cols << endl;
+                exit(1);
+            }
+            copy(matrix_rows[i].begin(), matrix_rows[i].end(), row_data(i));
+        }
+    }
+
+    int rows() const
+    {
+        return num_rows;
+    }
+
+    int cols() const
+    {
+        return num_cols;
+    }
+
+    T &operator()(int i, int j)
+    {
+        return values[(size_t)i * num_cols + j];
+    }
+
+    const T &operator()(int i, int j) const
+    {
+        return values[(size_t)i * num_cols + j];
+    }
+
+    T *data()
+    {
+        return values.data();
+    }
+
+    const T *data() const
+    {
+        return values.data();
+    }
+
+    T *row_data(int i)
+    {
+        return values.data() + (size_t)i * num_cols;
+    }
+
+    const T *row_data(int i) const
+    {
+        return values.data() + (size_t)i * num_cols;
+    }
+
+    // Copy of row i (for APIs such as CKKSEncoder::encode that take a vector)
+    vector<T> row(int i) const
+    {
+        return vector<T>(row_data(i), row_data(i) + num_cols);
+    }
+
+    vector<vector<T>> to_rows() const
+    {
+        vector<vector<T>> result(num_rows);
+        for (int i = 0; i < num_rows; i++)
+        {
+            result[i] = row(i);
+        }
+        return result;
+    }
+
+    MatrixView<T> view()
+    {
+        return MatrixView<T>{values.data(), num_rows, num_cols, (size_t)num_cols, 1};
+    }
+
+    MatrixView<const T> view() const
+    {
+        return MatrixView<const T>{values.data(), num_rows, num_cols, (size_t)num_cols, 1};
+    }
+
+    // Transposed view without copying, use transpose_matrix for a contiguous transposed copy
+    MatrixView<const T> transposed() const
+    {
+        return view().transposed();
+    }
+
+private:
+    int num_rows = 0;
+    int num_cols = 0;
+    vector<T> values;
+};
@@ -9,68 +9,7 @@
 using namespace std;
 using namespace seal;
 
-
-Ciphertext CC_Matrix_Multiplication(Ciphertext ctA, Ciphertext ctB, int dimension, vector<Plaintext> U_sigma_diagonals, vector<Plaintext> U_tau_diagonals, vector<vector<Plaintext>> V_diagonals, vector<vector<Plaintext>> W_diagonals, GaloisKeys gal_keys, EncryptionParameters params)
-{
-
-    auto context = SEALContext::Create(params);
-    Evaluator evaluator(context);
-
-    vector<Ciphertext> ctA_result(dimension);
-    vector<Ciphertext> ctB_result(dimension);
-
-    cout << "----------Step 1----------- " << endl;
-    // Step 1-1
-    ctA_result[0] = Linear_Transform_Plain(ctA, U_sigma_diagonals, gal_keys, params);
-
-    // Step 1-2
-    ctB_result[0] = Linear_Transform_Plain(ctB, U_tau_diagonals, gal_keys, params);
-
-    // Step 2
-    cout << "----------Step 2----------- " << endl;
-
-    for (int k = 1; k < dimension; k++)
-    {
-        cout << "Linear Transf at k = " << k;
-        ctA_result[k] = Linear_Transform_Plain(ctA_result[0], V_diagonals[k - 1], gal_keys, params);
-        ctB_result[k] = Linear_Transform_Plain(ctB_result[0], W_diagonals[k - 1], gal_keys, params);
-        cout << "..... Done" << endl;
-    }
-
-    // Step 3
-    cout << "----------Step 3----------- " << endl;
-
-    // Test Rescale
-    cout << "RESCALE--------" << endl;
-    for (int i = 1; i < dimension; i++)
-    {
-        evaluator.rescale_to_next_inplace(ctA_result[i]);
-        evaluator.rescale_to_next_inplace(ctB_result[i]);
-    }
-
-    Ciphertext ctAB;
-    evaluator.multiply(ctA_result[0], ctB_result[0], ctAB);
-    evaluator.mod_switch_to_next_inplace(ctAB);
-
-    // Manual scale set
-    for (int i = 1; i < dimension; i++)
-    {
-        ctA_result[i].scale() = pow(2, (int)log2(ctA_result[i].scale()));
-        ctB_result[i].scale() = pow(2, (int)log2(ctB_result[i].scale()));
-    }
-
-    for (int k = 1; k < dimension; k++)
-    {
-        cout << "Iteration k = " << k << endl;
-        Ciphertext temp_mul;
-        evaluator.multiply(ctA_result[k], ctB_result[k], temp_mul);
-        evaluator.add_inplace(ctAB, temp_mul);
-    }
-
-    return ctAB;
-}
-
-vector<vector<double>> test_matrix_mult(vector<vector<double>> mat_A, vector<vector<double>> mat_B, int dimension)
+vector<vector<double>> test_matrix_mult(const vector<vector<double>> &mat_A, const vector<vector<double>> &mat_B, int dimension)
 {
     vector<vector<double>> mat_res(dimension, vector<double>(dimension));
     for (int i = 0; i < dimension; i++)
@@ -87,7 +26,7 @@ vector<vector<double>> test_matrix_mult(vector<vector<double>> mat_A, vector<vec
     return mat_res;
 }
 
-void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
+void Matrix_Multiplication(size_t poly_modulus_degree, int dimension, DiagonalCache &diagonal_cache)
 {
 
     // Handle Rotation Error First
@@ -97,24 +36,22 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
         exit(1);
     }
 
-    EncryptionParameters params(scheme_type::CKKS);
+    EncryptionParameters params(scheme_type::ckks);
     params.set_poly_modulus_degree(poly_modulus_degree);
     cout << "MAX BIT COUNT: " << CoeffModulus::MaxBitCount(poly_modulus_degree) << endl;
     params.set_coeff_modulus(CoeffModulus::Create(poly_modulus_degree, {60, 40, 40, 40, 40, 60}));
-    auto context = SEALContext::Create(params);
 
-    // Generate keys, encryptor, decryptor and evaluator
-    KeyGenerator keygen(context);
-    PublicKey pk = keygen.public_key();
-    SecretKey sk = keygen.secret_key();
-    GaloisKeys gal_keys = keygen.galois_keys();
+    // Create context, keys, encryptor, decryptor, evaluator and encoder once
+    // Galois keys are generated once the non-zero diagonals are known
+    FHESession session(params, pow(2.0, 40), KeyCache::dir_from_env());
+    GaloisKeys &gal_keys = session.gal_keys;
 
-    Encryptor encryptor(context, pk);
-    Evaluator evaluator(context);
-    Decryptor decryptor(context, sk);
+    Encryptor &encryptor = session.encryptor;
+    TracedEvaluator &evaluator = session.evaluator;
+    Decryptor &decryptor = session.decryptor;
 
     // Create CKKS encoder
-    CKKSEncoder ckks_encoder(context);
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
 
     // Create Scale
     double scale = pow(2.0, 40);
@@ -176,137 +113,21 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
 
     int dimensionSq = pow(dimension, 2);
 
-    // Get U_sigma for first matrix
-    vector<vector<double>> U_sigma = get_U_sigma(pod_matrix1_set1);
-    cout << "\nU_sigma:" << endl;
-    print_full_matrix(U_sigma, 0);
-
-    // Get U_tau for second matrix
-    vector<vector<double>> U_tau = get_U_tau(pod_matrix1_set1);
-    cout << "\nU_tau:" << endl;
-    print_full_matrix(U_tau, 0);
-
-    // Get V_k (3D matrix)
-    vector<vector<vector<double>>> V_k(dimension - 1, vector<vector<double>>(dimensionSq, vector<double>(dimensionSq)));
-
-    for (int i = 1; i < dimension; i++)
-    {
-        V_k[i - 1] = get_V_k(pod_matrix1_set1, i);
-        cout << "\nV_" << to_string(i) << ":" << endl;
-        print_full_matrix(V_k[i - 1], 0);
-    }
-
-    // Get W_k (3D matrix)
-    vector<vector<vector<double>>> W_k(dimension - 1, vector<vector<double>>(dimensionSq, vector<double>(dimensionSq)));
-
-    for (int i = 1; i < dimension; i++)
-    {
-        W_k[i - 1] = get_W_k(pod_matrix1_set1, i);
-        cout << "\nW_" << to_string(i) << ":" << endl;
-        print_full_matrix(W_k[i - 1], 0);
-    }
-
-    // Get Diagonals for U_sigma
-    vector<vector<double>> U_sigma_diagonals = get_all_diagonals(U_sigma);
-    cout << "U_sigma Diagonal Matrix:" << endl;
-    print_full_matrix(U_sigma_diagonals, 0);
-
-    // Test ADD EPSILON
-    double epsilon = 0.00000001;
-    for (int i = 0; i < dimensionSq; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            U_sigma_diagonals[i][j] += epsilon;
-        }
-    }
-
-    // Get Diagonals for U_tau
-    vector<vector<double>> U_tau_diagonals = get_all_diagonals(U_tau);
-
-    // Test ADD EPSILON
-    for (int i = 0; i < dimensionSq; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            U_tau_diagonals[i][j] += epsilon;
-        }
-    }
-
-    // Get Diagonals for V_k
-    vector<vector<vector<double>>> V_k_diagonals(dimension - 1, vector<vector<double>>(dimensionSq, vector<double>(dimensionSq)));
-
-    for (int i = 1; i < dimension; i++)
-    {
-        V_k_diagonals[i - 1] = get_all_diagonals(V_k[i - 1]);
-    }
-
-    // Test ADD EPSILON
-    for (int i = 0; i < dimension - 1; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            for (int k = 0; k < dimensionSq; k++)
-            {
-
-                V_k_diagonals[i][j][k] += epsilon;
-            }
-        }
-    }
-
-    // Get Diagonals for W_k
-    vector<vector<vector<double>>> W_k_diagonals(dimension - 1, vector<vector<double>>(dimensionSq, vector<double>(dimensionSq)));
-
-    for (int i = 1; i < dimension; i++)
-    {
-        W_k_diagonals[i - 1] = get_all_diagonals(W_k[i - 1]);
-    }
-
-    // Test ADD EPSILON
-    for (int i = 0; i < dimension - 1; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            for (int k = 0; k < dimensionSq; k++)
-            {
-
-                W_k_diagonals[i][j][k] += epsilon;
-            }
-        }
-    }
-
     // --------------- ENCODING ----------------
-    // Encode U_sigma diagonals
-    // Encode U_tau diagonals
-    vector<Plaintext> U_sigma_diagonals_plain(dimensionSq);
-    vector<Plaintext> U_tau_diagonals_plain(dimensionSq);
-    vector<vector<Plaintext>> V_k_diagonals_plain(dimension - 1, vector<Plaintext>(dimensionSq));
-    vector<vector<Plaintext>> W_k_diagonals_plain(dimension - 1, vector<Plaintext>(dimensionSq));
     vector<Plaintext> plain_matrix1_set1(dimension);
     vector<Plaintext> plain_matrix2_set1(dimension);
 
-    // cout << "\nEncoding U_sigma_diagonals...Encoding U_tau_diagonals...";
     cout << "\nENCODING...." << endl;
     auto start_encode = chrono::high_resolution_clock::now();
-    for (int i = 0; i < dimensionSq; i++)
-    {
-        ckks_encoder.encode(U_sigma_diagonals[i], scale, U_sigma_diagonals_plain[i]);
-        ckks_encoder.encode(U_tau_diagonals[i], scale, U_tau_diagonals_plain[i]);
-    }
-    // cout << "Done" << endl;
 
-    // Encode V_k diagonals
-    // Encode W_k diagonals
-    // cout << "\nEncoding V_K_diagonals...Encoding W_k_diagonals...";
-    for (int i = 1; i < dimension; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            ckks_encoder.encode(V_k_diagonals[i - 1][j], scale, V_k_diagonals_plain[i - 1][j]);
-            ckks_encoder.encode(W_k_diagonals[i - 1][j], scale, W_k_diagonals_plain[i - 1][j]);
-        }
-    }
-    // cout << "Done" << endl;
+    // Get the encoded U_sigma, U_tau, V_k and W_k diagonals (built on the first run of this dimension, then cached)
+    auto start_diagonals = chrono::high_resolution_clock::now();
+    const MatMulDiagonals &diagonals = diagonal_cache.get(dimension, session);
+    const SparseDiagonals &U_sigma_diagonals_plain = diagonals.U_sigma;
+    auto stop_diagonals = chrono::high_resolution_clock::now();
+    auto duration_diagonals = chrono::duration_cast<chrono::microseconds>(stop_diagonals - start_diagonals);
+    cout << "Diagonal Setup Duration:\t" << duration_diagonals.count() << endl;
+    cout << "Non-zero U_sigma diagonals:\t" << U_sigma_diagonals_plain.indices.size() << " of " << dimensionSq << endl;
 
     // Encode Matrices
     // Encode Matrix 1
@@ -323,6 +144,12 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
     cout << "Encode Duration:\t" << duration_encode.count() << endl;
     outscript << duration_encode.count() << ", ";
 
+    // Only create the Galois keys for matrix encoding and the linear transformations
+    vector<int> gal_steps = get_matmul_steps(diagonals);
+    vector<int> encode_steps = get_matrix_encode_steps(dimension);
+    gal_steps.insert(gal_steps.end(), encode_steps.begin(), encode_steps.end());
+    session.create_galois_keys(gal_steps);
+
     // Encode Matrix 2
     // --------------- ENCRYPTING ----------------
     // Encrypt Matrix 1
@@ -359,12 +186,38 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
     // --------------- MATRIX MULTIPLICATION ----------------
     cout << "\nMatrix Multiplication..." << endl;
     auto start_matrix_mult = chrono::high_resolution_clock::now();
-    Ciphertext ct_result = CC_Matrix_Multiplication(cipher_encoded_matrix1_set1, cipher_encoded_matrix2_set1, dimension, U_sigma_diagonals_plain, U_tau_diagonals_plain, V_k_diagonals_plain, W_k_diagonals_plain, gal_keys, params);
+    Ciphertext ct_result = CC_Matrix_Multiplication(cipher_encoded_matrix1_set1, cipher_encoded_matrix2_set1, dimension, diagonals, session);
     auto stop_matrix_mutl = chrono::high_resolution_clock::now();
     auto duration_matrix_mult = chrono::duration_cast<chrono::microseconds>(stop_matrix_mutl - start_matrix_mult);
     cout << "Matrix Mult Duration:\t" << duration_matrix_mult.count() << endl;
     outscript << duration_matrix_mult.count() << ", ";
 
+    // --------------- PASS BY VALUE COST ----------------
+    // The mat-mul does 2 * dimension linear transformations. Taking their arguments by value copied
+    // the input ciphertext, the diagonals and the Galois keys on every call, measure what that cost
+    cout << "\nPass By Value Cost..." << endl;
+    size_t ct_bytes = cipher_encoded_matrix1_set1.save_size(compr_mode_type::none);
+    size_t gal_keys_bytes = gal_keys.save_size(compr_mode_type::none);
+    size_t diagonals_bytes = 0;
+    for (int i = 0; i < U_sigma_diagonals_plain.diagonals.size(); i++)
+    {
+        diagonals_bytes += U_sigma_diagonals_plain.diagonals[i].save_size(compr_mode_type::none);
+    }
+
+    auto start_copy = chrono::high_resolution_clock::now();
+    for (int k = 0; k < dimension; k++)
+    {
+        Ciphertext ct_copy = cipher_encoded_matrix1_set1;
+        SparseDiagonals diagonals_copy = U_sigma_diagonals_plain;
+        GaloisKeys gal_keys_copy = gal_keys;
+    }
+    auto stop_copy = chrono::high_resolution_clock::now();
+    auto duration_copy = chrono::duration_cast<chrono::microseconds>(stop_copy - start_copy);
+
+    cout << "Copied per call (bytes):\t" << ct_bytes + diagonals_bytes + gal_keys_bytes << endl;
+    cout << "Copied per mat-mul (bytes):\t" << 2 * dimension * (ct_bytes + diagonals_bytes + gal_keys_bytes) << endl;
+    cout << "Copy Duration per mat-mul:\t" << 2 * duration_copy.count() << endl;
+
     // --------------- DECRYPT ----------------
     Plaintext pt_result;
     cout << "\nResult Decrypt...";
@@ -414,7 +267,9 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
 int main()
 {
 
-    Matrix_Multiplication(8192 * 2, 5);
+    // Diagonals are kept in the working directory and reused by later runs
+    DiagonalCache diagonal_cache(".");
+    Matrix_Multiplication(8192 * 2, 5, diagonal_cache);
 
     return 0;
 }
@@ -8,129 +8,6 @@
 using namespace std;
 using namespace seal;
 
-Ciphertext CC_Matrix_Multiplication(Ciphertext ctA, Ciphertext ctB, int dimension, vector<Plaintext> U_sigma_diagonals, vector<Plaintext> U_tau_diagonals, vector<vector<Plaintext>> V_diagonals, vector<vector<Plaintext>> W_diagonals, GaloisKeys gal_keys, EncryptionParameters params)
-{
-
-    auto context = SEALContext::Create(params);
-    Evaluator evaluator(context);
-
-    vector<Ciphertext> ctA_result(dimension);
-    vector<Ciphertext> ctB_result(dimension);
-
-    cout << "----------Step 1----------- " << endl;
-    // Step 1-1
-    ctA_result[0] = Linear_Transform_Plain(ctA, U_sigma_diagonals, gal_keys, params);
-
-    // Step 1-2
-    ctB_result[0] = Linear_Transform_Plain(ctB, U_tau_diagonals, gal_keys, params);
-
-    /*
-    // Test scale
-    cout << "\nSCALE TEST -----------:" << endl;
-    for (int i = 0; i < dimension; i++)
-    {
-        cout << "CTA scale at i = " << i << ":\t" << log2(ctA_result[i].scale()) << endl;
-        cout << "CTB scale at i = " << i << ":\t" << log2(ctB_result[i].scale()) << endl;
-    }
-*/
-    // Step 2
-    cout << "----------Step 2----------- " << endl;
-
-    for (int k = 1; k < dimension; k++)
-    {
-        cout << "Linear Transf at k = " << k;
-        ctA_result[k] = Linear_Transform_Plain(ctA_result[0], V_diagonals[k - 1], gal_keys, params);
-        ctB_result[k] = Linear_Transform_Plain(ctB_result[0], W_diagonals[k - 1], gal_keys, params);
-        cout << "..... Done" << endl;
-    }
-
-    /*
-    // Test scale
-    for (int i = 0; i < dimension; i++)
-    {
-        cout << "CTA scale at i = " << i << ":\t" << log2(ctA_result[i].scale()) << endl;
-        cout << "CTB scale at i = " << i << ":\t" << log2(ctB_result[i].scale()) << endl;
-    }
-    // Test Chain
-    cout << "\nCHAIN TEST -----------:" << endl;
-    for (int i = 0; i < dimension; i++)
-    {
-        cout << "chain index A at i = " << i << ":\t" << context->get_context_data(ctA_result[i].parms_id())->chain_index() << endl;
-        cout << "chain index B at i = " << i << ":\t" << context->get_context_data(ctB_result[i].parms_id())->chain_index() << endl;
-    }
-
-    cout << "context data total coeff modulus bit count = " << context->get_context_data(U_sigma_diagonals[0].parms_id())->total_coeff_modulus_bit_count() << endl;
-*/
-    // Step 3
-    cout << "----------Step 3----------- " << endl;
-
-    // Test Rescale
-    cout << "RESCALE--------" << endl;
-    for (int i = 1; i < dimension; i++)
-    {
-        evaluator.rescale_to_next_inplace(ctA_result[i]);
-        evaluator.rescale_to_next_inplace(ctB_result[i]);
-    }
-
-    /*
-    // Test scale
-    for (int i = 0; i < dimension; i++)
-    {
-        cout << "CTA scale at i = " << i << ":\t" << log2(ctA_result[i].scale()) << endl;
-        cout << "CTB scale at i = " << i << ":\t" << log2(ctB_result[i].scale()) << endl;
-    }
-
-    cout << "Exact scale" << endl;
-    ios old_fmt(nullptr);
-    old_fmt.copyfmt(cout);
-    cout << fixed << setprecision(10);
-    for (int i = 0; i < dimension; i++)
-    {
-        cout << "\t Exact scale in ctA at i = " << i << ":\t" << ctA_result[i].scale() << endl;
-        cout << "\t Exact scale in ctB at i = " << i << ":\t" << ctB_result[i].scale() << endl;
-    }
-    cout << endl;
-    cout.copyfmt(old_fmt);
-
-    // Test Chain
-    cout << "\nCHAIN TEST -----------:" << endl;
-    for (int i = 0; i < dimension; i++)
-    {
-        cout << "chain index A at i = " << i << ":\t" << context->get_context_data(ctA_result[i].parms_id())->chain_index() << endl;
-        cout << "chain index B at i = " << i << ":\t" << context->get_context_data(ctB_result[i].parms_id())->chain_index() << endl;
-    }
-*/
-    Ciphertext ctAB;
-    evaluator.multiply(ctA_result[0], ctB_result[0], ctAB);
-
-    // cout << "TEST" << endl;
-    // cout << "CTAB scale :\t" << log2(ctAB.scale()) << endl;
-    // cout << "CTAB chain index :\t" << context->get_context_data(ctAB.parms_id())->chain_index() << endl;
-
-    // Mod switch CTAB
-    // cout << "MOD SWITCH CTAB:" << endl;
-    evaluator.mod_switch_to_next_inplace(ctAB);
-    // cout << "CTAB chain index :\t" << context->get_context_data(ctAB.parms_id())->chain_index() << endl;
-
-    // Manual scale set
-    cout << "\nMANUAL SCALE:" << endl;
-    for (int i = 1; i < dimension; i++)
-    {
-        ctA_result[i].scale() = pow(2, (int)log2(ctA_result[i].scale()));
-        ctB_result[i].scale() = pow(2, (int)log2(ctB_result[i].scale()));
-    }
-
-    for (int k = 1; k < dimension; k++)
-    {
-        cout << "Iteration k = " << k << endl;
-        Ciphertext temp_mul;
-        evaluator.multiply(ctA_result[k], ctB_result[k], temp_mul);
-        evaluator.add_inplace(ctAB, temp_mul);
-    }
-
-    return ctAB;
-}
-
 void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
 {
 
@@ -141,30 +18,26 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
         exit(1);
     }
 
-    EncryptionParameters params(scheme_type::CKKS);
+    EncryptionParameters params(scheme_type::ckks);
     params.set_poly_modulus_degree(poly_modulus_degree);
     cout << "MAX BIT COUNT: " << CoeffModulus::MaxBitCount(poly_modulus_degree) << endl;
     params.set_coeff_modulus(CoeffModulus::Create(poly_modulus_degree, {60, 40, 40, 40, 40, 60}));
-    auto context = SEALContext::Create(params);
 
-    // Generate keys, encryptor, decryptor and evaluator
-    KeyGenerator keygen(context);
-    PublicKey pk = keygen.public_key();
-    SecretKey sk = keygen.secret_key();
-    GaloisKeys gal_keys = keygen.galois_keys();
+    // Create context, keys, encryptor, decryptor, evaluator and encoder once
+    // Galois keys are generated once the non-zero diagonals are known
+    // HE_KEY_CACHE=<dir> keeps the keys on disk, so later runs load them instead of generating them
+    FHESession session(params, pow(2.0, 40), KeyCache::dir_from_env());
+    GaloisKeys &gal_keys = session.gal_keys;
 
-    Encryptor encryptor(context, pk);
-    Evaluator evaluator(context);
-    Decryptor decryptor(context, sk);
+    Encryptor &encryptor = session.encryptor;
+    TracedEvaluator &evaluator = session.evaluator;
+    Decryptor &decryptor = session.decryptor;
 
     // Create CKKS encoder
-    CKKSEncoder ckks_encoder(context);
-
-    // Create Scale
-    double scale = pow(2.0, 40);
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
 
-    vector<vector<double>> pod_matrix1_set1(dimension, vector<double>(dimension));
-    vector<vector<double>> pod_matrix2_set1(dimension, vector<double>(dimension));
+    Matrix<double> pod_matrix1_set1(dimension, dimension);
+    Matrix<double> pod_matrix2_set1(dimension, dimension);
 
     // Fill input matrices
     // double r = ((double)rand() / (RAND_MAX));
@@ -174,7 +47,7 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
     {
         for (int j = 0; j < dimension; j++)
         {
-            pod_matrix1_set1[i][j] = filler;
+            pod_matrix1_set1(i, j) = filler;
             filler++;
             // r = ((double)rand() / (RAND_MAX));
         }
@@ -189,7 +62,7 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
     {
         for (int j = 0; j < dimension; j++)
         {
-            pod_matrix2_set1[i][j] = filler;
+            pod_matrix2_set1(i, j) = filler;
             // r = ((double)rand() / (RAND_MAX));
             filler++;
         }
@@ -200,185 +73,33 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
 
     int dimensionSq = pow(dimension, 2);
 
-    // Get U_sigma for first matrix
-    vector<vector<double>> U_sigma = get_U_sigma(pod_matrix1_set1);
-    cout << "\nU_sigma:" << endl;
-    print_full_matrix(U_sigma, 0);
-
-    // Get U_tau for second matrix
-    vector<vector<double>> U_tau = get_U_tau(pod_matrix1_set1);
-    cout << "\nU_tau:" << endl;
-    print_full_matrix(U_tau, 0);
-
-    // Get V_k (3D matrix)
-    vector<vector<vector<double>>> V_k(dimension - 1, vector<vector<double>>(dimensionSq, vector<double>(dimensionSq)));
-
-    for (int i = 1; i < dimension; i++)
-    {
-        V_k[i - 1] = get_V_k(pod_matrix1_set1, i);
-        cout << "\nV_" << to_string(i) << ":" << endl;
-        print_full_matrix(V_k[i - 1], 0);
-    }
-
-    // Get W_k (3D matrix)
-    vector<vector<vector<double>>> W_k(dimension - 1, vector<vector<double>>(dimensionSq, vector<double>(dimensionSq)));
-
-    for (int i = 1; i < dimension; i++)
-    {
-        W_k[i - 1] = get_W_k(pod_matrix1_set1, i);
-        cout << "\nW_" << to_string(i) << ":" << endl;
-        print_full_matrix(W_k[i - 1], 0);
-    }
-
-    // Get Diagonals for U_sigma
-    vector<vector<double>> U_sigma_diagonals = get_all_diagonals(U_sigma);
-    cout << "U_sigma Diagonal Matrix:" << endl;
-    print_full_matrix(U_sigma_diagonals, 0);
-
-    // Test ADD EPSILON
-    double epsilon = 0.00000001;
-    for (int i = 0; i < dimensionSq; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            U_sigma_diagonals[i][j] += epsilon;
-        }
-    }
-
-    // Get Diagonals for U_tau
-    vector<vector<double>> U_tau_diagonals = get_all_diagonals(U_tau);
-
-    // Test ADD EPSILON
-    for (int i = 0; i < dimensionSq; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            U_tau_diagonals[i][j] += epsilon;
-        }
-    }
-
-    // Get Diagonals for V_k
-    vector<vector<vector<double>>> V_k_diagonals(dimension - 1, vector<vector<double>>(dimensionSq, vector<double>(dimensionSq)));
-
-    for (int i = 1; i < dimension; i++)
-    {
-        V_k_diagonals[i - 1] = get_all_diagonals(V_k[i - 1]);
-    }
-
-    // Test ADD EPSILON
-    for (int i = 0; i < dimension - 1; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            for (int k = 0; k < dimensionSq; k++)
-            {
-
-                V_k_diagonals[i][j][k] += epsilon;
-            }
-        }
-    }
-
-    // Get Diagonals for W_k
-    vector<vector<vector<double>>> W_k_diagonals(dimension - 1, vector<vector<double>>(dimensionSq, vector<double>(dimensionSq)));
-
-    for (int i = 1; i < dimension; i++)
-    {
-        W_k_diagonals[i - 1] = get_all_diagonals(W_k[i - 1]);
-    }
-
-    // Test ADD EPSILON
-    for (int i = 0; i < dimension - 1; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            for (int k = 0; k < dimensionSq; k++)
-            {
-
-                W_k_diagonals[i][j][k] += epsilon;
-            }
-        }
-    }
+    // Get the non-zero diagonals of U_sigma, U_tau, V_k and W_k without building the dimensionSq x dimensionSq matrices
+    PermutationDiagonals U_sigma_diagonals = get_U_sigma_diagonals(dimension);
+    cout << "U_sigma Diagonal Matrix (non-zero diagonals):" << endl;
+    print_full_matrix(U_sigma_diagonals.values, 0);
 
     // --------------- ENCODING ----------------
-    // Encode U_sigma diagonals
-    vector<Plaintext> U_sigma_diagonals_plain(dimensionSq);
-    cout << "\nEncoding U_sigma_diagonals...";
-    for (int i = 0; i < dimensionSq; i++)
-    {
-        ckks_encoder.encode(U_sigma_diagonals[i], scale, U_sigma_diagonals_plain[i]);
-    }
+    // Encode the non-zero U_sigma, U_tau, V_k and W_k diagonals
+    cout << "\nEncoding U_sigma_diagonals, U_tau_diagonals, V_k_diagonals and W_k_diagonals...";
+    MatMulDiagonals diagonals = get_matmul_diagonals(dimension, session);
+    SparseDiagonals &U_sigma_diagonals_plain = diagonals.U_sigma;
+    cout << "Done (" << U_sigma_diagonals_plain.indices.size() << " of " << dimensionSq << " U_sigma diagonals)" << endl;
+
+    // Only create the Galois keys for matrix encoding and the linear transformations
+    vector<int> gal_steps = get_matmul_steps(diagonals);
+    vector<int> encode_steps = get_matrix_encode_steps(dimension);
+    gal_steps.insert(gal_steps.end(), encode_steps.begin(), encode_steps.end());
+    session.create_galois_keys(gal_steps);
+
+    // --------------- ENCODING AND ENCRYPTING ----------------
+    // Encode and encrypt Matrix 1
+    cout << "\nEncoding and Encrypting Matrix 1...";
+    vector<Ciphertext> cipher_matrix1_set1 = encrypt_rows(pod_matrix1_set1, session);
     cout << "Done" << endl;
 
-    // Encode U_tau diagonals
-    vector<Plaintext> U_tau_diagonals_plain(dimensionSq);
-    cout << "\nEncoding U_tau_diagonals...";
-    for (int i = 0; i < dimensionSq; i++)
-    {
-        ckks_encoder.encode(U_tau_diagonals[i], scale, U_tau_diagonals_plain[i]);
-    }
-    cout << "Done" << endl;
-
-    // Encode V_k diagonals
-    vector<vector<Plaintext>> V_k_diagonals_plain(dimension - 1, vector<Plaintext>(dimensionSq));
-    cout << "\nEncoding V_K_diagonals...";
-    for (int i = 1; i < dimension; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            ckks_encoder.encode(V_k_diagonals[i - 1][j], scale, V_k_diagonals_plain[i - 1][j]);
-        }
-    }
-    cout << "Done" << endl;
-
-    // Encode W_k
-    vector<vector<Plaintext>> W_k_diagonals_plain(dimension - 1, vector<Plaintext>(dimensionSq));
-    cout << "\nEncoding W_k_diagonals...";
-    for (int i = 1; i < dimension; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            ckks_encoder.encode(W_k_diagonals[i - 1][j], scale, W_k_diagonals_plain[i - 1][j]);
-        }
-    }
-    cout << "Done" << endl;
-
-    // Encode Matrices
-    // Encode Matrix 1
-    vector<Plaintext> plain_matrix1_set1(dimension);
-    cout << "\nEncoding Matrix 1...";
-    for (int i = 0; i < dimension; i++)
-    {
-        ckks_encoder.encode(pod_matrix1_set1[i], scale, plain_matrix1_set1[i]);
-    }
-    cout << "Done" << endl;
-
-    // Encode Matrix 2
-    vector<Plaintext> plain_matrix2_set1(dimension);
-    cout << "\nEncoding Matrix 2...";
-    for (int i = 0; i < dimension; i++)
-    {
-        ckks_encoder.encode(pod_matrix2_set1[i], scale, plain_matrix2_set1[i]);
-    }
-    cout << "Done" << endl;
-
-    // --------------- ENCRYPTING ----------------
-    // Encrypt Matrix 1
-    vector<Ciphertext> cipher_matrix1_set1(dimension);
-    cout << "\nEncrypting Matrix 1...";
-
-    for (int i = 0; i < dimension; i++)
-    {
-        encryptor.encrypt(plain_matrix1_set1[i], cipher_matrix1_set1[i]);
-    }
-    cout << "Done" << endl;
-
-    // Encrypt Matrix 2
-    vector<Ciphertext> cipher_matrix2_set1(dimension);
-    cout << "\nEncrypting Matrix 2...";
-    for (int i = 0; i < dimension; i++)
-    {
-        encryptor.encrypt(plain_matrix2_set1[i], cipher_matrix2_set1[i]);
-    }
+    // Encode and encrypt Matrix 2
+    cout << "\nEncoding and Encrypting Matrix 2...";
+    vector<Ciphertext> cipher_matrix2_set1 = encrypt_rows(pod_matrix2_set1, session);
     cout << "Done" << endl;
 
     // --------------- MATRIX ENCODING ----------------
@@ -410,7 +131,7 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
     // --------------- MATRIX MULTIPLICATION ----------------
     cout << "\nMatrix Multiplication...";
     cout << "test " << endl;
-    Ciphertext ct_result = CC_Matrix_Multiplication(cipher_encoded_matrix1_set1, cipher_encoded_matrix2_set1, dimension, U_sigma_diagonals_plain, U_tau_diagonals_plain, V_k_diagonals_plain, W_k_diagonals_plain, gal_keys, params);
+    Ciphertext ct_result = CC_Matrix_Multiplication(cipher_encoded_matrix1_set1, cipher_encoded_matrix2_set1, dimension, diagonals, session);
     cout << "Done" << endl;
 
     // --------------- DECRYPT ----------------
@@ -444,10 +165,10 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
 
     cout << "----------Step 1----------- " << endl;
     // Step 1-1
-    ctA_result[0] = Linear_Transform_Plain(cipher_encoded_matrix1_set1, U_sigma_diagonals_plain, gal_keys, params);
+    ctA_result[0] = Linear_Transform_Plain_Sparse(cipher_encoded_matrix1_set1, U_sigma_diagonals_plain, session);
 
     // Step 1-2
-    ctB_result[0] = Linear_Transform_Plain(cipher_encoded_matrix2_set1, U_tau_diagonals_plain, gal_keys, params);
+    ctB_result[0] = Linear_Transform_Plain_Sparse(cipher_encoded_matrix2_set1, U_tau_diagonals_plain, session);
 
     // TEST CTA _ RESULT [0]
     Plaintext cta_0;
@@ -489,8 +210,8 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
     for (int k = 1; k < dimension; k++)
     {
         cout << "Linear Transf at k = " << k;
-        ctA_result[k] = Linear_Transform_Plain(ctA_result[0], V_k_diagonals_plain[k - 1], gal_keys, params);
-        ctB_result[k] = Linear_Transform_Plain(ctB_result[0], W_k_diagonals_plain[k - 1], gal_keys, params);
+        ctA_result[k] = Linear_Transform_Plain_Sparse(ctA_result[0], V_k_diagonals_plain[k - 1], session);
+        ctB_result[k] = Linear_Transform_Plain_Sparse(ctB_result[0], W_k_diagonals_plain[k - 1], session);
         cout << "..... Done" << endl;
     }
 
@@ -509,21 +230,12 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
 
     evaluator.multiply(ctA_result[0], ctB_result[0], ctAB);
 
-    evaluator.mod_switch_to_next_inplace(ctAB);
-
-    // Manual scale set
-    for (int i = 1; i < dimension; i++)
-    {
-        ctA_result[i].scale() = pow(2, 80);
-        ctB_result[i].scale() = pow(2, 80);
-    }
-
     for (int k = 1; k < dimension; k++)
     {
         cout << "Iteration k = " << k << endl;
         Ciphertext temp_mul;
         evaluator.multiply(ctA_result[k], ctB_result[k], temp_mul);
-        evaluator.add_inplace(ctAB, temp_mul);
+        add_aligned_inplace(ctAB, temp_mul, session);
     }
     */
 }
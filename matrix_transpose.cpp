@@ -3,6 +3,7 @@
 #include <fstream>
 #include "seal/seal.h"
 #include "helper.h"
+#include "layout.h"
 
 using namespace std;
 using namespace seal;
@@ -21,24 +22,17 @@ void MatrixTranspose(size_t poly_modulus_degree, int dimension)
     cout << "MAX BIT COUNT: " << CoeffModulus::MaxBitCount(poly_modulus_degree) << endl;
     params.set_coeff_modulus(CoeffModulus::Create(poly_modulus_degree, {60, 40, 40, 40, 40, 60}));
     
-    SEALContext context(params);
-    auto tmp = make_shared<SEALContext>(context);
-
-    // Generate keys, encryptor, decryptor and evaluator
-    KeyGenerator keygen(context);
-    PublicKey pk;
-    keygen.create_public_key(pk);
-    SecretKey sk = keygen.secret_key();
-    GaloisKeys gal_keys;
-    keygen.create_galois_keys(gal_keys);
-    RelinKeys relin_keys;
-    keygen.create_relin_keys(relin_keys);
-    Encryptor encryptor(context, pk);
-    Evaluator evaluator(context);
-    Decryptor decryptor(context, sk);
+    // Create context, keys, encryptor, decryptor, evaluator and encoder once
+    // Galois keys are generated once the non-zero diagonals are known
+    FHESession session(params, pow(2.0, 40), KeyCache::dir_from_env());
+    GaloisKeys &gal_keys = session.gal_keys;
+    RelinKeys &relin_keys = session.relin_keys;
+    Encryptor &encryptor = session.encryptor;
+    TracedEvaluator &evaluator = session.evaluator;
+    Decryptor &decryptor = session.decryptor;
 
     // Create CKKS encoder
-    CKKSEncoder ckks_encoder(context);
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
 
     // Create Scale
     double scale = pow(2.0, 40);
@@ -46,7 +40,7 @@ void MatrixTranspose(size_t poly_modulus_degree, int dimension)
     int dimensionSq = pow(dimension, 2);
 
     // Create input matrix
-    vector<vector<double>> pod_matrix1_set1(dimension, vector<double>(dimension));
+    Matrix<double> pod_matrix1_set1(dimension, dimension);
 
     // Fill input matrices
     // double r = ((double)rand() / (RAND_MAX));
@@ -56,7 +50,7 @@ void MatrixTranspose(size_t poly_modulus_degree, int dimension)
     {
         for (int j = 0; j < dimension; j++)
         {
-            pod_matrix1_set1[i][j] = filler;
+            pod_matrix1_set1(i, j) = filler;
             filler++;
             // r = ((double)rand() / (RAND_MAX));
         }
@@ -65,64 +59,35 @@ void MatrixTranspose(size_t poly_modulus_degree, int dimension)
     cout << "Matrix 1:" << endl;
     print_full_matrix(pod_matrix1_set1, 0);
 
-    // Get U_tranposed
-    vector<vector<double>> U_transposed = get_U_transpose(pod_matrix1_set1);
+    // U_transposed has 2 * dimension - 1 non-zero diagonals, the converter encodes them once for the level of the matrix
+    cout << "\nU_tranposed: " << get_U_transpose_diagonals(dimension).indices.size() << " of " << dimensionSq << " diagonals" << endl;
 
-    cout << "\nU_tranposed:" << endl;
-    print_full_matrix(U_transposed, 0);
-
-    // Get diagonals for U_transposed
-    vector<vector<double>> U_transposed_diagonals = get_all_diagonals(U_transposed);
-
-    // Test ADD EPSILON
-    double epsilon = 0.00000001;
-    for (int i = 0; i < dimensionSq; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            U_transposed_diagonals[i][j] += epsilon;
-        }
-    }
-
-    // --------------- ENCODING ----------------
-    // Encode U_transposed_diagonals
-    vector<Plaintext> U_transposed_diagonals_plain(dimensionSq);
-    cout << "\nEncoding U_tranposed_diagonals...";
-    for (int i = 0; i < dimensionSq; i++)
-    {
-        ckks_encoder.encode(U_transposed_diagonals[i], scale, U_transposed_diagonals_plain[i]);
-    }
-    cout << "Done" << endl;
-
-    // Encode Matrix 1
-    vector<Plaintext> plain_matrix1_set1(dimension);
-    cout << "\nEncoding Matrix 1...";
-    for (int i = 0; i < dimension; i++)
-    {
-        ckks_encoder.encode(pod_matrix1_set1[i], scale, plain_matrix1_set1[i]);
-    }
-    cout << "Done" << endl;
-
-    // --------------- ENCRYPTING ----------------
-    // Encrypt Matrix 1
-    vector<Ciphertext> cipher_matrix1_set1(dimension);
-    cout << "\nEncrypting Matrix 1...";
+    // Size of the dummy matrix, its rows are the inputs of the dot product test
+    int coldim = 4;
+    int rowdim = 3;
 
-    for (int i = 0; i < dimension; i++)
-    {
-        encryptor.encrypt(plain_matrix1_set1[i], cipher_matrix1_set1[i]);
-    }
+    // Only create the Galois keys for the layout conversions and the dot product test
+    vector<int> gal_steps = LayoutConverter::get_steps(dimension);
+    vector<int> dot_product_steps = get_dot_product_steps(coldim);
+    gal_steps.insert(gal_steps.end(), dot_product_steps.begin(), dot_product_steps.end());
+    session.create_galois_keys(gal_steps);
+    LayoutConverter layout(session);
+
+    // --------------- ENCODING AND ENCRYPTING ----------------
+    // Encode and encrypt Matrix 1
+    cout << "\nEncoding and Encrypting Matrix 1...";
+    vector<Ciphertext> cipher_matrix1_set1 = encrypt_rows(pod_matrix1_set1, session);
     cout << "Done" << endl;
 
     // --------------- MATRIX ENCODING ----------------
     // Matrix Encode Matrix 1
     cout << "\nMatrix Encoding Matrix 1...";
-    Ciphertext cipher_encoded_matrix1_set1 = C_Matrix_Encode(cipher_matrix1_set1, gal_keys, evaluator);
+    Ciphertext cipher_encoded_matrix1_set1 = layout.rows_to_packed(cipher_matrix1_set1);
     cout << "Done" << endl;
 
     // --------------- MATRIX TRANSPOSING ----------------
     cout << "\nMatrix Transposition...";
-    Ciphertext ct_result = Linear_Transform_Plain(cipher_encoded_matrix1_set1, U_transposed_diagonals_plain, gal_keys, params);
+    Ciphertext ct_result = layout.transpose(cipher_encoded_matrix1_set1, dimension);
     cout << "Done" << endl;
 
     // --------------- DECRYPT ----------------
@@ -151,7 +116,7 @@ void MatrixTranspose(size_t poly_modulus_degree, int dimension)
 
     // Test Matrix DECODE
     cout << "\nMATRIX DECODING... ";
-    vector<Ciphertext> ct_decoded_vec = C_Matrix_Decode(ct_result, dimension, scale, gal_keys, ckks_encoder, evaluator);
+    vector<Ciphertext> ct_decoded_vec = layout.packed_to_rows(ct_result, dimension);
     cout << "Done" << endl;
 
     // DECRYPT and DECODE
@@ -169,24 +134,38 @@ void MatrixTranspose(size_t poly_modulus_degree, int dimension)
         cout << "]" << endl;
     }
 
+    // Test the diagonal layout: ciphertext l holds the diagonal l of Matrix 1 (the input of Linear_Transform_Cipher)
+    cout << "\nROWS TO DIAGONALS... ";
+    vector<Ciphertext> ct_diagonals = layout.rows_to_diagonals(cipher_matrix1_set1);
+    cout << "Done" << endl;
+
+    double max_error = 0;
+    for (int l = 0; l < dimension; l++)
+    {
+        Plaintext pt_diagonal;
+        decryptor.decrypt(ct_diagonals[l], pt_diagonal);
+        vector<double> diagonal;
+        ckks_encoder.decode(pt_diagonal, diagonal);
+        vector<double> expected = get_diagonal(l, pod_matrix1_set1);
+        for (int i = 0; i < dimension; i++)
+        {
+            max_error = max(max_error, abs(diagonal[i] - expected[i]));
+        }
+    }
+    cout << "Max error against get_diagonal: " << max_error << endl;
+
     // Dummy Diagonal test
     cout << "\n----------------DUMMY TEST-----------------\n"
          << endl;
-    int coldim = 4;
-    int rowdim = 3;
-    vector<vector<double>> dummy_matrix(rowdim, vector<double>(coldim));
     vector<double> row_0 = {1, 2, 3, 4};
     vector<double> row_1 = {5, 6, 7, 8};
     vector<double> row_2 = {9, 10, 11, 12};
-
-    dummy_matrix[0] = row_0;
-    dummy_matrix[1] = row_1;
-    dummy_matrix[2] = row_2;
+    Matrix<double> dummy_matrix({row_0, row_1, row_2});
 
     cout << "Dummy matrix:" << endl;
     print_full_matrix(dummy_matrix);
 
-    vector<vector<double>> dummy_diagonals = get_all_diagonals(dummy_matrix);
+    Matrix<double> dummy_diagonals = get_all_diagonals(dummy_matrix);
     cout << "\nDummy matrix diagonals:" << endl;
 
     print_full_matrix(dummy_diagonals);
@@ -214,7 +193,7 @@ void MatrixTranspose(size_t poly_modulus_degree, int dimension)
     Ciphertext ct_1;
     encryptor.encrypt(pt_1, ct_1);
 
-    Ciphertext dot_prod_ct = cipher_dot_product(ct_0, ct_1, 4, relin_keys, gal_keys, evaluator);
+    Ciphertext dot_prod_ct = cipher_dot_product(ct_0, ct_1, coldim, relin_keys, gal_keys, evaluator);
 
     Plaintext dot_prod_pt;
     decryptor.decrypt(dot_prod_ct, dot_prod_pt);
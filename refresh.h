@@ -0,0 +1,186 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <mutex>
+#include "seal/seal.h"
+#include "helper.h"
+
+using namespace std;
+using namespace seal;
+
+// Client side of the refresh, the only place that needs the secret key
+// Decrypts a ciphertext that ran out of levels and encrypts its first count values again at the first level with the scale of the session.
+// relayout builds the slots from these values when the layout is not just the values (e.g. the replicated packed weights)
+class RefreshClient
+{
+public:
+    RefreshClient(FHESession &session, int count, function<vector<double>(const vector<double> &)> relayout = nullptr)
+        : session(session), count(count), relayout(relayout)
+    {
+    }
+
+    Ciphertext refresh(const Ciphertext &ct)
+    {
+        Plaintext pt;
+        session.decryptor.decrypt(ct, pt);
+        vector<double> values;
+        session.ckks_encoder.decode(pt, values);
+        values.resize(count);
+
+        session.ckks_encoder.encode(relayout ? relayout(values) : values, session.scale, pt);
+        Ciphertext refreshed;
+        session.encryptor.encrypt(pt, refreshed);
+
+        lock_guard<mutex> lock(values_mutex);
+        latest = move(values);
+        return refreshed;
+    }
+
+    // Handler for a SerializedRefreshTransport: serialized ciphertext in, serialized refreshed ciphertext out
+    string handle(const string &request)
+    {
+        istringstream in(request, ios::binary);
+        Ciphertext ct;
+        ct.load(session.context, in);
+        return save_to_string(refresh(ct));
+    }
+
+    // Values of the last refreshed ciphertext, for logging (they were decoded anyway, nothing is decrypted here)
+    vector<double> latest_values()
+    {
+        lock_guard<mutex> lock(values_mutex);
+        return latest;
+    }
+
+private:
+    FHESession &session;
+    int count;
+    function<vector<double>(const vector<double> &)> relayout;
+    mutex values_mutex;
+    vector<double> latest;
+};
+
+// How the server gets a ciphertext refreshed by the client
+class RefreshTransport
+{
+public:
+    virtual ~RefreshTransport()
+    {
+    }
+
+    virtual Ciphertext refresh(const Ciphertext &ct) = 0;
+};
+
+// Client in the same process as the server (the setup of the examples)
+class LocalRefreshTransport : public RefreshTransport
+{
+public:
+    LocalRefreshTransport(RefreshClient &client) : client(client)
+    {
+    }
+
+    Ciphertext refresh(const Ciphertext &ct) override
+    {
+        return client.refresh(ct);
+    }
+
+private:
+    RefreshClient &client;
+};
+
+// Client behind a byte channel: send gets the compressed ciphertext and returns the compressed refreshed one
+// (a socket, a message queue or, for testing the round trip, RefreshClient::handle)
+class SerializedRefreshTransport : public RefreshTransport
+{
+public:
+    SerializedRefreshTransport(const SEALContext &context, function<string(const string &)> send) : context(context), send(send)
+    {
+    }
+
+    Ciphertext refresh(const Ciphertext &ct) override
+    {
+        string request = save_to_string(ct);
+        string reply = send(request);
+        bytes_sent += request.size();
+        bytes_received += reply.size();
+
+        istringstream in(reply, ios::binary);
+        Ciphertext refreshed;
+        refreshed.load(context, in);
+        return refreshed;
+    }
+
+    atomic<size_t> bytes_sent{0};
+    atomic<size_t> bytes_received{0};
+
+private:
+    const SEALContext &context;
+    function<string(const string &)> send;
+};
+
+// Runs refreshes in the background so the server can keep computing while the client refreshes
+class AsyncRefresher
+{
+public:
+    AsyncRefresher(RefreshTransport &transport) : transport(transport)
+    {
+    }
+
+    future<Ciphertext> submit(const Ciphertext &ct)
+    {
+        return async(launch::async, [this, ct]() { return transport.refresh(ct); });
+    }
+
+private:
+    RefreshTransport &transport;
+};
+
+// Gradient descent with a refresh after every step
+// gradient(w, i) returns the scaled gradient of step i to subtract from the fresh weights w (the steps of a mini-batch
+// schedule use different batches, see train_cipher_sgd).
+// Without pipelining every step waits for its refresh: w_i+1 = refresh(w_i - gradient(w_i, i)).
+// With pipelining the server computes the next gradient from the weights it already has while the client refreshes,
+// which hides the refresh latency behind the gradient but uses gradients one step old (delayed gradient descent):
+// w_i+1 = refresh(w_i - gradient(w_i-1, i)), the first two steps both use w_0.
+// The gradient of step 0 is then reused for step 1 unless same_gradient(1) is false (a different batch or learning rate),
+// without same_gradient the gradient doesn't depend on its step.
+// on_iteration(i) is called once w_i+1 is refreshed (e.g. to log RefreshClient::latest_values or compute the cost from them),
+// training stops with w_i+1 when it returns false
+Ciphertext train_with_refresh(const Ciphertext &weights, int iters, function<Ciphertext(const Ciphertext &, int)> gradient, RefreshTransport &transport, FHESession &session, bool pipelined = false, function<bool(int)> on_iteration = nullptr, function<bool(int)> same_gradient = nullptr)
+{
+    AsyncRefresher refresher(transport);
+    Ciphertext fresh_weights = weights;
+    Ciphertext step_gradient = gradient(fresh_weights, 0);
+
+    for (int i = 0; i < iters; i++)
+    {
+        Ciphertext new_weights = fresh_weights;
+        sub_aligned_inplace(new_weights, step_gradient, session);
+        future<Ciphertext> refreshed = refresher.submit(new_weights);
+
+        bool more = i + 1 < iters;
+        if (pipelined && more && (i > 0 || (same_gradient && !same_gradient(1))))
+        {
+            step_gradient = gradient(fresh_weights, i + 1);
+        }
+
+        fresh_weights = refreshed.get();
+        if (on_iteration && !on_iteration(i))
+        {
+            break;
+        }
+
+        if (!pipelined && more)
+        {
+            step_gradient = gradient(fresh_weights, i + 1);
+        }
+    }
+
+    return fresh_weights;
+}
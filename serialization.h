@@ -0,0 +1,423 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <algorithm>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include "seal/seal.h"
+#include "csv.h"
+
+using namespace std;
+using namespace seal;
+
+// Saves a SEAL object (Ciphertext, keys, EncryptionParameters or their Serializable versions) to a file, returns the bytes written
+// The default compression is zstd or zlib, whichever SEAL was built with
+template <typename T>
+size_t save_to_file(const T &object, const string &path, compr_mode_type compr_mode = Serialization::compr_mode_default)
+{
+    ofstream out(path, ios::binary);
+    if (!out)
+    {
+        cerr << "Couldn't open file: " << path << endl;
+        exit(1);
+    }
+
+    return object.save(out, compr_mode);
+}
+
+// Loads a SEAL object saved by save_to_file, Serializable objects are loaded as the object they wrap
+template <typename T>
+void load_from_file(T &object, const SEALContext &context, const string &path)
+{
+    ifstream in(path, ios::binary);
+    if (!in)
+    {
+        cerr << "Couldn't open file: " << path << endl;
+        exit(1);
+    }
+
+    object.load(context, in);
+}
+
+// The server builds its context from the parameters of the client
+inline EncryptionParameters load_parameters(const string &path)
+{
+    ifstream in(path, ios::binary);
+    if (!in)
+    {
+        cerr << "Couldn't open file: " << path << endl;
+        exit(1);
+    }
+
+    EncryptionParameters params;
+    params.load(in);
+    return params;
+}
+
+// Serializes a SEAL object into a string (e.g. to compress several of them in parallel before writing them in order)
+template <typename T>
+string save_to_string(const T &object, compr_mode_type compr_mode = Serialization::compr_mode_default)
+{
+    ostringstream out(ios::binary);
+    object.save(out, compr_mode);
+    return out.str();
+}
+
+// File layout of a ciphertext bundle:
+// magic, version, count, index_offset, then the serialized ciphertexts one after the other,
+// then at index_offset the index with (offset, size) of every ciphertext.
+// The index is written last so ciphertexts can be streamed in without knowing their number or size up front
+const uint32_t bundle_magic = 0x4e424548; // "HEBN"
+const uint32_t bundle_version = 1;
+
+// Streams ciphertexts into a bundle file, the index is written by close (or the destructor)
+class CiphertextBundleWriter
+{
+public:
+    CiphertextBundleWriter(const string &path, compr_mode_type compr_mode = Serialization::compr_mode_default) : path(path), compr_mode(compr_mode), out(path, ios::binary)
+    {
+        if (!out)
+        {
+            cerr << "Couldn't open file: " << path << endl;
+            exit(1);
+        }
+
+        // Placeholder header, count and index_offset are patched by close
+        uint64_t count = 0;
+        uint64_t index_offset = 0;
+        out.write(reinterpret_cast<const char *>(&bundle_magic), sizeof(bundle_magic));
+        out.write(reinterpret_cast<const char *>(&bundle_version), sizeof(bundle_version));
+        out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+        out.write(reinterpret_cast<const char *>(&index_offset), sizeof(index_offset));
+    }
+
+    ~CiphertextBundleWriter()
+    {
+        close();
+    }
+
+    CiphertextBundleWriter(const CiphertextBundleWriter &) = delete;
+    CiphertextBundleWriter &operator=(const CiphertextBundleWriter &) = delete;
+
+    // Appends a Ciphertext or a Serializable<Ciphertext> (seeded, from encrypt_symmetric)
+    template <typename T>
+    void add(const T &ct)
+    {
+        add_serialized(save_to_string(ct, compr_mode));
+    }
+
+    // Appends a ciphertext already serialized with save_to_string
+    void add_serialized(const string &bytes)
+    {
+        lock_guard<mutex> lock(writer_mutex);
+        index.push_back({(uint64_t)out.tellp(), (uint64_t)bytes.size()});
+        out.write(bytes.data(), bytes.size());
+    }
+
+    int size() const
+    {
+        return index.size();
+    }
+
+    void close()
+    {
+        lock_guard<mutex> lock(writer_mutex);
+        if (!out.is_open())
+        {
+            return;
+        }
+
+        uint64_t count = index.size();
+        uint64_t index_offset = out.tellp();
+        out.write(reinterpret_cast<const char *>(index.data()), index.size() * sizeof(BundleEntry));
+        out.seekp(sizeof(bundle_magic) + sizeof(bundle_version));
+        out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+        out.write(reinterpret_cast<const char *>(&index_offset), sizeof(index_offset));
+        out.close();
+        if (!out)
+        {
+            cerr << "Couldn't write bundle: " << path << endl;
+            exit(1);
+        }
+    }
+
+private:
+    struct BundleEntry
+    {
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    string path;
+    compr_mode_type compr_mode;
+    ofstream out;
+    vector<BundleEntry> index;
+    mutex writer_mutex;
+};
+
+// Random access to the ciphertexts of a bundle, load can be called from several threads
+// Only the read of the serialized bytes is serialized, decompression and parsing run in the calling thread
+class CiphertextBundleReader
+{
+public:
+    CiphertextBundleReader(const string &path, const SEALContext &context) : path(path), context(context), in(path, ios::binary)
+    {
+        if (!in)
+        {
+            cerr << "Couldn't open file: " << path << endl;
+            exit(1);
+        }
+
+        uint32_t magic;
+        uint32_t version;
+        uint64_t count;
+        uint64_t index_offset;
+        in.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+        in.read(reinterpret_cast<char *>(&version), sizeof(version));
+        in.read(reinterpret_cast<char *>(&count), sizeof(count));
+        in.read(reinterpret_cast<char *>(&index_offset), sizeof(index_offset));
+        if (!in || magic != bundle_magic || version != bundle_version || index_offset == 0)
+        {
+            cerr << path << " is not a ciphertext bundle (or was not closed)" << endl;
+            exit(1);
+        }
+
+        index.resize(count);
+        in.seekg(index_offset);
+        in.read(reinterpret_cast<char *>(index.data()), count * sizeof(BundleEntry));
+        if (!in)
+        {
+            cerr << "Couldn't read the index of bundle: " << path << endl;
+            exit(1);
+        }
+    }
+
+    int size() const
+    {
+        return index.size();
+    }
+
+    // Compressed size of ciphertext i in bytes
+    size_t entry_size(int i) const
+    {
+        return index[i].size;
+    }
+
+    Ciphertext load(int i)
+    {
+        if (i < 0 || i >= size())
+        {
+            cerr << "Bundle " << path << " has " << size() << " ciphertexts, no ciphertext " << i << endl;
+            exit(1);
+        }
+
+        string bytes(index[i].size, '\0');
+        {
+            lock_guard<mutex> lock(reader_mutex);
+            in.seekg(index[i].offset);
+            in.read(&bytes[0], bytes.size());
+            if (!in)
+            {
+                cerr << "Couldn't read ciphertext " << i << " of bundle: " << path << endl;
+                exit(1);
+            }
+        }
+
+        istringstream ct_in(bytes, ios::binary);
+        Ciphertext ct;
+        ct.load(context, ct_in);
+        return ct;
+    }
+
+private:
+    struct BundleEntry
+    {
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    string path;
+    const SEALContext &context;
+    ifstream in;
+    vector<BundleEntry> index;
+    mutex reader_mutex;
+};
+
+// On-disk cache of the keys of a session, so that short runs load their keys instead of generating them
+// The keys of one set of encryption parameters live in <dir>/<hex of their parms_id> (SEAL's hash of the parameters):
+// secret, public, relin and galois_<hash of the steps> (galois_all for the power-of-two steps).
+// They are saved uncompressed and loaded from a memory mapping (MappedFile). SEAL checks that a loaded key is valid for the context,
+// a key for another parms_id or a file that doesn't load is a miss and the key is generated (and saved) again.
+// The cache holds the secret key: the directory and its files are only accessible by their owner
+class KeyCache
+{
+public:
+    // An empty dir disables the cache
+    KeyCache(const string &dir, const EncryptionParameters &params) : dir(dir.empty() ? "" : dir + "/" + get_fingerprint(params.parms_id()))
+    {
+    }
+
+    // Directory of the cache from HE_KEY_CACHE, empty (no cache) if it isn't set
+    static string dir_from_env()
+    {
+        const char *value = getenv("HE_KEY_CACHE");
+        return value ? value : "";
+    }
+
+    static string get_fingerprint(const parms_id_type &parms_id)
+    {
+        string result;
+        for (uint64_t word : parms_id)
+        {
+            result += to_hex(word);
+        }
+
+        return result;
+    }
+
+    // Name of the Galois keys for these steps (FNV-1a of the sorted steps)
+    static string get_galois_name(vector<int> steps)
+    {
+        sort(steps.begin(), steps.end());
+        steps.erase(unique(steps.begin(), steps.end()), steps.end());
+        uint64_t hash = 14695981039346656037ULL;
+        for (int step : steps)
+        {
+            hash = (hash ^ (uint32_t)step) * 1099511628211ULL;
+        }
+
+        return "galois_" + to_hex(hash);
+    }
+
+    bool enabled() const
+    {
+        return !dir.empty();
+    }
+
+    bool contains(const string &name) const
+    {
+        return enabled() && filesystem::exists(get_path(name));
+    }
+
+    // Loads a cached key, false if it is missing or doesn't belong to this context
+    template <typename T>
+    bool load(T &key, const SEALContext &context, const string &name) const
+    {
+        if (!contains(name))
+        {
+            return false;
+        }
+
+        MappedFile file(get_path(name));
+        try
+        {
+            key.load(context, reinterpret_cast<const seal_byte *>(file.begin()), file.end() - file.begin());
+        }
+        catch (const exception &e)
+        {
+            cerr << "Ignoring cached key " << get_path(name) << ": " << e.what() << endl;
+            return false;
+        }
+
+        return key.parms_id() == context.key_parms_id();
+    }
+
+    // Starts the cache of these parameters with a new secret key
+    // With replace_stale the cached secret key exists but didn't load (a corrupt file or another SEAL version): its directory
+    // is moved aside and removed, since none of its keys belong to the new secret key. Without it the keys of a directory
+    // without a secret key are removed.
+    // The directory is built under a temporary name and renamed, so of several runs that start cold at the same time only
+    // the first one publishes its secret key. The cache is disabled for the others, which keep their own keys
+    void create(const SecretKey &secret_key, bool replace_stale = false)
+    {
+        if (!enabled())
+        {
+            return;
+        }
+
+        error_code error;
+        if (replace_stale)
+        {
+            string stale_dir = dir + ".stale" + to_string(getpid());
+            if (rename(dir.c_str(), stale_dir.c_str()) == 0)
+            {
+                cerr << "Replacing the key cache of an unreadable secret key: " << dir << endl;
+                filesystem::remove_all(stale_dir, error);
+            }
+        }
+        else if (!contains("secret"))
+        {
+            filesystem::remove_all(dir, error);
+        }
+        filesystem::create_directories(filesystem::path(dir).parent_path(), error);
+
+        string tmp_dir = dir + ".tmp" + to_string(getpid());
+        filesystem::create_directory(tmp_dir, error);
+        filesystem::permissions(tmp_dir, filesystem::perms::owner_all, error);
+        if (!write_file(tmp_dir + "/secret", save_to_string(secret_key, compr_mode_type::none)) || rename(tmp_dir.c_str(), dir.c_str()) != 0)
+        {
+            filesystem::remove_all(tmp_dir, error);
+            dir = "";
+        }
+    }
+
+    // Saves a key through a temporary file that is renamed, so that concurrent runs never load a partial file
+    // A cache that can't be written only costs the next run its warm start
+    template <typename T>
+    void save(const T &key, const string &name) const
+    {
+        if (!enabled())
+        {
+            return;
+        }
+
+        string path = get_path(name);
+        string tmp_path = path + ".tmp" + to_string(getpid());
+        if (!write_file(tmp_path, save_to_string(key, compr_mode_type::none)) || rename(tmp_path.c_str(), path.c_str()) != 0)
+        {
+            cerr << "Couldn't write cached key: " << path << endl;
+            remove(tmp_path.c_str());
+        }
+    }
+
+private:
+    string dir;
+
+    static string to_hex(uint64_t word)
+    {
+        static const char *digits = "0123456789abcdef";
+        string result;
+        for (int shift = 60; shift >= 0; shift -= 4)
+        {
+            result += digits[(word >> shift) & 0xf];
+        }
+
+        return result;
+    }
+
+    // Writes a file only its owner can read
+    static bool write_file(const string &path, const string &bytes)
+    {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0)
+        {
+            return false;
+        }
+        bool written = write(fd, bytes.data(), bytes.size()) == (ssize_t)bytes.size();
+        return close(fd) == 0 && written;
+    }
+
+    string get_path(const string &name) const
+    {
+        return dir + "/" + name;
+    }
+};
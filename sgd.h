@@ -0,0 +1,132 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <numeric>
+#include <random>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+// Mini-batch schedule of the plaintext (logistic_regression.cpp) and the encrypted (logistic_regression_ckks.h) training
+struct SGDOptions
+{
+    // Observations per step, 0 = all of them (full-batch gradient descent)
+    int batch_size = 0;
+    // Visit the batches in a new random order every epoch
+    bool shuffle = true;
+    unsigned seed = 1;
+    // The learning rate of epoch e is learning_rate / (1 + decay * e)
+    double decay = 0;
+    // Cost every cost_every steps (0 = never)
+    int cost_every = 1;
+    // Stop once the cost improved by less than tolerance (relative to the previous cost) patience times in a row, 0 = never stop early
+    double tolerance = 0;
+    int patience = 2;
+};
+
+// Which observations every step uses, with which learning rate, and when training has converged
+// The schedule works on units: single observations for the plaintext training, groups of observations that are encrypted
+// together for the encrypted one (they can't be regrouped without encrypting them again). A mini-batch is
+// max(1, batch_size / unit_size) consecutive units of the order of its epoch, and every unit is used once per epoch.
+// The batches of a step only depend on the step, so a pipelined training can ask for the next batch early
+class SGDSchedule
+{
+public:
+    SGDSchedule(int num_units, int unit_size, double learning_rate, const SGDOptions &options = SGDOptions())
+        : num_units(num_units), learning_rate(learning_rate), options(options)
+    {
+        if (num_units < 1 || unit_size < 1 || options.batch_size < 0 || options.cost_every < 0 || options.patience < 1)
+        {
+            cerr << "Invalid mini-batch schedule: " << num_units << " units of " << unit_size << " observations, batch size " << options.batch_size << endl;
+            exit(1);
+        }
+
+        units_per_batch = options.batch_size == 0 ? num_units : min(num_units, max(1, options.batch_size / unit_size));
+    }
+
+    int steps_per_epoch() const
+    {
+        return (num_units + units_per_batch - 1) / units_per_batch;
+    }
+
+    bool is_full_batch() const
+    {
+        return units_per_batch == num_units;
+    }
+
+    // Units of the mini-batch of step
+    // The order of the latest epoch is kept, so the steps of an epoch only shuffle once
+    vector<int> get_batch(int step) const
+    {
+        int epoch = step / steps_per_epoch();
+        if (epoch != order_epoch)
+        {
+            order.resize(num_units);
+            iota(order.begin(), order.end(), 0);
+            if (options.shuffle && !is_full_batch())
+            {
+                mt19937 generator(options.seed + epoch);
+                shuffle(order.begin(), order.end(), generator);
+            }
+            order_epoch = epoch;
+        }
+
+        int begin = (step % steps_per_epoch()) * units_per_batch;
+        int end = min(num_units, begin + units_per_batch);
+        return vector<int>(order.begin() + begin, order.begin() + end);
+    }
+
+    double get_learning_rate(int step) const
+    {
+        return learning_rate / (1 + options.decay * (step / steps_per_epoch()));
+    }
+
+    // Whether step and other use the same batch with the same learning rate (their gradients of the same weights are equal)
+    bool same_gradient(int step, int other) const
+    {
+        return get_learning_rate(step) == get_learning_rate(other) && get_batch(step) == get_batch(other);
+    }
+
+    // Whether the cost of the weights after step is wanted
+    bool is_cost_step(int step) const
+    {
+        return options.cost_every > 0 && (step + 1) % options.cost_every == 0;
+    }
+
+    // Records the cost of the weights after step, returns true once training has converged
+    bool record_cost(int step, double cost)
+    {
+        if (options.tolerance > 0 && !costs.empty())
+        {
+            double previous = costs.back().second;
+            bool improved = previous - cost > options.tolerance * abs(previous);
+            stalled = improved ? 0 : stalled + 1;
+        }
+        costs.push_back({step, cost});
+
+        return converged();
+    }
+
+    bool converged() const
+    {
+        return options.tolerance > 0 && stalled >= options.patience;
+    }
+
+    // (step, cost) of every recorded cost
+    const vector<pair<int, double>> &get_costs() const
+    {
+        return costs;
+    }
+
+private:
+    int num_units;
+    int units_per_batch;
+    double learning_rate;
+    SGDOptions options;
+    vector<pair<int, double>> costs;
+    int stalled = 0;
+    mutable vector<int> order;
+    mutable int order_epoch = -1;
+};
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <atomic>
+#include <functional>
+#include <future>
+#include "seal/seal.h"
+#include "helper.h"
+#include "refresh.h"
+#include "logistic_regression_ckks.h"
+
+using namespace std;
+using namespace seal;
+
+// Data-parallel training
+// Every shard holds part of the encrypted observations and returns its partial gradient for the weights it is sent,
+// already scaled by learning_rate / (observations of all shards), so the partial gradients of the shards add up to the full gradient.
+// The coordinator broadcasts the weights, sums the partial gradients and applies the update (train_sharded)
+
+// Partial gradient of one shard for the given weights, computed where the shard is stored
+using PartialGradient = function<Ciphertext(const Ciphertext &)>;
+
+// Shard of unpacked observations: its rows, the transpose of its rows and its labels
+PartialGradient make_shard(const vector<Ciphertext> &features, const vector<Ciphertext> &features_T, const Ciphertext &labels, float learning_rate, int total_observations, FHESession &session, const LROptions &options = LROptions())
+{
+    return [&features, &features_T, &labels, learning_rate, total_observations, &session, options](const Ciphertext &weights) {
+        return local_gradient_cipher(features, features_T, labels, weights, learning_rate, total_observations, session, options);
+    };
+}
+
+// Shard of packed batches
+PartialGradient make_packed_shard(const vector<vector<Ciphertext>> &features_diagonals, const vector<vector<Ciphertext>> &features_T_diagonals, const vector<Ciphertext> &labels, float learning_rate, int total_observations, FHESession &session, const LROptions &options = LROptions())
+{
+    return [&features_diagonals, &features_T_diagonals, &labels, learning_rate, total_observations, &session, options](const Ciphertext &weights) {
+        return gradient_cipher_packed(features_diagonals, features_T_diagonals, labels, weights, total_observations, learning_rate, session, options);
+    };
+}
+
+// How the coordinator reaches a shard
+class ShardTransport
+{
+public:
+    virtual ~ShardTransport()
+    {
+    }
+
+    virtual Ciphertext partial_gradient(const Ciphertext &weights) = 0;
+};
+
+// Shard in the process of the coordinator
+class LocalShardTransport : public ShardTransport
+{
+public:
+    LocalShardTransport(PartialGradient gradient) : gradient(gradient)
+    {
+    }
+
+    Ciphertext partial_gradient(const Ciphertext &weights) override
+    {
+        return gradient(weights);
+    }
+
+private:
+    PartialGradient gradient;
+};
+
+// Worker side of a remote shard: serialized weights in, serialized partial gradient out
+// The worker needs the parameters and the evaluation keys of the client (FHESession::save_server_keys), never the secret key
+class ShardWorker
+{
+public:
+    ShardWorker(const SEALContext &context, PartialGradient gradient) : context(context), gradient(gradient)
+    {
+    }
+
+    string handle(const string &request)
+    {
+        istringstream in(request, ios::binary);
+        Ciphertext weights;
+        weights.load(context, in);
+        return save_to_string(gradient(weights));
+    }
+
+private:
+    const SEALContext &context;
+    PartialGradient gradient;
+};
+
+// Shard behind a byte channel: send gets the compressed weights and returns the compressed partial gradient
+// (a socket, MPI or, for testing the round trip, ShardWorker::handle)
+class SerializedShardTransport : public ShardTransport
+{
+public:
+    SerializedShardTransport(const SEALContext &context, function<string(const string &)> send) : context(context), send(send)
+    {
+    }
+
+    Ciphertext partial_gradient(const Ciphertext &weights) override
+    {
+        string request = save_to_string(weights);
+        string reply = send(request);
+        bytes_sent += request.size();
+        bytes_received += reply.size();
+
+        istringstream in(reply, ios::binary);
+        Ciphertext gradient;
+        gradient.load(context, in);
+        return gradient;
+    }
+
+    atomic<size_t> bytes_sent{0};
+    atomic<size_t> bytes_received{0};
+
+private:
+    const SEALContext &context;
+    function<string(const string &)> send;
+};
+
+// Sends the weights to every shard at once and sums their partial gradients homomorphically
+class ShardCoordinator
+{
+public:
+    ShardCoordinator(const vector<ShardTransport *> &shards, FHESession &session) : shards(shards), session(session)
+    {
+        if (shards.empty())
+        {
+            cerr << "A sharded training needs at least one shard" << endl;
+            exit(1);
+        }
+    }
+
+    Ciphertext gradient(const Ciphertext &weights)
+    {
+        TraceScope trace_scope(__func__);
+
+        // Shards in this process record their operations at the call site of the coordinator
+        string trace_site = EvaluatorTrace::current_site();
+        vector<future<Ciphertext>> partials;
+        for (ShardTransport *shard : shards)
+        {
+            partials.push_back(async(launch::async, [shard, &weights, trace_site]() {
+                TraceScope shard_scope(trace_site, true);
+                return shard->partial_gradient(weights);
+            }));
+        }
+
+        // Summed as they arrive in shard order, every partial gradient has the same level and scale
+        Ciphertext sum = partials[0].get();
+        for (int s = 1; s < partials.size(); s++)
+        {
+            add_aligned_inplace(sum, partials[s].get(), session);
+        }
+
+        return sum;
+    }
+
+    int size() const
+    {
+        return shards.size();
+    }
+
+private:
+    vector<ShardTransport *> shards;
+    FHESession &session;
+};
+
+// Gradient descent over every shard: w_i+1 = refresh(w_i - sum_s partial_gradient_s(w_i))
+// The refreshed weights are broadcast to the shards in the next step, options.pipelined overlaps the refresh as in train_with_refresh
+Ciphertext train_sharded(const Ciphertext &weights, int iters, ShardCoordinator &coordinator, FHESession &session, RefreshTransport &transport, const LROptions &options = LROptions(), function<bool(int)> on_iteration = nullptr)
+{
+    TraceScope trace_scope(__func__);
+
+    auto gradient = [&](const Ciphertext &current_weights, int) {
+        return coordinator.gradient(current_weights);
+    };
+
+    return train_with_refresh(weights, iters, gradient, transport, session, options.pipelined, on_iteration);
+}
+
+// Splits count items (rows or packed batches) into num_shards contiguous ranges [begin, end) of sizes that differ by at most one
+vector<pair<int, int>> get_shard_ranges(int count, int num_shards)
+{
+    if (num_shards < 1 || num_shards > count)
+    {
+        cerr << "Can't split " << count << " rows or batches into " << num_shards << " shards" << endl;
+        exit(1);
+    }
+
+    vector<pair<int, int>> ranges;
+    for (int s = 0; s < num_shards; s++)
+    {
+        ranges.push_back({(int)((long long)count * s / num_shards), (int)((long long)count * (s + 1) / num_shards)});
+    }
+
+    return ranges;
+}